@@ -0,0 +1,391 @@
+/* This file is dedicated to the public domain. */
+
+/*
+ * Micro-benchmarks for the bits of build that run once per task or once per
+ * string, so that work on them can be measured rather than guessed at. Run it
+ * from the base directory of some real project that's been built at least
+ * once:
+ *
+ *   build/<your config>/bench/micro [-t ms] [benchmark...]
+ *
+ * Everything is fed from that project's .builddb (which is only read, never
+ * written), so the strings, paths and argvs are the ones real builds deal with.
+ * Each benchmark makes passes over its corpus for at least -t milliseconds
+ * (500 by default) after one untimed pass to warm up, then gives the average
+ * time per operation and, if the linker was able to wrap malloc() and friends
+ * (see scripts/micro.target), how many allocations each operation made.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <errmsg.h>
+#include <intdefs.h>
+#include <noreturn.h>
+#include <opt.h>
+#include <str.h>
+#include <vec.h>
+
+#include "../src/db.h"
+#include "../src/defs.h"
+#include "../src/desc.h"
+#include "../src/fpath.h"
+#include "../src/ipcserver.h"
+#include "../src/time.h"
+
+USAGE("[-t ms] [benchmark...]");
+
+// from db-strpool.c (no header, see db.c)
+uint strpool_getidx(const char *s);
+
+static ulong nallocs = 0;
+
+#ifdef COUNT_ALLOCS
+// the linker points every call to these (outside of libc itself) here instead
+void *__real_malloc(size_t sz);
+void *__real_calloc(size_t n, size_t sz);
+void *__real_realloc(void *p, size_t sz);
+void *__wrap_malloc(size_t sz) { ++nallocs; return __real_malloc(sz); }
+void *__wrap_calloc(size_t n, size_t sz) {
+	++nallocs;
+	return __real_calloc(n, sz);
+}
+void *__wrap_realloc(void *p, size_t sz) {
+	++nallocs;
+	return __real_realloc(p, sz);
+}
+#endif
+
+static noreturn diemem(void) {
+	errmsg_die(100, msg_fatal, "couldn't allocate memory");
+}
+
+struct task { struct task_desc desc; struct db_taskresult *r; };
+struct vec_task VEC(struct task);
+static struct vec_task tasks = {0};
+
+// every occurrence of every string in the db - argv entries, workdirs and
+// infile paths - as interned, and again as uninterned copies of the same
+struct vec_str VEC(const char *);
+static struct vec_str strs = {0}, strcopies = {0};
+
+// task descs with their own copies of each argv array, as if freshly decoded
+struct vec_desc VEC(struct task_desc);
+static struct vec_desc descs = {0};
+
+// workdir-joined infile paths, the way ipcserver.c hands them to fpath_canon()
+static struct vec_str joined = {0};
+
+// requests as libbuild would send them, to be decoded relative to workdir
+struct msg { const char *workdir; char *buf; uint len; };
+struct vec_msg VEC(struct msg);
+static struct vec_msg msgs = {0};
+
+static volatile ulong sink; // stops results being optimised away
+
+static void addtask(struct task_desc desc, struct db_taskresult *r,
+		void *unused) {
+	if (!r->newness) return; // never finished, see build-query.c
+	if (!vec_push(&tasks, ((struct task){desc, r}))) diemem();
+}
+
+static void addstr(const char *s) {
+	if (!vec_push(&strs, s)) diemem();
+}
+
+// appends path relative to workdir, assuming the two are both canonical paths
+// from the base dir - that is, goes all the way up and then back down
+static void appendrel(struct str *s, const char *workdir, const char *path) {
+	if (workdir[0] != '.' || workdir[1]) {
+		if (!str_append0t(s, "../")) diemem();
+		for (const char *p = workdir; *p; ++p) {
+			if (*p == '/' && !str_append0t(s, "../")) diemem();
+		}
+	}
+	if (!str_append0t(s, path)) diemem();
+}
+
+static char mbuf[IPC_MSGMAX];
+static uint mlen = 0, mcountpos;
+static int mcount = 0;
+
+static bool fits(ulong n) { return mlen + n <= IPC_MSGMAX; }
+static void put(const void *p, uint n) { memcpy(mbuf + mlen, p, n); mlen += n; }
+static void putstr(const char *s) { put(s, strlen(s) + 1); }
+
+static void beginmsg(char type) {
+	mlen = 0;
+	put(&type, 1);
+	mcountpos = mlen;
+	put(&mcount, sizeof(mcount)); // filled in by endmsg()
+}
+
+static void endmsg(const char *workdir) {
+	if (mcount) {
+		memcpy(mbuf + mcountpos, &mcount, sizeof(mcount));
+		char *buf = malloc(mlen);
+		if (!buf) diemem();
+		memcpy(buf, mbuf, mlen);
+		if (!vec_push(&msgs, ((struct msg){workdir, buf, mlen}))) diemem();
+	}
+	mlen = 0; mcount = 0;
+}
+
+static ulong argvsize(const char *const *argv) {
+	ulong sz = sizeof(int);
+	for (const char *const *pp = argv; *pp; ++pp) sz += strlen(*pp) + 1;
+	return sz;
+}
+
+// packs a task's recorded deps and infiles into IPC_REQ_DEPS and
+// IPC_REQ_INFILES requests, split up the same way ipcclient.c does it
+static void addmsgs(const struct task *t) {
+	const char *workdir = t->desc.workdir;
+	struct str s = {0};
+	for (uint i = 0; i < t->r->ndeps; ++i) {
+		const struct task_desc *d = t->r->deps + i;
+		ulong sz = argvsize(d->argv);
+		if (mcount && (d->workdir != d[-1].workdir || !fits(sz))) {
+			endmsg(workdir);
+		}
+		if (!mcount) {
+			int tag = i;
+			beginmsg(IPC_REQ_DEPS);
+			put(&tag, sizeof(tag));
+			if (!str_clear(&s)) diemem();
+			appendrel(&s, workdir, d->workdir);
+			putstr(s.data);
+			if (!fits(sz)) { mlen = 0; continue; } // too big for a datagram
+		}
+		int argc = 0;
+		for (const char *const *pp = d->argv; *pp; ++pp) ++argc;
+		put(&argc, sizeof(argc));
+		for (const char *const *pp = d->argv; *pp; ++pp) putstr(*pp);
+		++mcount;
+	}
+	endmsg(workdir);
+	for (uint i = 0; i < t->r->ninfiles; ++i) {
+		if (!str_clear(&s)) diemem();
+		appendrel(&s, workdir, t->r->infiles[i]);
+		if (mcount && !fits(strlen(s.data) + 1)) endmsg(workdir);
+		if (!mcount) beginmsg(IPC_REQ_INFILES);
+		if (!fits(strlen(s.data) + 1)) { mlen = 0; continue; }
+		putstr(s.data);
+		++mcount;
+	}
+	endmsg(workdir);
+	free(s.data);
+}
+
+static void load(void) {
+	db_init_readonly();
+	db_foreachtaskresult(&addtask, 0);
+	if (!tasks.sz) {
+		errmsg_diex(2, msg_fatal, "there are no finished tasks to go by");
+	}
+	struct str s = {0};
+	for (uint i = 0; i < tasks.sz; ++i) {
+		const struct task *t = tasks.data + i;
+		uint argc = 0;
+		for (const char *const *pp = t->desc.argv; *pp; ++pp, ++argc) {
+			addstr(*pp);
+		}
+		addstr(t->desc.workdir);
+		for (uint j = 0; j < t->r->ninfiles; ++j) {
+			addstr(t->r->infiles[j]);
+			if (!str_clear(&s)) diemem();
+			if (!str_append0t(&s, t->desc.workdir) || !str_appendc(&s, '/')) {
+				diemem();
+			}
+			appendrel(&s, t->desc.workdir, t->r->infiles[j]);
+			if (!vec_push(&joined, s.data)) diemem();
+			s = (struct str){0};
+		}
+		const char **argv = malloc(sizeof(*argv) * (argc + 1));
+		if (!argv) diemem();
+		memcpy(argv, t->desc.argv, sizeof(*argv) * (argc + 1));
+		if (!vec_push(&descs, ((struct task_desc){argv, t->desc.workdir}))) {
+			diemem();
+		}
+		addmsgs(t);
+	}
+	// the copies all go in one block, much like they would come out of the
+	// receive buffer
+	ulong total = 0;
+	for (uint i = 0; i < strs.sz; ++i) total += strlen(strs.data[i]) + 1;
+	char *p = malloc(total);
+	if (!p) diemem();
+	if (!vec_reserve(&strcopies, strs.sz)) diemem();
+	for (uint i = 0; i < strs.sz; ++i) {
+		ulong len = strlen(strs.data[i]) + 1;
+		memcpy(p, strs.data[i], len);
+		strcopies.data[strcopies.sz++] = p;
+		p += len;
+	}
+}
+
+static ulong pass_intern(void) {
+	for (uint i = 0; i < strcopies.sz; ++i) {
+		const char *s = db_intern(strcopies.data[i]);
+		if (!s) errmsg_die(100, msg_fatal, "couldn't intern string");
+		sink += (ulong)s;
+	}
+	return strcopies.sz;
+}
+
+static ulong pass_getidx(void) {
+	for (uint i = 0; i < strs.sz; ++i) sink += strpool_getidx(strs.data[i]);
+	return strs.sz;
+}
+
+static ulong pass_findtaskresult(void) {
+	for (uint i = 0; i < descs.sz; ++i) {
+		sink += (ulong)db_findtaskresult(descs.data[i]);
+	}
+	return descs.sz;
+}
+
+static ulong pass_canon(void) {
+	char buf[PATH_MAX];
+	for (uint i = 0; i < joined.sz; ++i) {
+		sink += fpath_canon(joined.data[i], buf, 0);
+	}
+	return joined.sz;
+}
+
+static void decode(const struct msg *m) {
+	struct ipc_req req;
+	if (!ipcserver_decode(&req, m->workdir)) {
+		errmsg_die(100, msg_fatal, "couldn't decode request");
+	}
+	sink += req.type;
+}
+
+static int sock[2];
+
+static ulong pass_recv(void) {
+	for (uint i = 0; i < msgs.sz; ++i) {
+		if (send(sock[1], msgs.data[i].buf, msgs.data[i].len, 0) == -1 ||
+				!ipcserver_recv(sock[0])) {
+			errmsg_die(100, msg_fatal, "couldn't pass request through socket");
+		}
+		decode(msgs.data + i);
+	}
+	return msgs.sz;
+}
+
+static struct ipc_ring *ring;
+
+// does what ringput() in ipcclient.c does, minus the wakeup
+static void ringput(const char *p, uint n) {
+	uint tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	char *d = ring->data;
+	uint off = tail & (IPC_RINGSZ - 1), recsz = (sizeof(n) + n + 3) & ~3u;
+	// wrapping around is rare enough not to bother with; start again instead
+	if (off + recsz > IPC_RINGSZ) {
+		atomic_store(&ring->head, 0);
+		tail = 0; off = 0;
+	}
+	memcpy(d + off, &n, sizeof(n));
+	memcpy(d + off + sizeof(n), p, n);
+	atomic_store(&ring->tail, tail + recsz);
+}
+
+static ulong pass_recvring(void) {
+	for (uint i = 0; i < msgs.sz; ++i) {
+		ringput(msgs.data[i].buf, msgs.data[i].len);
+		if (!ipcserver_recvring(ring)) {
+			errmsg_die(100, msg_fatal, "couldn't read request from ring");
+		}
+		decode(msgs.data + i);
+	}
+	return msgs.sz;
+}
+
+static ulong pass_desctostr(void) {
+	for (uint i = 0; i < tasks.sz; ++i) {
+		char *s = desctostr(&tasks.data[i].desc);
+		if (!s) diemem();
+		sink += *s;
+		free(s);
+	}
+	return tasks.sz;
+}
+
+static const struct {
+	const char *name;
+	ulong (*pass)(void); // one go over the corpus; returns how many ops
+} benches[] = {
+	{"db_intern", &pass_intern},
+	{"strpool_getidx", &pass_getidx},
+	{"db_findtaskresult", &pass_findtaskresult},
+	{"fpath_canon", &pass_canon},
+	{"ipcserver_recv", &pass_recv},
+	{"ipcserver_recvring", &pass_recvring},
+	{"desctostr", &pass_desctostr}
+};
+
+static void run(const char *name, ulong (*pass)(void), vlong mintime) {
+	if (!pass()) { printf("%-20s (nothing to do)\n", name); return; }
+	ulong ops = 0;
+	nallocs = 0;
+	vlong start = time_nowus(), end;
+	do { ops += pass(); } while ((end = time_nowus()) - start < mintime);
+	double ns = (end - start) * 1000.0 / ops;
+#ifdef COUNT_ALLOCS
+	printf("%-20s %12lu %10.1f %10.2f\n", name, ops, ns,
+			(double)nallocs / ops);
+#else
+	printf("%-20s %12lu %10.1f %10s\n", name, ops, ns, "-");
+#endif
+}
+
+int main(int argc, char *argv[]) {
+	vlong mintime = 500000;
+	FOR_OPTS(argc, argv, {
+		case 't':;
+			const char *errstr;
+			mintime = strtonum(OPTARG(argc, argv), 1, 3600000, &errstr) * 1000;
+			if (errstr) {
+				errmsg_warnx(msg_error, "-t value is ", errstr);
+				if (errno == EINVAL) usage();
+				else exit(1);
+			}
+	});
+	for (int i = 0; i < argc; ++i) {
+		for (uint j = 0; j < sizeof(benches) / sizeof(*benches); ++j) {
+			if (!strcmp(argv[i], benches[j].name)) goto ok;
+		}
+		errmsg_warnx(msg_error, "unknown benchmark: ", argv[i]);
+		usage();
+ok:;
+	}
+
+	load();
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sock) == -1) {
+		errmsg_die(100, msg_fatal, "couldn't create socket pair");
+	}
+	ring = calloc(1, sizeof(*ring) + IPC_RINGSZ);
+	if (!ring) diemem();
+	printf("%u tasks, %u strings, %u infile paths, %u IPC requests\n\n",
+			tasks.sz, strs.sz, joined.sz, msgs.sz);
+	printf("%-20s %12s %10s %10s\n", "benchmark", "ops", "ns/op", "allocs/op");
+	fflush(stdout);
+	for (uint i = 0; i < sizeof(benches) / sizeof(*benches); ++i) {
+		bool want = !argc;
+		for (int j = 0; j < argc; ++j) {
+			if (!strcmp(argv[j], benches[i].name)) { want = true; break; }
+		}
+		if (want) run(benches[i].name, benches[i].pass, mintime);
+		fflush(stdout);
+	}
+	return 0;
+}
+
+// vi: sw=4 ts=4 noet tw=80 cc=80
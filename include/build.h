@@ -13,8 +13,25 @@
  * then exits. The build-dep program with no flags calls this and then the
  * build_dep_wait() function, and exits with the status returned from the
  * latter.
+ *
+ * Returns an ID which identifies this dependency in the results given by
+ * build_dep_waitsome(). IDs count up from 1 in each process, so they're only
+ * meaningful to the process that made the request.
+ */
+int build_dep(const char *const *argv, const char *workdir);
+
+/*
+ * Does the same thing as calling build_dep() for each of the `n` argv arrays in
+ * `argvs`, all with the same `workdir`, but sends as few requests as possible,
+ * which makes a big difference when a task has lots of dependencies.
+ *
+ * The build-dep program with the -f flag essentially calls this function.
+ *
+ * Returns the ID of the first dependency; the rest get consecutive IDs after
+ * that, in order.
  */
-void build_dep(const char *const *argv, const char *workdir);
+int build_dep_many(const char *const *const *argvs, int n,
+		const char *workdir);
 
 /*
  * Causes the current process to block until every requested dependency so far
@@ -30,9 +47,32 @@ void build_dep(const char *const *argv, const char *workdir);
  *
  * The build-dep program with the -w flag essentially calls this function and
  * exits with whatever status is returned.
+ *
+ * Any results not yet collected with build_dep_waitsome() are thrown away.
  */
 int build_dep_wait(void);
 
+struct build_depresult {
+	int id; // as returned from build_dep() or build_dep_many()
+	unsigned char status; // exit status of the dependency
+	unsigned char rerun; // 1 if it ran in this build, 0 if already up-to-date
+};
+
+/*
+ * Blocks until at least one requested dependency has finished (or returns
+ * straight away if some already have), then fills in `out` with up to `max`
+ * results, oldest first, and returns how many there were. Each dependency
+ * request gets exactly one result, even if the same task is requested twice.
+ * Returns 0 if there's nothing left to wait for.
+ *
+ * This allows a task to get on with something useful as soon as any one of its
+ * dependencies is done, rather than waiting for the slowest one every time.
+ *
+ * Results are tracked per task, not per process, so if a task is made up of
+ * several processes, only one of them should use this function.
+ */
+int build_dep_waitsome(struct build_depresult *out, int max);
+
 /*
  * Tells build that the currently-running task depends on access to and/or the
  * contents of the file at `path`. This information will be used to determine
@@ -41,6 +81,14 @@ int build_dep_wait(void);
  */
 void build_infile(const char *path);
 
+/*
+ * Reads the Makefile-style dependency file at `path`, like the ones compilers
+ * write when given -MD, and calls build_infile() on every file it lists - but
+ * all in one go, which is a lot quicker than doing them one at a time. Targets
+ * are ignored, as are files outside the project (such as system headers).
+ */
+void build_infile_depfile(const char *path);
+
 /*
  * Tells build that the currently-running task has a friendly, descriptive name
  * that can be displayed to the user rather than spitting out the argv. Since
@@ -50,6 +98,31 @@ void build_infile(const char *path);
  */
 void build_tasktitle(const char *title);
 
+/*
+ * For worker programs, which are started once and then kept around by build to
+ * do any number of @worker tasks (see build(1)): waits for the next task and
+ * returns its argv, with argv[0] being the program's own name as it was given
+ * in the task. Before returning, the current directory is changed to the
+ * task's working directory, and stderr is redirected to the task's error
+ * output. Dependencies and infiles requested while doing the task are recorded
+ * against the task, as usual.
+ *
+ * Returns null once build has no more tasks for the worker, in which case it
+ * should exit. Also returns null straight away if the program wasn't started as
+ * a worker (or wasn't started by build at all), so a program can try this first
+ * and then carry on as normal if it doesn't get anything.
+ *
+ * The argv is only valid until the next call.
+ */
+const char *const *build_worker_next(void);
+
+/*
+ * Finishes the task most recently returned by build_worker_next(), giving it
+ * the exit status `status`, just as if it were a process that exited. stderr
+ * and BUILD_ROOT_DIR go back to how they were before the task.
+ */
+void build_worker_done(int status);
+
 #endif
 
 // vi: sw=4 ts=4 noet tw=80 cc=80
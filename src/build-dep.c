@@ -14,29 +14,91 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <fcntl.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <errmsg.h>
+#include <intdefs.h>
+#include <iobuf.h>
 #include <opt.h>
+#include <str.h>
+#include <vec.h>
 
 #include "../include/build.h"
 
-USAGE("[-n] [-C workdir] [command...] [-w]");
+USAGE("[-n] [-C workdir] [command... | -f file] [-w]");
+
+struct vec_str VEC(char *);
+struct vec_uint VEC(uint);
+
+// reads one argument per line, with a blank line (or the end of the file)
+// ending each task, and requests all of those tasks in one go
+static void readargsfile(const char *path, const char *workdir) {
+	int fd = 0;
+	if (strcmp(path, "-") && (fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		errmsg_die(100, msg_fatal, "couldn't open ", path);
+	}
+	struct ibuf *b = IBUF(fd, 4096);
+	struct vec_str args = {0}; // all the argvs, each null-terminated
+	struct vec_uint starts = {0}; // where each argv starts in the above
+	bool intask = false;
+	struct str line = {0};
+	for (;;) {
+		if (!str_clear(&line)) goto nomem;
+		int n = ibuf_getstr(b, &line, '\n');
+		if (n == -1) errmsg_die(100, msg_fatal, "couldn't read ", path);
+		if (n <= 0) break; // EOF
+		if (line.data[n - 1] == '\n') line.data[--n] = '\0';
+		if (!n) {
+			if (intask && !vec_push(&args, 0)) goto nomem;
+			intask = false;
+			continue;
+		}
+		if (!intask) {
+			if (!vec_push(&starts, args.sz)) goto nomem;
+			intask = true;
+		}
+		char *arg = strdup(line.data);
+		if (!arg || !vec_push(&args, arg)) goto nomem;
+	}
+	if (intask && !vec_push(&args, 0)) goto nomem;
+	// args is done growing now, so pointers into it will stay put
+	const char *const **argvs = malloc(starts.sz * sizeof(*argvs));
+	if (!argvs && starts.sz) goto nomem;
+	for (uint i = 0; i < starts.sz; ++i) {
+		argvs[i] = (const char *const *)args.data + starts.data[i];
+	}
+	build_dep_many(argvs, starts.sz, workdir);
+	// not bothering to free anything since we're about to exit anyway
+	return;
+
+nomem:	errmsg_die(100, msg_fatal, "couldn't allocate memory");
+}
 
 int main(int argc, char *argv[]) {
 	const char *workdir = "."; bool hasworkdir = false;
+	const char *file = 0;
 	bool nonblock = false;
 	bool waitall = false;
 	FOR_OPTS(argc, argv, {
 		case 'C': workdir = OPTARG(argc, argv); hasworkdir = true; break;
+		case 'f': file = OPTARG(argc, argv); break;
 		// doesn't really make any sense to have both these flags set...
 		case 'n': nonblock = true; waitall = false; break;
 		case 'w': waitall = true; nonblock = false;
 	});
 	if (waitall) {
-		if (argc) usage();
+		if (argc || file) usage();
 		return build_dep_wait();
 	}
+	if (file) {
+		if (argc) usage();
+		readargsfile(file, workdir);
+		if (!nonblock) return build_dep_wait();
+		return 0;
+	}
 	if (!argc) {
 		if (!hasworkdir) {
 			errmsg_warnx("expected a workdir and/or command");
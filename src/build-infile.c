@@ -14,16 +14,23 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <stdbool.h>
+
 #include <opt.h>
 
 #include "../include/build.h"
 
-USAGE("filename1 [filename2 ...]");
+USAGE("[-d] filename1 [filename2 ...]");
 
 int main(int argc, char *argv[]) {
-	FOR_OPTS(argc, argv, {});
+	bool depfiles = false;
+	FOR_OPTS(argc, argv, {
+		case 'd': depfiles = true;
+	});
 	if (!argc) usage();
-	for (; *argv; ++argv) build_infile(*argv);
+	for (; *argv; ++argv) {
+		if (depfiles) build_infile_depfile(*argv); else build_infile(*argv);
+	}
 }
 
 // vi: sw=4 ts=4 noet tw=80 cc=80
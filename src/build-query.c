@@ -0,0 +1,519 @@
+/* This file is dedicated to the public domain. */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <basichashes.h>
+#include <errmsg.h>
+#include <fmt.h>
+#include <intdefs.h>
+#include <iobuf.h>
+#include <noreturn.h>
+#include <opt.h>
+#include <table.h>
+#include <vec.h>
+
+#include "db.h"
+#include "defs.h"
+#include "desc.h"
+#include "fpath.h"
+#include "infile.h"
+#include "json.h"
+
+USAGE("[-j] tasks | deps ID... | rdeps [-rt] ARG... | affected [PATH...] | "
+		"hot [N] | graph");
+
+// spaghetti variables (build.h), which infile.c pulls in; never used here
+int maxpar = 0;
+bool cleanbuild = false;
+
+static bool json = false;
+
+// everything in the db gets loaded into two lists - tasks, sorted by ID, and
+// infiles - and then the reverse index is built on top of those: for each task
+// and each infile, the tasks that directly depend on it
+struct task { struct task_desc desc; struct db_taskresult *r; };
+struct vec_task VEC(struct task);
+static struct vec_task tasks = {0};
+struct vec_str VEC(const char *);
+static struct vec_str infiles = {0};
+struct vec_uint VEC(uint);
+
+// rdeps of task i are rdeps[rdepstart[i]] up to rdeps[rdepstart[i + 1]], and
+// likewise for infiles, with the infile's index offset by tasks.sz
+static uint *rdepstart;
+static uint *rdeps;
+
+struct idx { const void *p; uint i; };
+static inline const void *kmemb_idx(const struct idx *e) { return e->p; }
+DECL_TABLE(static, idx, const void *, struct idx)
+DEF_TABLE(static, idx, hash_ptr, table_ideq, kmemb_idx)
+static struct table_idx taskidx; // by db_taskresult pointer
+static struct table_idx infileidx; // by interned path
+
+static noreturn diemem(void) {
+	errmsg_die(100, msg_fatal, "couldn't allocate memory");
+}
+
+static struct obuf *out = OBUF(1, 65536);
+
+static noreturn diewrite(void) {
+	errmsg_die(100, msg_fatal, "couldn't write output");
+}
+
+static void put(const char *p, uint n) {
+	if (!obuf_putbytes(out, p, n)) diewrite();
+}
+
+static void put0t(const char *s) {
+	if (!obuf_put0t(out, s)) diewrite();
+}
+
+static void putch(char c) {
+	if (!obuf_putc(out, c)) diewrite();
+}
+
+static void putnum(uint n) {
+	if (!fmt_buf_u32(out, n)) diewrite();
+}
+
+static void addtask(struct task_desc desc, struct db_taskresult *r,
+		void *unused) {
+	// tasks that were requested but never got to finish don't have results
+	// worth talking about (they're still in there so they get their IDs back)
+	if (!r->newness) return;
+	if (!vec_push(&tasks, ((struct task){desc, r}))) diemem();
+}
+
+static int cmptask(const void *a, const void *b) {
+	const struct task *t1 = a, *t2 = b;
+	return (t1->r->id > t2->r->id) - (t1->r->id < t2->r->id);
+}
+
+static long findtask(struct task_desc desc) {
+	struct db_taskresult *r = db_findtaskresult(desc);
+	if (!r) return -1;
+	struct idx *e = table_get_idx(&taskidx, r);
+	return e ? e->i : -1;
+}
+
+static void load(void) {
+	db_init_readonly();
+	db_foreachtaskresult(&addtask, 0);
+	qsort(tasks.data, tasks.sz, sizeof(*tasks.data), &cmptask);
+	if (!table_init_idx(&taskidx) || !table_init_idx(&infileidx)) diemem();
+	for (uint i = 0; i < tasks.sz; ++i) {
+		struct idx *e = table_put_idx(&taskidx, tasks.data[i].r);
+		if (!e) diemem();
+		*e = (struct idx){tasks.data[i].r, i};
+	}
+	for (struct task *t = tasks.data; t - tasks.data < tasks.sz; ++t) {
+		for (uint j = 0; j < t->r->ninfiles; ++j) {
+			bool isnew;
+			struct idx *e = table_putget_idx(&infileidx, t->r->infiles[j],
+					&isnew);
+			if (!e) diemem();
+			if (!isnew) continue;
+			*e = (struct idx){t->r->infiles[j], infiles.sz};
+			if (!vec_push(&infiles, t->r->infiles[j])) diemem();
+		}
+	}
+	// two passes: count up each node's rdeps, then fill them in
+	uint n = tasks.sz + infiles.sz;
+	rdepstart = calloc(n + 2, sizeof(*rdepstart));
+	if (!rdepstart) diemem();
+	uint nedges = 0;
+	for (int pass = 0; pass < 2; ++pass) {
+		for (uint i = 0; i < tasks.sz; ++i) {
+			const struct db_taskresult *r = tasks.data[i].r;
+			for (uint j = 0; j < r->ndeps; ++j) {
+				long dep = findtask(r->deps[j]);
+				if (dep == -1) continue;
+				if (pass) rdeps[rdepstart[dep + 1]++] = i;
+				else ++rdepstart[dep + 2];
+			}
+			for (uint j = 0; j < r->ninfiles; ++j) {
+				uint f = tasks.sz + table_get_idx(&infileidx,
+						r->infiles[j])->i;
+				if (pass) rdeps[rdepstart[f + 1]++] = i;
+				else ++rdepstart[f + 2];
+			}
+		}
+		if (pass) break;
+		// shift the counts into starting positions, one ahead, so that the
+		// second pass bumps each into place as the previous one's end
+		for (uint i = 2; i < n + 2; ++i) rdepstart[i] += rdepstart[i - 1];
+		nedges = rdepstart[n + 1];
+		rdeps = malloc((nedges ? nedges : 1) * sizeof(*rdeps));
+		if (!rdeps) diemem();
+	}
+}
+
+// IDs are the serial numbers the db gives tasks (the same numbers as in
+// .builddb's error output files)
+static uint parseid(const char *s) {
+	const char *errstr;
+	uint id = strtonum(s, 0, UINT_MAX, &errstr);
+	if (errstr) errmsg_diex(2, msg_fatal, "task ID is ", errstr, ": ", s);
+	uint lo = 0, hi = tasks.sz;
+	while (lo < hi) {
+		uint mid = lo + (hi - lo) / 2;
+		if (tasks.data[mid].r->id < id) lo = mid + 1; else hi = mid;
+	}
+	if (lo == tasks.sz || tasks.data[lo].r->id != id) {
+		errmsg_diex(2, msg_fatal, "no task with ID ", s);
+	}
+	return lo;
+}
+
+// returns the infile's node index, or -1 if nothing's ever read the file
+static long parsepath(const char *s) {
+	char *canon = malloc(strlen(s) + 1);
+	if (!canon) diemem();
+	enum fpath_err e = fpath_canon(s, canon, 0);
+	if (e != FPATH_OK) {
+		errmsg_diex(2, msg_fatal, "invalid path `", s, "`: ",
+				fpath_errorstring(e));
+	}
+	const char *path = db_findstr(canon);
+	free(canon);
+	struct idx *i = path ? table_get_idx(&infileidx, path) : 0;
+	return i ? (long)(tasks.sz + i->i) : -1;
+}
+
+static void putjsonpart(const char *p, uint n, void *unused) { put(p, n); }
+
+static void putjsonstr(const char *s) { json_putstr(s, &putjsonpart, 0); }
+
+static void putdesc(const struct task_desc *d) {
+	char *s = desctostr(d);
+	if (!s) diemem();
+	put0t(s);
+	free(s);
+}
+
+// prints a task in the given format; for JSON, a list of its deps (by ID) and
+// infiles can be included too
+static void puttask(uint i, bool first, bool edges) {
+	const struct task *t = tasks.data + i;
+	if (!json) {
+		putnum(t->r->id);
+		putch('\t');
+		putnum(t->r->status);
+		putch('\t');
+		putdesc(&t->desc);
+		putch('\n');
+		return;
+	}
+	put0t(first ? "{\"id\": " : ", {\"id\": ");
+	putnum(t->r->id);
+	put0t(", \"status\": ");
+	putnum(t->r->status);
+	put0t(", \"argv\": [");
+	for (const char *const *pp = t->desc.argv; *pp; ++pp) {
+		if (pp != t->desc.argv) put0t(", ");
+		putjsonstr(*pp);
+	}
+	put0t("], \"workdir\": ");
+	putjsonstr(t->desc.workdir);
+	if (edges) {
+		put0t(", \"deps\": [");
+		bool firstdep = true;
+		for (uint j = 0; j < t->r->ndeps; ++j) {
+			long dep = findtask(t->r->deps[j]);
+			if (dep == -1) continue;
+			if (!firstdep) put0t(", ");
+			putnum(tasks.data[dep].r->id);
+			firstdep = false;
+		}
+		put0t("], \"infiles\": [");
+		for (uint j = 0; j < t->r->ninfiles; ++j) {
+			if (j) put0t(", ");
+			putjsonstr(t->r->infiles[j]);
+		}
+		putch(']');
+	}
+	putch('}');
+}
+
+// prints all the tasks with a nonzero mark (in ID order, as they're stored);
+// JSON output is a list, which is left unterminated by a newline
+static void putmarked(const uint *marks) {
+	bool first = true;
+	if (json) putch('[');
+	for (uint i = 0; i < tasks.sz; ++i) {
+		if (marks[i]) { puttask(i, first, false); first = false; }
+	}
+	if (json) putch(']');
+}
+
+static uint *marks; // one per node; what each gets set to depends on the use
+static struct vec_uint queue = {0};
+
+// marks everything that depends on the given nodes, directly or (if deep)
+// transitively, with mark; returns how many tasks got marked
+static uint walk(const uint *start, uint nstart, uint mark, bool deep) {
+	uint n = 0;
+	queue.sz = 0;
+	for (uint i = 0; i < nstart; ++i) {
+		if (!vec_push(&queue, start[i])) diemem();
+	}
+	for (uint qi = 0; qi < queue.sz; ++qi) {
+		uint node = queue.data[qi];
+		for (uint j = rdepstart[node]; j < rdepstart[node + 1]; ++j) {
+			uint t = rdeps[j];
+			if (marks[t] == mark) continue;
+			marks[t] = mark;
+			++n;
+			if (deep && !vec_push(&queue, t)) diemem();
+		}
+	}
+	return n;
+}
+
+static void do_tasks(int argc, char **argv) {
+	if (argc) usage();
+	for (uint i = 0; i < tasks.sz; ++i) marks[i] = 1;
+	putmarked(marks);
+	if (json) putch('\n');
+}
+
+static void do_deps(int argc, char **argv) {
+	if (!argc) usage();
+	// mark deps with 1 and infiles with 2, so each only comes out once
+	for (; *argv; ++argv) {
+		const struct db_taskresult *r = tasks.data[parseid(*argv)].r;
+		for (uint j = 0; j < r->ndeps; ++j) {
+			long dep = findtask(r->deps[j]);
+			if (dep != -1) marks[dep] = 1;
+		}
+		for (uint j = 0; j < r->ninfiles; ++j) {
+			marks[tasks.sz + table_get_idx(&infileidx, r->infiles[j])->i] = 2;
+		}
+	}
+	if (json) put0t("{\"deps\": ");
+	putmarked(marks);
+	if (json) put0t(", \"infiles\": [");
+	bool first = true;
+	for (uint i = 0; i < infiles.sz; ++i) {
+		if (marks[tasks.sz + i] != 2) continue;
+		if (json) {
+			if (!first) put0t(", ");
+			putjsonstr(infiles.data[i]);
+		}
+		else {
+			put0t("infile\t");
+			put0t(infiles.data[i]);
+			putch('\n');
+		}
+		first = false;
+	}
+	if (json) put0t("]}\n");
+}
+
+static void do_rdeps(int argc, char **argv) {
+	bool deep = false, byid = false;
+	FOR_OPTS(argc, argv, {
+		case 'r': deep = true; break;
+		case 't': byid = true;
+	});
+	if (!argc) usage();
+	struct vec_uint start = {0};
+	for (; *argv; ++argv) {
+		long node = byid ? parseid(*argv) : parsepath(*argv);
+		if (node != -1 && !vec_push(&start, node)) diemem();
+	}
+	walk(start.data, start.sz, 1, deep);
+	putmarked(marks);
+	if (json) putch('\n');
+}
+
+static void do_affected(int argc, char **argv) {
+	struct vec_uint start = {0};
+	if (argc) {
+		for (; *argv; ++argv) {
+			long node = parsepath(*argv);
+			if (node != -1 && !vec_push(&start, node)) diemem();
+		}
+	}
+	else {
+		// nothing given, so look at whatever's changed since the last build
+		for (uint i = 0; i < infiles.sz; ++i) {
+			int ret = infile_peek(infiles.data[i]);
+			if (ret == -1) {
+				errmsg_warn(msg_warn, "couldn't check infile ",
+						infiles.data[i]);
+				errmsg_warnx(msg_note, "assuming it's changed");
+			}
+			if (ret && !vec_push(&start, tasks.sz + i)) diemem();
+		}
+	}
+	walk(start.data, start.sz, 1, true);
+	putmarked(marks);
+	if (json) putch('\n');
+}
+
+struct hot { uint node, total, direct; };
+struct vec_hot VEC(struct hot);
+
+static int cmphot(const void *a, const void *b) {
+	const struct hot *h1 = a, *h2 = b;
+	if (h1->total != h2->total) return (h1->total < h2->total) -
+			(h1->total > h2->total);
+	return (h1->direct < h2->direct) - (h1->direct > h2->direct);
+}
+
+// finds the files and tasks that would cause the most reruns if they changed.
+// this does a whole walk per node, so it's quadratic-ish, but it's not like
+// it's in the way of a build
+static void do_hot(int argc, char **argv) {
+	uint max = 20;
+	if (argc > 1) usage();
+	if (argc) {
+		const char *errstr;
+		max = strtonum(*argv, 1, UINT_MAX, &errstr);
+		if (errstr) errmsg_diex(2, msg_fatal, "count is ", errstr);
+	}
+	struct vec_hot hot = {0};
+	uint n = tasks.sz + infiles.sz;
+	for (uint node = 0; node < n; ++node) {
+		uint direct = rdepstart[node + 1] - rdepstart[node];
+		if (!direct) continue;
+		// node + 1 is a fresh mark every time, since marks start at 0
+		uint total = walk(&node, 1, node + 1, true);
+		if (!vec_push(&hot, ((struct hot){node, total, direct}))) diemem();
+	}
+	qsort(hot.data, hot.sz, sizeof(*hot.data), &cmphot);
+	if (hot.sz > max) hot.sz = max;
+	if (json) putch('[');
+	for (struct hot *h = hot.data; h - hot.data < hot.sz; ++h) {
+		if (json) {
+			put0t(h == hot.data ? "{\"total\": " : ", {\"total\": ");
+			putnum(h->total);
+			put0t(", \"direct\": ");
+			putnum(h->direct);
+			if (h->node < tasks.sz) {
+				put0t(", \"task\": ");
+				putnum(tasks.data[h->node].r->id);
+			}
+			else {
+				put0t(", \"infile\": ");
+				putjsonstr(infiles.data[h->node - tasks.sz]);
+			}
+			putch('}');
+		}
+		else {
+			putnum(h->total);
+			putch('\t');
+			putnum(h->direct);
+			if (h->node < tasks.sz) {
+				put0t("\ttask ");
+				putnum(tasks.data[h->node].r->id);
+				put0t(" `");
+				putdesc(&tasks.data[h->node].desc);
+				put0t("`\n");
+			}
+			else {
+				put0t("\tinfile ");
+				put0t(infiles.data[h->node - tasks.sz]);
+				putch('\n');
+			}
+		}
+	}
+	if (json) put0t("]\n");
+}
+
+static void putdotstr(const char *s) {
+	putch('"');
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\') putch('\\');
+		if (*s == '\n') put0t("\\n"); else putch(*s);
+	}
+	putch('"');
+}
+
+// dumps everything: in DOT, tasks are tN (by ID) and infiles are boxes named fN
+// with arrows pointing at what things depend on; in JSON, each task just lists
+// its deps by ID and its infiles by path
+static void do_graph(int argc, char **argv) {
+	if (argc) usage();
+	if (json) {
+		put0t("{\"tasks\": [");
+		for (uint i = 0; i < tasks.sz; ++i) puttask(i, !i, true);
+		put0t("]}\n");
+		return;
+	}
+	put0t("digraph build {\n");
+	for (uint i = 0; i < tasks.sz; ++i) {
+		put0t("\tt");
+		putnum(tasks.data[i].r->id);
+		put0t(" [label=");
+		char *s = desctostr(&tasks.data[i].desc);
+		if (!s) diemem();
+		putdotstr(s);
+		free(s);
+		put0t("];\n");
+	}
+	for (uint i = 0; i < infiles.sz; ++i) {
+		put0t("\tf");
+		putnum(i);
+		put0t(" [label=");
+		putdotstr(infiles.data[i]);
+		put0t(", shape=box];\n");
+	}
+	for (uint i = 0; i < tasks.sz; ++i) {
+		const struct db_taskresult *r = tasks.data[i].r;
+		for (uint j = 0; j < r->ndeps; ++j) {
+			long dep = findtask(r->deps[j]);
+			if (dep == -1) continue;
+			put0t("\tt");
+			putnum(r->id);
+			put0t(" -> t");
+			putnum(tasks.data[dep].r->id);
+			put0t(";\n");
+		}
+		for (uint j = 0; j < r->ninfiles; ++j) {
+			put0t("\tt");
+			putnum(r->id);
+			put0t(" -> f");
+			putnum(table_get_idx(&infileidx, r->infiles[j])->i);
+			put0t(";\n");
+		}
+	}
+	put0t("}\n");
+}
+
+int main(int argc, char *argv[]) {
+	FOR_OPTS(argc, argv, {
+		case 'j': json = true;
+	});
+	if (!argc) usage();
+	static const struct {
+		const char *name;
+		void (*f)(int argc, char **argv);
+	} cmds[] = {
+		{"tasks", &do_tasks},
+		{"deps", &do_deps},
+		{"rdeps", &do_rdeps},
+		{"affected", &do_affected},
+		{"hot", &do_hot},
+		{"graph", &do_graph}
+	};
+	for (uint i = 0; i < sizeof(cmds) / sizeof(*cmds); ++i) {
+		if (strcmp(*argv, cmds[i].name)) continue;
+		load();
+		marks = calloc(tasks.sz + infiles.sz + 1, sizeof(*marks));
+		if (!marks) diemem();
+		// subcommands parse their own options, so leave the name as argv[0]
+		if (cmds[i].f == &do_rdeps) cmds[i].f(argc, argv);
+		else cmds[i].f(argc - 1, argv + 1);
+		if (!obuf_flush(out)) diewrite();
+		return 0;
+	}
+	usage();
+}
+
+// vi: sw=4 ts=4 noet tw=80 cc=80
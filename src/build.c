@@ -29,35 +29,46 @@
 
 #include "db.h"
 #include "defs.h"
+#include "events.h"
 #include "evloop.h"
 #include "fpath.h"
+#include "stats.h"
 #include "task.h"
+#include "time.h"
+#include "trace.h"
 #include "tui.h"
 
 #include "infile.h"
 
-USAGE("[-j tasks_at_once] [-C workdir] [-B] [command...]");
+USAGE("[-j tasks_at_once] [-C workdir] [-B] [-n] [-s] [-S statsfile] "
+		"[-T tracefile] [-E events] [command...]");
 
 // XXX: generally we want to be running one thing at a time per CPU thread, plus
-// all the blocked ones, and then each running job has file descriptors
-// attached, and we only have so many file descriptors (and so much memory)!
-// with all that in mind, make the hard limit 256; if computers end up having
-// more CPU threads than that then this number can get bumped up (along with
-// kernel FD limits, ulimits etc.)
-#define MAX_JOBS_AT_ONCE 256
+// all the blocked ones. tasks don't cost many file descriptors anymore (on
+// Linux, just a pidfd each; elsewhere, just their IPC socket) but there's still
+// a limit on how many fds the event loop can handle, and it's also quite
+// possible to run out of memory and/or processes if this gets too high. I/O
+// bound stuff can make good use of way more jobs than CPU threads though, so
+// this is a fair bit higher than any sane CPU count
+#define MAX_JOBS_AT_ONCE 4096
 
 // spaghetti variables (build.h)
 int maxpar = 0;
 bool cleanbuild = false;
+bool dryrun = false;
 
 int main(int argc, char *argv[]) {
-	if (getenv(ENV_SOCKFD) || getenv(ENV_ROOT_DIR)) { // check both for paranoia
+	stats.startus = time_nowus();
+	// check all of these for paranoia
+	if (getenv(ENV_SOCKFD) || getenv(ENV_SOCKADDR) || getenv(ENV_ROOT_DIR)) {
 		errmsg_diex(1, "can't run build from build!");
 	}
 
 	const char *default_command[] = {"./Buildfile", 0};
 	const char **command = default_command;
 	const char *workdir = ".";
+	const char *tracefile = 0;
+	const char *eventsdest = 0;
 
 	FOR_OPTS(argc, argv, {
 		case 'j':;
@@ -70,7 +81,12 @@ int main(int argc, char *argv[]) {
 			}
 			break;
 		case 'B': cleanbuild = true; break;
-		case 'C': workdir = OPTARG(argc, argv);
+		case 'n': dryrun = true; break;
+		case 's': stats_print = true; break;
+		case 'S': stats_file = OPTARG(argc, argv); break;
+		case 'C': workdir = OPTARG(argc, argv); break;
+		case 'T': tracefile = OPTARG(argc, argv); break;
+		case 'E': eventsdest = OPTARG(argc, argv);
 	});
 
 	if (!maxpar) maxpar = sysconf(_SC_NPROCESSORS_ONLN);
@@ -78,21 +94,31 @@ int main(int argc, char *argv[]) {
 		// this is a crappy error message, but unlikely to be seen by, like,
 		// anyone, so whatever.
 		errmsg_warnx(msg_crit, "machine has unreasonably many CPU threads; "
-				"capping at 256! build will not utilise all your cores!");
+				"capping at 4096! build will not utilise all your cores!");
 		errmsg_warnx(msg_note, "increase MAX_JOBS_AT_ONCE in build.c to fix!");
-		maxpar = 256;
+		maxpar = MAX_JOBS_AT_ONCE;
 	}
 	if (argc) command = (const char **)argv;
+	if (tracefile && !dryrun && !trace_init(tracefile)) {
+		errmsg_die(100, msg_fatal, "couldn't open trace file ", tracefile);
+	}
+	// before stdout is replaced below, in case that's where events should go
+	if (eventsdest && !dryrun && !events_init(eventsdest)) {
+		errmsg_die(100, msg_fatal, "couldn't open events output ", eventsdest);
+	}
 
 	// replace stdin and stdout with /dev/null so people don't use build wrong.
 	// any user can have a build system painted any colour that he wants so long
-	// as it is black.
-	close(0); close(1);
-	if (open("/dev/null", O_RDWR) == -1 || dup(0) == -1) {
+	// as it is black. (-n is the exception, since it just prints stuff.)
+	close(0);
+	if (!dryrun) close(1);
+	if (open("/dev/null", O_RDWR) == -1 || !dryrun && dup(0) == -1) {
 		errmsg_die(100, msg_fatal, "couldnt't open /dev/null");
 	}
 	evloop_init();
+	vlong dbstart = time_nowus();
 	db_init();
+	stats.dbinitus = time_nowus() - dbstart;
 	for (const char **pp = command; *pp; ++pp) {
 		// reuse argv space for interned strings, might as well avoid malloc()
 		*pp = db_intern(*pp);
@@ -106,7 +132,10 @@ int main(int argc, char *argv[]) {
 	}
 	workdir = db_intern(canonworkdir);
 	if (!workdir) errmsg_die(100, msg_fatal, "couldn't intern string");
-	if (isatty(2)) {
+	if (dryrun) {
+		// nothing will run, so there's nothing to show
+	}
+	else if (isatty(2)) {
 		tui_init(2);
 	}
 	else {
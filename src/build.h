@@ -23,6 +23,7 @@
 
 extern int maxpar;
 extern bool cleanbuild;
+extern bool dryrun;
 
 #endif
 
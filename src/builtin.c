@@ -0,0 +1,369 @@
+/* This file is dedicated to the public domain. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <intdefs.h>
+#include <iobuf.h>
+#include <vec.h>
+
+#include "builtin.h"
+#include "cdep.h"
+#include "db.h"
+#include "fd.h"
+#include "fpath.h"
+
+static struct obuf *E = OBUF(-1, 512);
+static const char *curname; // for error messages
+static const char *curworkdir;
+static bool (*curinfile)(const char *path, void *ctxt);
+static void *curctxt;
+
+static int fail(const char *what, const char *path) {
+	int e = errno;
+	obuf_put0t(E, curname); obuf_put0t(E, ": couldn't ");
+	obuf_put0t(E, what); obuf_putc(E, ' '); obuf_put0t(E, path);
+	obuf_put0t(E, ": "); obuf_put0t(E, strerror(e)); obuf_putc(E, '\n');
+	// running out of resources is worth trying again next time; anything else
+	// is probably going to keep happening so it might as well be cached
+	return e == ENOMEM || e == EMFILE || e == ENFILE ? 100 : 1;
+}
+
+// creates all the directories leading up to the last path component
+static bool mkparents(int dfd, const char *path) {
+	char buf[PATH_MAX];
+	uint len = strlen(path);
+	if (len >= sizeof(buf)) { errno = ENAMETOOLONG; return false; }
+	memcpy(buf, path, len + 1);
+	// skip the first char so an absolute path doesn't try to make "" first
+	for (char *p = buf + 1; *p; ++p) {
+		if (*p != '/' || p[-1] == '/') continue;
+		*p = '\0';
+		if (mkdirat(dfd, buf, 0755) == -1 && errno != EEXIST) return false;
+		*p = '/';
+	}
+	return true;
+}
+
+static int do_mkdir(int dfd, const char *const *args, int nargs) {
+	for (int i = 0; i < nargs; ++i) {
+		if (!mkparents(dfd, args[i]) ||
+				mkdirat(dfd, args[i], 0755) == -1 && errno != EEXIST) {
+			return fail("create directory", args[i]);
+		}
+	}
+	return 0;
+}
+
+static int cp1(int dfd, const char *src, const char *dst) {
+	if (!curinfile(src, curctxt)) return 100;
+	int in = openat(dfd, src, O_RDONLY | O_CLOEXEC);
+	if (in == -1) return fail("open", src);
+	int ret = 0;
+	struct stat s;
+	if (fstat(in, &s) == -1) { ret = fail("stat", src); goto e; }
+	if (!mkparents(dfd, dst)) {
+		ret = fail("create parent directories of", dst);
+		goto e;
+	}
+	int out = openat(dfd, dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			s.st_mode & 0777);
+	if (out == -1) { ret = fail("create", dst); goto e; }
+	if (!fd_transferall(in, out)) ret = fail("copy to", dst);
+	close(out);
+e:	close(in);
+	return ret;
+}
+
+static int do_cp(int dfd, const char *const *args, int nargs) {
+	const char *dst = args[nargs - 1];
+	uint dstlen = strlen(dst);
+	struct stat s;
+	bool todir = nargs > 2 || dst[dstlen - 1] == '/' ||
+			fstatat(dfd, dst, &s, 0) != -1 && S_ISDIR(s.st_mode);
+	if (!todir) return cp1(dfd, args[0], dst);
+	char buf[PATH_MAX];
+	if (dstlen >= sizeof(buf) - 1) {
+		errno = ENAMETOOLONG;
+		return fail("copy to", dst);
+	}
+	memcpy(buf, dst, dstlen);
+	if (dst[dstlen - 1] != '/') buf[dstlen++] = '/';
+	for (int i = 0; i < nargs - 1; ++i) {
+		const char *base = strrchr(args[i], '/');
+		base = base ? base + 1 : args[i];
+		uint baselen = strlen(base);
+		if (dstlen + baselen >= sizeof(buf)) {
+			errno = ENAMETOOLONG;
+			return fail("copy to", dst);
+		}
+		memcpy(buf + dstlen, base, baselen + 1);
+		int ret = cp1(dfd, args[i], buf);
+		if (ret) return ret;
+	}
+	return 0;
+}
+
+static int do_symlink(int dfd, const char *const *args, int nargs) {
+	const char *tgt = args[0], *link = args[1];
+	char buf[PATH_MAX];
+	uint tgtlen = strlen(tgt);
+	// if it's already there, leave it be
+	long n = readlinkat(dfd, link, buf, sizeof(buf));
+	if (n == tgtlen && !memcmp(buf, tgt, n)) return 0;
+	if (n != -1 || errno == EINVAL) {
+		if (unlinkat(dfd, link, 0) == -1) return fail("remove", link);
+	}
+	else if (errno != ENOENT) {
+		return fail("read", link);
+	}
+	if (!mkparents(dfd, link)) {
+		return fail("create parent directories of", link);
+	}
+	if (symlinkat(tgt, dfd, link) == -1) return fail("create", link);
+	return 0;
+}
+
+// true if the file's contents are exactly s
+static bool same(int fd, const char *s, uint len) {
+	char buf[4096];
+	uint off = 0;
+	long nread;
+	while ((nread = read(fd, buf, sizeof(buf))) > 0) {
+		if (off + nread > len || memcmp(buf, s + off, nread)) return false;
+		off += nread;
+	}
+	return nread == 0 && off == len;
+}
+
+static int do_write(int dfd, const char *const *args, int nargs) {
+	const char *path = args[0], *s = args[1];
+	uint len = strlen(s);
+	if (!mkparents(dfd, path)) {
+		return fail("create parent directories of", path);
+	}
+	int fd = openat(dfd, path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1) return fail("create", path);
+	int ret = 0;
+	// don't touch the file if it's already right; something might care about
+	// its modification time
+	if (!same(fd, s, len)) {
+		if (ftruncate(fd, 0) == -1 || lseek(fd, 0, SEEK_SET) == -1 ||
+				!fd_writeall(fd, s, len)) {
+			ret = fail("write", path);
+		}
+	}
+	close(fd);
+	return ret;
+}
+
+// @cdep: the actual reading and tokenising of files is in cdep.c; this part
+// does the include path lookups the way a C preprocessor would, keeping paths
+// relative to workdir, exactly as given. every candidate path gets recorded as
+// an infile, even if it's not there, so that adding a header which would shadow
+// one further along the search path also causes a rescan. headers outside the
+// tree (i.e. system ones) are neither tracked nor scanned
+enum {
+	// include directories, in search order
+	CDEP_IQUOTE, CDEP_I, CDEP_ISYSTEM, CDEP_IDIRAFTER,
+	CDEP_NDIRKINDS,
+	CDEP_INCLUDE = CDEP_NDIRKINDS, CDEP_IMACROS,
+	CDEP_IGNORED // anything after here just has its argument skipped
+};
+static const char *const cdepopts[] = {
+	"-iquote", "-I", "-isystem", "-idirafter", "-include", "-imacros",
+	"-o", "-x", "-D", "-U", "-MF", "-MT", "-MQ", "-isysroot"
+};
+struct vec_cstr VEC(const char *);
+static struct vec_cstr incdirs[CDEP_NDIRKINDS] = {0};
+static int curdfd;
+static uint scanno = 0; // cdep_file marks; bumped for each @cdep task
+
+// returns the index into cdepopts of the option at args[*i], or -1 if it's a
+// source file or an option we don't care about, or -2 if the option's argument
+// is missing. the argument (or source file) goes in *arg; if it's separate from
+// the option itself, *i is moved along to it
+static int cdepopt(const char *const *args, int nargs, int *i,
+		const char **arg) {
+	*arg = args[*i];
+	if (**arg != '-') return -1;
+	for (int o = 0; o < sizeof(cdepopts) / sizeof(*cdepopts); ++o) {
+		uint len = strlen(cdepopts[o]);
+		if (strncmp(*arg, cdepopts[o], len)) continue;
+		if ((*arg)[len]) { *arg += len; return o; }
+		if (++*i == nargs) return -2;
+		*arg = args[*i];
+		return o;
+	}
+	return -1;
+}
+
+static int scanfile(const char *path);
+
+// tries dir/name, where dir may be empty to mean workdir itself
+static int tryinc(const char *dir, uint dirlen, const char *name) {
+	char path[PATH_MAX];
+	uint namelen = strlen(name);
+	if (dirlen + namelen + 1 >= sizeof(path)) return -1; // can't be there!
+	memcpy(path, dir, dirlen);
+	if (dirlen) path[dirlen++] = '/';
+	memcpy(path + dirlen, name, namelen + 1);
+	return scanfile(path);
+}
+
+// looks for an include the way the preprocessor would, and scans it if it's
+// found; if it's not, it's a system header or something the compiler will
+// complain about, so either way there's nothing more to do
+static int findinc(const char *from, char kind, const char *name) {
+	if (*name == '/') return 0; // never in the tree
+	int k = CDEP_I;
+	if (kind == '"') {
+		const char *slash = strrchr(from, '/');
+		int ret = tryinc(from, slash ? slash - from : 0, name);
+		if (ret != -1) return ret;
+		k = CDEP_IQUOTE;
+	}
+	for (; k < CDEP_NDIRKINDS; ++k) {
+		for (uint i = 0; i < incdirs[k].sz; ++i) {
+			const char *dir = incdirs[k].data[i];
+			int ret = tryinc(dir, strlen(dir), name);
+			if (ret != -1) return ret;
+		}
+	}
+	return 0;
+}
+
+// scans path (relative to workdir) and everything it includes; returns -1 with
+// errno set if it's not there, or otherwise an exit status
+static int scanfile(const char *path) {
+	// not in the tree, so all that matters is whether it's there
+	if (*path == '/') return faccessat(curdfd, path, F_OK, 0) == -1 ? -1 : 0;
+	if (!curinfile(path, curctxt)) return 100;
+	uint wdlen = strlen(curworkdir), len = strlen(path);
+	char joined[PATH_MAX];
+	if (wdlen + len + 1 >= sizeof(joined)) {
+		errno = ENAMETOOLONG;
+		return fail("read", path);
+	}
+	memcpy(joined, curworkdir, wdlen); joined[wdlen] = '/';
+	memcpy(joined + wdlen + 1, path, len + 1);
+	char *canon = malloc(wdlen + len + 2);
+	if (!canon) return fail("read", path);
+	if (fpath_canon(joined, canon, 0) != FPATH_OK) { // outside, via ../
+		free(canon);
+		return faccessat(curdfd, path, F_OK, 0) == -1 ? -1 : 0;
+	}
+	const char *key = db_intern_free(canon);
+	if (!key) { errno = ENOMEM; return fail("read", path); }
+	struct cdep_file *f = cdep_get(key);
+	if (!f) {
+		if (errno == ENOENT || errno == ENOTDIR || errno == EISDIR) return -1;
+		return fail("read", path);
+	}
+	if (f->mark == scanno) return 0; // already done, or include cycle
+	f->mark = scanno;
+	// f itself won't stay valid once other files are scanned, but this will
+	const char *incs = f->incs, *end = incs + f->incslen;
+	for (const char *p = incs; p < end; p += strlen(p) + 1) {
+		int ret = findinc(path, *p, p + 1);
+		if (ret) return ret;
+	}
+	return 0;
+}
+
+static int do_cdep(int dfd, const char *const *args, int nargs) {
+	for (int k = 0; k < CDEP_NDIRKINDS; ++k) incdirs[k].sz = 0;
+	const char *arg;
+	for (int i = 0; i < nargs; ++i) {
+		int opt = cdepopt(args, nargs, &i, &arg);
+		if (opt == -2) {
+			obuf_put0t(E, curname); obuf_put0t(E, ": missing argument to ");
+			obuf_put0t(E, arg); obuf_putc(E, '\n');
+			return 2;
+		}
+		if (opt >= 0 && opt < CDEP_NDIRKINDS &&
+				!vec_push(&incdirs[opt], arg)) {
+			errno = ENOMEM;
+			return fail("add include directory", arg);
+		}
+	}
+	curdfd = dfd;
+	++scanno;
+	for (int i = 0; i < nargs; ++i) {
+		int ret = 0, opt = cdepopt(args, nargs, &i, &arg);
+		if (opt == CDEP_INCLUDE || opt == CDEP_IMACROS) {
+			// these are looked for in workdir first, then like a "" include
+			ret = findinc("", '"', arg);
+		}
+		else if (opt == -1 && *arg != '-') {
+			ret = scanfile(arg);
+			if (ret == -1) ret = fail("read", arg);
+		}
+		if (ret) return ret;
+	}
+	return 0;
+}
+
+static const struct builtin {
+	const char *name;
+	int minargs, maxargs; // not counting argv[0]; maxargs -1 means unlimited
+	const char *usage;
+	int (*f)(int dfd, const char *const *args, int nargs);
+} builtins[] = {
+	{"@mkdir", 1, -1, "DIR...", &do_mkdir},
+	{"@cp", 2, -1, "SRC... DST", &do_cp},
+	{"@symlink", 2, 2, "TARGET LINK", &do_symlink},
+	{"@write", 2, 2, "FILE TEXT", &do_write},
+	{"@cdep", 1, -1, "[-I DIR]... [-include FILE]... SRC...", &do_cdep}
+};
+
+int builtin_run(const char *const *argv, const char *workdir, int errfd,
+		bool (*infile)(const char *path, void *ctxt), void *ctxt) {
+	E->fd = errfd; E->n = 0;
+	curname = argv[0]; curworkdir = workdir;
+	curinfile = infile; curctxt = ctxt;
+	const struct builtin *b = builtins;
+	for (; b - builtins < sizeof(builtins) / sizeof(*builtins); ++b) {
+		if (!strcmp(argv[0], b->name)) goto found;
+	}
+	obuf_put0t(E, "no such built-in task kind: ");
+	obuf_put0t(E, argv[0]); obuf_putc(E, '\n');
+	obuf_flush(E);
+	return 2;
+
+found:;
+	int nargs = 0;
+	for (const char *const *pp = argv + 1; *pp; ++pp) {
+		if (!**pp) {
+			obuf_put0t(E, argv[0]); obuf_put0t(E, ": empty argument\n");
+			obuf_flush(E);
+			return 2;
+		}
+		++nargs;
+	}
+	if (nargs < b->minargs || b->maxargs != -1 && nargs > b->maxargs) {
+		obuf_put0t(E, "usage: "); obuf_put0t(E, argv[0]);
+		obuf_putc(E, ' '); obuf_put0t(E, b->usage); obuf_putc(E, '\n');
+		obuf_flush(E);
+		return 2;
+	}
+	int ret;
+	int dfd = open(workdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd == -1) {
+		ret = fail("enter directory", workdir);
+	}
+	else {
+		ret = b->f(dfd, argv + 1, nargs);
+		close(dfd);
+	}
+	obuf_flush(E);
+	return ret;
+}
+
+// vi: sw=4 ts=4 noet tw=80 cc=80
@@ -0,0 +1,45 @@
+/* This file is dedicated to the public domain. */
+
+#ifndef INC_BUILTIN_H
+#define INC_BUILTIN_H
+
+#include <stdbool.h>
+
+/*
+ * Built-in tasks are ones whose argv[0] starts with an @; rather than spawning
+ * a process, build just does the thing itself, which is a whole lot cheaper for
+ * trivial stuff like making directories and copying files. They're otherwise
+ * just like any other task: results are cached in the db, and any files they
+ * read are recorded as infiles so they'll rerun if those files change.
+ *
+ * The built-ins are:
+ *   @mkdir DIR...         - like mkdir -p
+ *   @cp SRC... DST        - copies files; DST is a directory if it ends with a
+ *                           slash, or if there's more than one SRC
+ *   @symlink TARGET LINK  - like ln -sfn
+ *   @write FILE TEXT      - writes TEXT (exactly, with no newline added) to
+ *                           FILE, leaving it alone if it already matches
+ *   @cdep [OPTS...] SRC... - makes every header SRC includes (recursively) an
+ *                           infile; understands -I, -include, etc. as a C
+ *                           compiler would and ignores other options (see
+ *                           cdep.h)
+ * Missing parent directories are created for any files that are written.
+ *
+ * @lua is also built in, but it's rather more involved; see luatask.h. So is
+ * @worker, which is dealt with in task.c.
+ */
+
+static inline bool builtin_is(const char *argv0) { return *argv0 == '@'; }
+
+/*
+ * Runs a built-in task with paths relative to workdir, and returns an exit
+ * status just like a process would. Errors get written to errfd. Before any
+ * file is read, infile is called with the path exactly as given in argv; if it
+ * returns false, the task fails with status 100.
+ */
+int builtin_run(const char *const *argv, const char *workdir, int errfd,
+		bool (*infile)(const char *path, void *ctxt), void *ctxt);
+
+#endif
+
+// vi: sw=4 ts=4 noet tw=80 cc=80
@@ -0,0 +1,120 @@
+/* This file is dedicated to the public domain. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <basichashes.h>
+#include <intdefs.h>
+#include <table.h>
+#include <vec.h>
+
+#include "cdep.h"
+
+// files that have been scanned this run, keyed by interned path. a file can be
+// regenerated partway through a run (by a task that writes a header, say), so
+// each scan is only trusted while the file's identity still matches
+struct ent {
+	const char *path;
+	struct cdep_file f;
+	uvlong dev, inode, len;
+	struct timespec mtime;
+};
+static inline const char *kmemb_ent(const struct ent *e) { return e->path; }
+DECL_TABLE(static, cdepfile, const char *, struct ent)
+DEF_TABLE(static, cdepfile, hash_ptr, table_ideq, kmemb_ent)
+static struct table_cdepfile files = {0};
+
+struct vec_char VEC(char);
+
+// all files are read into here, one at a time
+static char *buf = 0;
+static uint bufsz = 0;
+
+static long readall(int fd) {
+	uint len = 0;
+	for (;;) {
+		if (len == bufsz) {
+			uint newsz = bufsz ? bufsz * 2 : 65536;
+			char *p = realloc(buf, newsz);
+			if (!p) return -1;
+			buf = p; bufsz = newsz;
+		}
+		long nread = read(fd, buf + len, bufsz - len);
+		if (nread == -1) return -1;
+		if (!nread) return len;
+		len += nread;
+	}
+}
+
+static inline bool isblank_(char c) { return c == ' ' || c == '\t'; }
+
+static bool scan(const char *s, const char *end, struct vec_char *out) {
+	// directives are rare enough that it's quickest to just look for #s and
+	// then check whether each one starts a line
+	for (const char *p = s; p = memchr(p, '#', end - p); ) {
+		const char *q = p++;
+		while (q > s && isblank_(q[-1])) --q;
+		if (q > s && q[-1] != '\n') continue;
+		while (p < end && isblank_(*p)) ++p;
+		if (end - p > 7 && !memcmp(p, "include", 7)) p += 7;
+		else if (end - p > 6 && !memcmp(p, "import", 6)) p += 6;
+		else continue;
+		while (p < end && isblank_(*p)) ++p;
+		if (p == end) break;
+		char kind = *p, close;
+		if (kind == '<') close = '>'; else if (kind == '"') close = '"';
+		else continue; // computed include, #include_next, or not a directive
+		const char *name = ++p;
+		while (p < end && *p != close && *p != '\n') ++p;
+		if (p == end) break;
+		if (*p != close || p == name) continue;
+		if (!vec_push(out, kind)) return false;
+		for (; name < p; ++name) if (!vec_push(out, *name)) return false;
+		if (!vec_push(out, '\0')) return false;
+	}
+	return true;
+}
+
+static bool sameident(const struct ent *e, const struct stat *s) {
+	return e->dev == s->st_dev && e->inode == s->st_ino &&
+			e->len == s->st_size && e->mtime.tv_sec == s->st_mtim.tv_sec &&
+			e->mtime.tv_nsec == s->st_mtim.tv_nsec;
+}
+
+struct cdep_file *cdep_get(const char *path) {
+	if (!files.data && !table_init_cdepfile(&files)) return 0;
+	bool isnew;
+	struct ent *e = table_putget_transact_cdepfile(&files, path, &isnew);
+	if (!e) return 0;
+	struct stat s;
+	if (!isnew) {
+		if (stat(path, &s) == -1) return 0;
+		if (sameident(e, &s)) return &e->f;
+	}
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return 0;
+	// stat before reading: if the file changes during the read, the next call
+	// will see a different identity and scan it again
+	long len = fstat(fd, &s) == -1 ? -1 : readall(fd);
+	int err = errno;
+	close(fd);
+	if (len == -1) { errno = err; return 0; }
+	struct vec_char incs = {0};
+	if (!scan(buf, buf + len, &incs)) { free(incs.data); return 0; }
+	// a rescanned file keeps its mark, so include cycles still terminate
+	uint mark = 0;
+	if (!isnew) { free((char *)e->f.incs); mark = e->f.mark; }
+	e->path = path;
+	e->f = (struct cdep_file){incs.data, incs.sz, mark};
+	e->dev = s.st_dev; e->inode = s.st_ino; e->len = s.st_size;
+	e->mtime = s.st_mtim;
+	if (isnew) table_transactcommit_cdepfile(&files);
+	return &e->f;
+}
+
+// vi: sw=4 ts=4 noet tw=80 cc=80
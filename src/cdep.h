@@ -0,0 +1,39 @@
+/* This file is dedicated to the public domain. */
+
+#ifndef INC_CDEP_H
+#define INC_CDEP_H
+
+#include <intdefs.h>
+
+/*
+ * The #include scanner behind the @cdep built-in (see builtin.h). Each file is
+ * only read once per run, no matter how many tasks end up including it; after
+ * that its list of includes just comes out of memory, for as long as a stat()
+ * shows the same device, inode, size and mtime.
+ *
+ * Scanning is purely lexical: every #include/#import line with a <> or "" name
+ * counts, whether it's behind an #if or not, so the result is a superset of
+ * what the compiler actually reads, which is fine for dependency purposes.
+ * Computed includes (#include MACRO) and #include_next are skipped.
+ */
+
+struct cdep_file {
+	// each include is '<' or '"', then the name, then a null terminator
+	const char *incs;
+	uint incslen;
+	uint mark; // zero to begin with; otherwise for the caller to do with as it
+	           // pleases (builtin.c uses it to avoid scanning a file twice)
+};
+
+/*
+ * Gets the includes of the file at path, which must be interned and canonical
+ * (relative to the base directory, like an infile). Returns null with errno
+ * set if the file can't be read; failures aren't cached, so a file created
+ * later in the run will still be found, and a file that's changed since its
+ * last scan is scanned again. The result is only valid until the next call.
+ */
+struct cdep_file *cdep_get(const char *path);
+
+#endif
+
+// vi: sw=4 ts=4 noet tw=80 cc=80
@@ -14,11 +14,13 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <errno.h>
 #include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-#include <basichashes.h>
 #include <errmsg.h>
 #include <intdefs.h>
 #include <iobuf.h>
@@ -27,13 +29,16 @@
 
 #include "db.h"
 #include "fd.h"
+#include "hash.h"
+#include "stats.h"
 
 // String pool (interning) allowing for O(1) string comparisons and hashing, and
 // also saving some memory and making allocation lifetimes easier (everything
 // just hangs around forever, or gets freed if it's a dupe).
 // Strings are additionally appended to a file disk upon initial interning and
 // reloaded later so the dependency database can reference strings using
-// fixed-length IDs, saving space.
+// fixed-length IDs, saving space. Each one's hash is written along with it, but
+// that's only of use within the same run (see hash.h), so it's redone on load.
 
 static int fd;
 
@@ -60,22 +65,41 @@ static struct hls memb_hls(const struct ent *e) { return *(struct hls *)e; }
 DEF_TABLE(static, strpool, hash_precomp, eq_hls, memb_hls)
 static struct table_strpool tab;
 
+// keeps the memory estimate in stats up to date after anything's put in tab
+static void countput(uint oldsz, uint len) {
+	if (tab.sz != oldsz) {
+		++stats.strrehashes;
+		stats.strmem += (tab.sz - oldsz) * sizeof(struct ent) +
+				(tab.sz - oldsz) / 8; // + flags
+	}
+	stats.strmem += len + 1 + sizeof(const char *); // + slot in indexed
+}
+
 static uvlong strlen_and_hash(const char *s) {
-	uint len = 0;
-	uint h = HASH_ITER_INIT;
-	for (; *s ; ++s) { ++len; h = hash_iter(h, *s); }
+	uint len;
+	uint h = hash_str(s, &len);
 	return (uvlong)h | (uvlong)len << 32;
 }
 
 struct list VEC(const char *);
 static struct list indexed = {0};
 
-void strpool_init(void) {
+void strpool_init(bool readonly) {
 const char *Lastfullstr = 0;
+	hash_seed = (uvlong)arc4random() << 32 | arc4random();
 	if (!table_init_strpool(&tab)) {
 		errmsg_die(100, msg_fatal, "couldn't create string pool table");
 	}
-	fd = openat(db_dirfd, "strings", O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+	stats.strmem = tab.sz * sizeof(struct ent) + tab.sz / 8;
+	if (readonly) {
+		// nothing new ever gets interned (writes to -1 just fail), so a
+		// missing file is the same as an empty one
+		fd = openat(db_dirfd, "strings", O_RDONLY | O_CLOEXEC);
+		if (fd == -1 && errno == ENOENT) return;
+	}
+	else {
+		fd = openat(db_dirfd, "strings", O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+	}
 	if (fd == -1) errmsg_die(100, "couldn't open .builddb/strings");
 	union {
 		struct ibuf b;
@@ -89,7 +113,7 @@ const char *Lastfullstr = 0;
 		if (nread == -1) goto e;
 		if (nread == 0) break; // EOF here is fine! we're done!
 		if (nread != sizeof(hl)) {
-			errmsg_warnx("eof on hl");
+			if (!readonly) errmsg_warnx("eof on hl");
 			goto eof;
 		}
 		uint len = hl >> 32;
@@ -107,12 +131,15 @@ const char *Lastfullstr = 0;
 		if (nread == -1) goto e;
 		if (nread != len) {
 			s[nread] = '\0';
-			errmsg_warnx("eof on s");
+			if (!readonly) errmsg_warnx("eof on s");
 			goto eof;
 		}
 		// vec_pop(&s); // remove the extra \0 - doesn't actually matter here
+		hl = strlen_and_hash(s);
+		uint oldsz = tab.sz;
 		struct ent *e = table_put_strpool(&tab, (struct hls){hl, s});
 		if (!e) goto e;
+		countput(oldsz, len);
 		e->hash_and_len = hl;
 		e->s = s;
 		if (!vec_push(&indexed, s)) goto e;
@@ -120,20 +147,34 @@ const char *Lastfullstr = 0;
 	}
 
 	return;
-eof:errmsg_diex(2, msg_fatal, "invalid strings file: unexpected EOF (last: ",
+	// a build that's still going could be partway through adding a string;
+	// the tables being read won't refer to that one anyway
+eof:if (readonly) return;
+	errmsg_diex(2, msg_fatal, "invalid strings file: unexpected EOF (last: ",
 			Lastfullstr, ")");
 e:	errmsg_die(100, msg_fatal, "couldn't load strings database");
 }
 
-const char *db_intern(const char *s) {
+// if copy is set, s is only around temporarily, so gets copied if it's new
+static const char *intern(const char *s, bool copy) {
 	bool isnew;
 	uvlong hl = strlen_and_hash(s);
+	uint oldsz = tab.sz;
 	struct ent *e = table_putget_transact_strpool(&tab, (struct hls){hl, s},
 			&isnew);
 	if (!e) return 0;
-	if (isnew) {
-		if (!vec_push(&indexed, s)) return 0;
+	if (!isnew) {
+		++stats.strhits;
+	}
+	else {
+		++stats.strmisses;
 		uint len = hl >> 32;
+		if (copy) {
+			char *dup = malloc(len + 1);
+			if (!dup) return 0;
+			s = memcpy(dup, s, len + 1);
+		}
+		if (!vec_push(&indexed, s)) { if (copy) free((char *)s); return 0; }
 		vlong pos = lseek(fd, 0, SEEK_CUR);
 		// XXX this isn't power-fail-safe, must decide whether I care about that
 		if (!fd_writeall(fd, &hl, sizeof(hl)) || !fd_writeall(fd, s, len)) {
@@ -141,22 +182,67 @@ const char *db_intern(const char *s) {
 			// are probably bigger fish to fry
 			lseek(fd, pos, SEEK_SET);
 			ftruncate(fd, pos);
+			--indexed.sz; // (never got its index, so nothing refers to it)
+			if (copy) free((char *)s);
 			return 0;
 		}
 		e->hash_and_len = hl;
 		e->s = s;
 		e->idx = indexed.sz - 1;
 		table_transactcommit_strpool(&tab);
+		countput(oldsz, len);
 	}
 	return e->s;
 }
 
+const char *db_intern(const char *s) { return intern(s, false); }
+const char *db_intern_tmp(const char *s) { return intern(s, true); }
+
 const char *db_intern_free(char *s) {
 	const char *ret = db_intern(s);
 	if (ret && ret != s) free(s);
 	return ret;
 }
 
+// argvs get similar treatment, so that decoding the same dep over and over
+// doesn't keep allocating new arrays (these aren't saved to disk, though)
+static uint hash_argv(const char *const *argv) {
+	uvlong h = hash_seed;
+	for (; *argv; ++argv) h = hash_mix(h ^ (ulong)*argv, HASH_K);
+	return hash_fold(h);
+}
+static bool eq_argv(const char *const *argv1, const char *const *argv2) {
+	for (;; ++argv1, ++argv2) {
+		if (*argv1 != *argv2) return false;
+		if (!*argv1) return true; // implies !*argv2
+	}
+}
+DECL_TABLE(static, argv, const char *const *, const char *const *)
+DEF_TABLE(static, argv, hash_argv, eq_argv, table_scalarmemb)
+static struct table_argv argvtab = {0};
+
+const char *const *db_internargv(const char *const *argv) {
+	if (!argvtab.data && !table_init_argv(&argvtab)) return 0;
+	bool isnew;
+	const char *const **e = table_putget_transact_argv(&argvtab, argv, &isnew);
+	if (!e) return 0;
+	if (isnew) {
+		uint n = 1;
+		for (const char *const *pp = argv; *pp; ++pp) ++n;
+		const char **copy = malloc(n * sizeof(*copy));
+		if (!copy) return 0;
+		*e = memcpy(copy, argv, n * sizeof(*copy));
+		table_transactcommit_argv(&argvtab);
+	}
+	return *e;
+}
+
+const char *db_findstr(const char *s) {
+	uvlong hl = strlen_and_hash(s);
+	struct ent *e = table_get_strpool(&tab, (struct hls){hl, s});
+	return e ? e->s : 0;
+}
+
 // assumes the string is actually in there
 uint strpool_getidx(const char *s) {
 	return table_get_strpool(&tab, (struct hls){strlen_and_hash(s), s})->idx;
@@ -17,6 +17,7 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -32,20 +33,30 @@
 
 #include "db.h"
 #include "defs.h"
+#include "stats.h"
 #include "tableshared.h"
 
 // TODO(db-opt): this whole file :)
 
 // from db-strpool.c (no header because who cares)
-void strpool_init(void);
+void strpool_init(bool readonly);
 uint strpool_getidx(const char *s);
 const char *strpool_fromidx(uint idx);
 
 int db_dirfd;
 uint db_newness = 1; // start at 1 (as 0 is used for newly-created entries)
 static uint nexttaskid = 0; // just a serial number
+static bool readonly = false; // for build-query; see db_init_readonly()
 
-#define DBVER 1 // increase if something gets broken!
+#define DBVER 2 // increase if something gets broken!
+static int dbver = DBVER; // what was actually loaded (see checkversion())
+
+// the part of a db_taskresult that gets saved as-is: all but the 2 pointers
+#define SAVEDSZ (sizeof(struct db_taskresult) - sizeof(void *) * 2)
+// version 1 had no durms, just padding where it is now - or on 32-bit, nothing
+// at all. either way, that's the offset of durms rounded up to pointer size
+#define SAVEDSZ_V1 ((offsetof(struct db_taskresult, durms) + \
+		sizeof(void *) - 1) & -sizeof(void *))
 
 static bool savesymstr(const char *name, const char *val) {
 	// create a new symlink and rename it to atomically replace the old one
@@ -83,6 +94,20 @@ static vlong loadsymnum(const char *name, const char **errstr) {
 DEF_PERMALLOC(infile, struct db_infile, 4096)
 DEF_PERMALLOC(taskresult, struct db_taskresult, 4096)
 
+// permalloc never gives anything back, so the stats just count up what's been
+// handed out (not the slack at the end of the latest chunk)
+static struct db_infile *newinfile(void) {
+	struct db_infile *i = permalloc_infile();
+	if (i) stats.permem += sizeof(*i);
+	return i;
+}
+
+static struct db_taskresult *newtaskresult(void) {
+	struct db_taskresult *r = permalloc_taskresult();
+	if (r) stats.permem += sizeof(*r);
+	return r;
+}
+
 struct lookup_infile {
 	const char *path;
 	struct db_infile *i;
@@ -117,7 +142,39 @@ static noreturn diemem(void) {
 	errmsg_die(100, msg_fatal, "couldn't allocate memory for task database");
 }
 
+static void checkversion(void) {
+	// XXX all this error handling is far from perfect in terms of simplicity
+	const char *errstr = 0;
+	errno = 0;
+	int dbversion = loadsymnum("version", &errstr); // ignore overflow, shrug
+	if (errno == ENOENT) {
+		if (readonly) {
+			errmsg_diex(2, msg_fatal, "no task database in "BUILDDB_DIR);
+		}
+		if (!savesymnum("version", DBVER)) {
+			errmsg_die(100, msg_fatal, "couldn't create task database");
+		}
+	}
+	else if (errno == EINVAL) {
+		// status 2: user has messed with something, not our fault!
+		errmsg_diex(2, msg_fatal, "task database version is ", errstr);
+	}
+	else if (errno) {
+		errmsg_die(100, msg_fatal, "couldn't read task database version");
+	}
+	else if (dbversion == 1) {
+		// only missing task durations; load() fills those in as unknown and
+		// db_finalise() saves everything back as the current version
+		dbver = 1;
+	}
+	else if (dbversion != DBVER) {
+		errmsg_diex(1, msg_fatal, "unsupported task database version; "
+				"try rm -rf "BUILDDB_DIR"/");
+	}
+}
+
 static void unlock(void) { unlinkat(db_dirfd, "lock", 0); }
+static void load(void);
 
 void db_init(void) {
 	if (mkdir(BUILDDB_DIR, 0755) == -1 && errno != EEXIST) {
@@ -172,29 +229,24 @@ void db_init(void) {
 	// inform the user of their severe mishandling of their tools
 	errmsg_diex(2, msg_fatal, "user is grossly incompetent");
 ok:	atexit(&unlock);
-	// XXX all this error handling is far from perfect in terms of simplicity
-	const char *errstr = 0;
-	errno = 0;
-	int dbversion = loadsymnum("version", &errstr); // ignore overflow, shrug
-	if (errno == ENOENT) {
-		if (!savesymnum("version", DBVER)) {
-			errmsg_die(100, msg_fatal, "couldn't create task database");
+	load();
+}
+
+void db_init_readonly(void) {
+	readonly = true;
+	db_dirfd = open(BUILDDB_DIR, O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+	if (db_dirfd == -1) {
+		if (errno == ENOENT) {
+			errmsg_diex(2, msg_fatal, "no task database in "BUILDDB_DIR);
 		}
+		errmsg_die(100, msg_fatal, "couldn't open "BUILDDB_DIR" directory");
 	}
-	else if (errno == EINVAL) {
-		// status 2: user has messed with something, not our fault!
-		errmsg_diex(2, msg_fatal, "task database version is ", errstr);
-	}
-	else if (errno) {
-		errmsg_die(100, msg_fatal, "couldn't read task database version");
-	}
-	else if (dbversion != DBVER) {
-		// can add migration or something later if we actually bump the
-		// version, but this is fine for now
-		errmsg_diex(1, msg_fatal, "unsupported task database version; "
-				"try rm -rf "BUILDDB_DIR"/");
-	}
-	errstr = 0;
+	load();
+}
+
+static void load(void) {
+	checkversion();
+	const char *errstr = 0;
 	errno = 0;
 	uint newness = loadsymnum("newness", &errstr); // ignore overflow again
 	if (errno == EINVAL) {
@@ -209,21 +261,24 @@ ok:	atexit(&unlock);
 		db_newness = newness;
 	}
 	// bump newness immediately: if we crash, later rebuilds won't be prevented
-	if (!savesymnum("newness", db_newness + 1)) {
+	if (!readonly && !savesymnum("newness", db_newness + 1)) {
 		errmsg_die(100, msg_fatal, "couldn't update task database");
 	}
-	strpool_init();
-	int fd = openat(db_dirfd, "tables", O_RDONLY, 0644);
+	// open the tables before loading strings: that way, if a build finishes in
+	// between (see db_init_readonly()), these tables can only refer to strings
+	// that are already in the file
+	int fd = openat(db_dirfd, "tables", O_RDONLY | O_CLOEXEC);
+	if (fd == -1 && errno != ENOENT) {
+		errmsg_die(100, msg_fatal, "couldn't open "BUILDDB_DIR"/tables");
+	}
+	strpool_init(readonly);
 	if (fd == -1) {
-		if (errno == ENOENT) {
-			// setup default tables instead
-			if (!table_init_lookup_infile(&infiles) ||
-					!table_init_lookup_taskresult(&results)) {
-				errmsg_die(100, msg_fatal, "couldn't allocate hashtable");
-			}
-			return;
+		// setup default tables instead
+		if (!table_init_lookup_infile(&infiles) ||
+				!table_init_lookup_taskresult(&results)) {
+			errmsg_die(100, msg_fatal, "couldn't allocate hashtable");
 		}
-		errmsg_die(200, msg_fatal, "couldn't open "BUILDDB_DIR"/strings");
+		return;
 	}
 	union {
 		struct ibuf b;
@@ -252,7 +307,7 @@ ok:	atexit(&unlock);
 		struct lookup_infile *p = table_put_lookup_infile(&infiles, path);
 		if (!p) diemem(); // rehash could happen (and fail) if (very) unlucky
 		p->path = path;
-		p->i = permalloc_infile();
+		p->i = newinfile();
 		if (!p->i) diemem();
 		n = ibuf_getbytes(b, p->i, sizeof(*p->i));
 		checkread(n, sizeof(*p->i));
@@ -290,13 +345,13 @@ ok:	atexit(&unlock);
 		struct lookup_taskresult *p = table_put_lookup_taskresult(&results, d);
 		if (!p) diemem();
 		p->desc = d;
-		p->r = permalloc_taskresult();
+		p->r = newtaskresult();
 		if (!p->r) diemem();
 		// NOTE: relies on layout of db_taskresult (2 pointers at the end)
-		// also note: could leave out 4 bytes of padding too, but then we're
-		// making more assumptions about padding so... meh
-		n = ibuf_getbytes(b, p->r, sizeof(*p->r) - sizeof(void *) * 2);
-		checkread(n, sizeof(*p->r) - sizeof(void *) * 2);
+		uint sz = dbver == 1 ? SAVEDSZ_V1 : SAVEDSZ;
+		n = ibuf_getbytes(b, p->r, sz);
+		checkread(n, sz);
+		if (dbver == 1) p->r->durms = -1u;
 		if (p->r->id >= nexttaskid) nexttaskid = p->r->id + 1;
 		const char **infiles = malloc(p->r->ninfiles * sizeof(*p->r->infiles));
 		if (!infiles) diemem();
@@ -339,7 +394,7 @@ struct db_infile *db_getinfile(const char *path) {
 			path, &isnew);
 	if (!l) return 0;
 	if (isnew) {
-		struct db_infile *i = permalloc_infile();
+		struct db_infile *i = newinfile();
 		if (!i) return 0;
 		i->newness = 0;
 		// hack(?): other db_infile initialisation is unnecessary -
@@ -359,13 +414,14 @@ struct db_taskresult *db_gettaskresult(struct task_desc desc) {
 			&results, desc, &isnew);
 	if (!l) return 0;
 	if (isnew) {
-		struct db_taskresult *r = permalloc_taskresult();
+		struct db_taskresult *r = newtaskresult();
 		if (!r) return 0;
 		r->newness = 0;
 		r->checked = false;
 		r->id = nexttaskid++;
 		r->ninfiles = 0;
 		r->ndeps = 0;
+		r->durms = -1u;
 		r->infiles = 0;
 		r->deps = 0;
 		l->desc = desc;
@@ -375,6 +431,21 @@ struct db_taskresult *db_gettaskresult(struct task_desc desc) {
 	return l->r;
 }
 
+struct db_infile *db_findinfile(const char *path) {
+	struct lookup_infile *l = table_get_lookup_infile(&infiles, path);
+	return l ? l->i : 0;
+}
+
+struct db_taskresult *db_findtaskresult(struct task_desc desc) {
+	struct lookup_taskresult *l = table_get_lookup_taskresult(&results, desc);
+	return l ? l->r : 0;
+}
+
+void db_foreachtaskresult(void (*f)(struct task_desc desc,
+		struct db_taskresult *r, void *ctxt), void *ctxt) {
+	TABLE_FOREACH_PTR(p, lookup_taskresult, &results) f(p->desc, p->r, ctxt);
+}
+
 static bool needwrite = false;
 
 // these are currently almost no-ops (see TODO(db-opt))
@@ -383,7 +454,7 @@ void db_committaskresult(struct db_taskresult *t) { needwrite = true; }
 
 // NOTE: this function doesn't bother closing files since we're about to exit!
 void db_finalise(void) {
-	if (!needwrite) return;
+	if (!needwrite && dbver == DBVER) return;
 	int fd = openat(db_dirfd, "newtables", O_RDWR | O_CREAT | O_TRUNC, 0644);
 	if (fd == -1) {
 		errmsg_warn(msg_crit, "couldn't open "BUILDDB_DIR"/newtables");
@@ -423,10 +494,7 @@ void db_finalise(void) {
 		if (!obuf_putbytes(b, (char *)&idx, sizeof(idx))) goto e;
 		p->r->checked = false;
 		// same thing with the - 2 pointers
-		if (!obuf_putbytes(b, (char *)p->r, sizeof(*p->r) -
-				sizeof(void *) * 2)) {
-			goto e;
-		}
+		if (!obuf_putbytes(b, (char *)p->r, SAVEDSZ)) goto e;
 		for (const char *const *pp = p->r->infiles;
 				pp - p->r->infiles < p->r->ninfiles; ++pp) {
 			idx = strpool_getidx(*pp);
@@ -452,6 +520,11 @@ void db_finalise(void) {
 		errmsg_warn(msg_crit, "couldn't commit saved database file");
 		goto e;
 	}
+	// only after the tables: on 64-bit, tables that are newer than the version
+	// says still load fine, just with the durations thrown away
+	if (dbver != DBVER && !savesymnum("version", DBVER)) {
+		errmsg_warn(msg_crit, "couldn't update task database version");
+	}
 
 	return;
 e:	errmsg_warnx("unnecessary reruns will happen in the future!");
@@ -42,7 +42,7 @@ struct db_taskresult {
 	// char padding[2]; :(
 	uint id; // used for unique out/err filenames
 	uint ninfiles, ndeps; // counts (together for packing)
-	// char ugh_even_more_padding[4];
+	uint durms; // time spent actually running last time; -1 if not known
 	const char *const *infiles;
 	const struct task_desc *deps;
 };
@@ -50,6 +50,14 @@ struct db_taskresult {
 void db_init(void);
 void db_finalise(void);
 
+/*
+ * alternative to db_init() for build-query: loads the db without taking the
+ * lock (so a build can be going at the same time) and never writes anything
+ * back. nothing new can be interned, so use db_findstr() for lookups instead.
+ * exits with status 2 if there's no db to load.
+ */
+void db_init_readonly(void);
+
 /*
  * moves a string into the string pool if necessary; the string should be in
  * static/global memory.
@@ -64,6 +72,23 @@ const char *db_intern(const char *s);
  */
 const char *db_intern_free(char *s);
 
+/*
+ * interns a string that's only around temporarily (eg in a buffer that's about
+ * to be reused), copying it into the pool only if it isn't in there already.
+ * returns the interned string, or null on failure
+ */
+const char *db_intern_tmp(const char *s);
+
+/*
+ * returns a lasting copy of a null-terminated array of interned strings, shared
+ * with every other identical one that's been through here, or null on failure.
+ * the result must never be freed
+ */
+const char *const *db_internargv(const char *const *argv);
+
+/* returns the interned copy of a string, or null if it isn't in the pool */
+const char *db_findstr(const char *s);
+
 extern int db_dirfd;
 extern uint db_newness;
 
@@ -75,6 +100,14 @@ extern uint db_newness;
 struct db_infile *db_getinfile(const char *path);
 struct db_taskresult *db_gettaskresult(struct task_desc desc);
 
+/* these just look entries up, returning null if there isn't one */
+struct db_infile *db_findinfile(const char *path);
+struct db_taskresult *db_findtaskresult(struct task_desc desc);
+
+/* calls f for every task in the db, in no particular order */
+void db_foreachtaskresult(void (*f)(struct task_desc desc,
+		struct db_taskresult *r, void *ctxt), void *ctxt);
+
 void db_commitinfile(struct db_infile *i);
 void db_committaskresult(struct db_taskresult *t);
 
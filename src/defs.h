@@ -23,6 +23,8 @@
 
 #define ENV_ROOT_DIR "BUILD_ROOT_DIR"
 #define ENV_SOCKFD "_BUILD_SOCK_FD" /* var name should not be relied upon! */
+#define ENV_SOCKADDR "_BUILD_SOCK_ADDR" /* " */
+#define ENV_TOKEN "_BUILD_TOKEN" /* " */
 
 /* and random general structs that don't belong anywhere else */
 
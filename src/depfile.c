@@ -0,0 +1,67 @@
+/* This file is dedicated to the public domain. */
+
+#include <stdbool.h>
+
+#include <intdefs.h>
+
+#include "depfile.h"
+
+static inline bool isblank_(char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+// true if p is at a backslash-newline, setting *n to its length
+static inline bool iscont(const char *p, const char *end, int *n) {
+	if (*p != '\\' || end - p < 2) return false;
+	if (p[1] == '\n') { *n = 2; return true; }
+	if (p[1] == '\r' && end - p > 2 && p[2] == '\n') { *n = 3; return true; }
+	return false;
+}
+
+// a colon only separates targets from prerequisites if there's a space or the
+// end of a line after it - otherwise it's probably a Windows drive letter
+static inline bool issep(const char *p, const char *end) {
+	int n;
+	return *p == ':' && (p + 1 == end || isblank_(p[1]) || p[1] == '\n' ||
+			iscont(p + 1, end, &n));
+}
+
+bool depfile_parse(char *buf, uint len,
+		bool (*f)(const char *path, void *ctxt), void *ctxt) {
+	char *p = buf, *end = buf + len;
+	bool targets = true; // still on the left of the colon
+	int n;
+	while (p < end) {
+		if (isblank_(*p)) { ++p; continue; }
+		if (iscont(p, end, &n)) { p += n; continue; }
+		if (*p == '\n') { targets = true; ++p; continue; }
+		if (*p == '#') { // compilers don't write comments, but still...
+			while (p < end && *p != '\n') ++p;
+			continue;
+		}
+		if (issep(p, end)) { targets = false; ++p; continue; }
+		// unescaping only ever makes a word shorter, so it's just copied down
+		// over itself as it goes
+		char *start = p, *w = p;
+		while (p < end && !isblank_(*p) && *p != '\n' && !iscont(p, end, &n) &&
+				!issep(p, end)) {
+			if (*p == '\\' && p + 1 < end && (p[1] == ' ' || p[1] == '#')) ++p;
+			else if (*p == '$' && p + 1 < end && p[1] == '$') ++p;
+			*w++ = *p++;
+		}
+		// w might be right on top of whatever ended the word, so deal with
+		// that before putting the terminator in
+		bool sep = false, eol = false;
+		if (p < end) {
+			if (issep(p, end)) sep = true; else if (*p == '\n') eol = true;
+			if (iscont(p, end, &n)) p += n; else ++p;
+		}
+		*w = '\0';
+		if (!sep && !targets && !f(start, ctxt)) return false;
+		if (sep) targets = false;
+		if (eol) targets = true;
+	}
+	return true;
+}
+
+// vi: sw=4 ts=4 noet tw=80 cc=80
@@ -0,0 +1,22 @@
+/* This file is dedicated to the public domain. */
+
+#ifndef INC_DEPFILE_H
+#define INC_DEPFILE_H
+
+#include <stdbool.h>
+
+#include <intdefs.h>
+
+/*
+ * Parses a Makefile-style dependency file, as written by cc -MD and the like,
+ * calling f with each prerequisite of each rule in turn; targets are skipped.
+ * Escaped spaces and #s and doubled $s are dealt with, and continuation lines
+ * are joined up. The parsing is done in place, in buf, which must have room for
+ * one more byte after len. Returns false only if f does.
+ */
+bool depfile_parse(char *buf, uint len,
+		bool (*f)(const char *path, void *ctxt), void *ctxt);
+
+#endif
+
+// vi: sw=4 ts=4 noet tw=80 cc=80
@@ -0,0 +1,53 @@
+/* This file is dedicated to the public domain. */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <str.h>
+
+#include "defs.h"
+#include "desc.h"
+
+// this function *should* be safe, although it's only actually used for printing
+// user-friendly messages right now, not for actually doing anything shell-based
+static inline bool shellesc(struct str *s, const char *p) {
+	// if there's shell-looking characters, wrap in single quotes, escaping
+	// single quotes specially, otherwise try to keep it simple
+	if (strpbrk(p, " \t\n\"'`<>&#~*$|(){};?!\\")) {
+		if (!str_appendc(s, '\'')) return false;
+		for (; *p; ++p) {
+			if (*p == '\'') {
+				if (!str_appendbytes(s, "'\\''", 4)) return false;
+			}
+			else {
+				if (!str_appendc(s, *p)) return false;
+			}
+		}
+		return str_appendc(s, '\'');
+	}
+	// if there's no special chars just use the string itself directly
+	return str_append0t(s, p);
+}
+
+char *desctostr(const struct task_desc *t) {
+	int e = errno;
+	struct str s = {0};
+	if (!str_clear(&s)) return 0;
+	if (!shellesc(&s, *t->argv)) goto e;
+	for (const char *const *argv = t->argv + 1; *argv; ++argv) {
+		if (!str_appendc(&s, ' ')) goto e;
+		if (!shellesc(&s, *argv)) goto e;
+	}
+	if (t->workdir[0] != '.' || t->workdir[1]) { // not in base dir
+		if (!str_append0t(&s, "` in `")) goto e;
+		if (!str_append0t(&s, t->workdir)) goto e;
+	}
+	return s.data;
+e:	free(s.data);
+	errno = e;
+	return 0;
+}
+
+// vi: sw=4 ts=4 noet tw=80 cc=80
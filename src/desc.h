@@ -0,0 +1,20 @@
+/* This file is dedicated to the public domain. */
+
+#ifndef INC_DESC_H
+#define INC_DESC_H
+
+#include "defs.h"
+
+/*
+ * Renders a task as a human-readable command line, with any arguments that
+ * look like they need it quoted shell-style, followed by "` in `" and the
+ * working directory if that's not the base directory (the result is meant to
+ * go between backticks). Returns a malloc()ed string, or null if out of memory
+ * (in which case errno is left as it was, since this is mostly used while
+ * reporting some other error).
+ */
+char *desctostr(const struct task_desc *t);
+
+#endif
+
+// vi: sw=4 ts=4 noet tw=80 cc=80
@@ -0,0 +1,314 @@
+/* This file is dedicated to the public domain. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <errmsg.h>
+#include <fmt.h>
+#include <intdefs.h>
+
+#include "build.h"
+#include "defs.h"
+#include "events.h"
+#include "evloop.h"
+#include "json.h"
+#include "proc.h"
+#include "time.h"
+#include "tui.h"
+
+bool events_on = false;
+
+static int fd = -1;
+static bool isreg; // regular files can't hold anything up, so skip the checks
+static vlong epoch;
+
+// output that's waiting to be written is buf[head] up to buf[tail]
+static char *buf = 0;
+static uint bufmax = 0, head = 0, tail = 0;
+static uint evstart; // where the event currently being put together began
+static bool overflow = false; // couldn't fit that event in, so drop it
+static uvlong ndropped = 0;
+static bool saiddropped = false; // that event's led by a count of the above
+
+// this much unwritten output means the reader has fallen way behind
+#define MAXPENDING (1u << 20)
+// a lot can happen in one trip round the event loop, so don't always wait
+#define FLUSHPENDING (1u << 16)
+
+#define SNAPSHOT_INTERVAL 1000 // ms
+
+static bool flushing = false; // flush timer's scheduled already
+static bool waiting = false; // waiting in the event loop for fd to be writable
+static struct evloop_timer flushtimer, snaptimer;
+
+static void put(const char *s, uint n) {
+	if (overflow) return;
+	if (tail + n > bufmax) {
+		uint newmax = bufmax ? bufmax * 2 : 4096;
+		while (newmax < tail + n) newmax *= 2;
+		char *new = realloc(buf, newmax);
+		if (!new) { overflow = true; return; }
+		buf = new;
+		bufmax = newmax;
+	}
+	memcpy(buf + tail, s, n);
+	tail += n;
+}
+
+static void put0t(const char *s) { put(s, strlen(s)); }
+
+static void putnum(uvlong n) {
+	char b[21];
+	put(b, fmt_fixed_u64(b, n));
+}
+
+static void putstrpart(const char *p, uint n, void *unused) { put(p, n); }
+
+static void putstr(const char *s) { json_putstr(s, &putstrpart, 0); }
+
+static void stop(void) {
+	errmsg_warn(msg_warn, "couldn't write events");
+	errmsg_warnx(msg_note, "no more events will be written");
+	if (waiting) evloop_onfd_remove(fd);
+	close(fd);
+	events_on = false;
+}
+
+static void cb_writable(int unused, short revents, void *ctxt);
+
+// writes as much as can be written without blocking
+static void flush(void) {
+	while (head < tail) {
+		uint n = tail - head;
+		if (!isreg) {
+			// pipes and sockets will always take PIPE_BUF bytes without
+			// blocking if they say they're writable. checking this way rather
+			// than using O_NONBLOCK avoids messing with a descriptor that's
+			// shared with whoever started us
+			struct pollfd p = {fd, POLLOUT};
+			if (poll(&p, 1, 0) == -1) {
+				if (errno == EINTR) continue;
+				stop();
+				return;
+			}
+			if (!(p.revents & (POLLOUT | POLLERR | POLLHUP))) goto w;
+			if (n > PIPE_BUF) n = PIPE_BUF;
+		}
+		long nw = write(fd, buf + head, n);
+		if (nw == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) goto w;
+			stop();
+			return;
+		}
+		head += nw;
+	}
+	head = tail = 0;
+	if (waiting) {
+		evloop_onfd_remove(fd);
+		waiting = false;
+	}
+	return;
+
+w:	if (!waiting) {
+		if (!evloop_onfd(fd, EV_OUT, &cb_writable, 0)) { stop(); return; }
+		waiting = true;
+	}
+	// don't let the already-written part take up space forever
+	if (head > bufmax / 2) {
+		memmove(buf, buf + head, tail - head);
+		tail -= head;
+		head = 0;
+	}
+}
+
+static void cb_writable(int unused, short revents, void *ctxt) { flush(); }
+
+static void flushcb(struct evloop_timer *unused) {
+	flushing = false;
+	if (events_on && !waiting) flush();
+}
+
+// starts off an event object, leaving it open for the rest of the fields
+static void event(const char *name) {
+	evstart = tail;
+	overflow = false;
+	saiddropped = false;
+	if (ndropped && tail - head < MAXPENDING / 2) {
+		// caught up enough, so say what got missed
+		put0t("{\"t\":");
+		putnum(time_now() - epoch);
+		put0t(",\"event\":\"dropped\",\"count\":");
+		putnum(ndropped);
+		put0t("}\n");
+		saiddropped = true;
+	}
+	put0t("{\"t\":");
+	putnum(time_now() - epoch);
+	put0t(",\"event\":\"");
+	put0t(name);
+	put0t("\"");
+}
+
+static void endevent(void) {
+	put0t("}\n");
+	if (overflow || tail - head > MAXPENDING) {
+		tail = evstart;
+		overflow = false;
+		++ndropped;
+		return;
+	}
+	if (saiddropped) ndropped = 0;
+	// try again every time another FLUSHPENDING bytes pile up, even while
+	// waiting, since the reader may well have caught up in the meantime
+	if ((tail - head) / FLUSHPENDING > (evstart - head) / FLUSHPENDING) {
+		flush();
+		return;
+	}
+	// otherwise, everything from this trip round the event loop goes out in
+	// one go
+	if (!flushing && !waiting) {
+		flushtimer.deadline = time_now();
+		evloop_sched(&flushtimer);
+		flushing = true;
+	}
+}
+
+static void taskevent(const char *name, uint id) {
+	event(name);
+	put0t(",\"id\":");
+	putnum(id);
+}
+
+static void snapcb(struct evloop_timer *unused) {
+	if (!events_on) return;
+	event("snapshot");
+	put0t(",\"active\":");
+	putnum(nactive);
+	put0t(",\"blocked\":");
+	putnum(nblocked);
+	put0t(",\"queued\":");
+	putnum(qlen);
+	put0t(",\"done\":");
+	putnum(tui_ndone);
+	endevent();
+	snaptimer.deadline += SNAPSHOT_INTERVAL;
+	evloop_sched(&snaptimer);
+}
+
+static struct evloop_timer flushtimer = {.cb = &flushcb};
+static struct evloop_timer snaptimer = {.cb = &snapcb};
+
+// a reader that goes away should just mean no more events, not a dead build. a
+// handler rather than SIG_IGN, so that tasks get the default back on exec()
+static void onsigpipe(int unused) {}
+
+bool events_init(const char *dest) {
+	const char *errstr;
+	int n = strtonum(dest, 0, INT_MAX, &errstr);
+	if (errstr) {
+		fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd == -1) return false;
+	}
+	else {
+		// moved out of the way of stdin/stdout, which are about to be replaced
+		// by /dev/null, and kept away from tasks
+		fd = fcntl(n, F_DUPFD_CLOEXEC, 3);
+		if (fd == -1) return false;
+		if (n > 2) close(n);
+	}
+	struct stat s;
+	if (fstat(fd, &s) == -1) { close(fd); return false; }
+	isreg = S_ISREG(s.st_mode);
+	sigaction(SIGPIPE, &(struct sigaction){.sa_handler = &onsigpipe,
+			.sa_flags = SA_RESTART}, 0);
+	events_on = true;
+	epoch = time_now();
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	event("begin");
+	put0t(",\"time\":"); // wall clock, for lining up with other things
+	putnum((uvlong)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+	put0t(",\"slots\":");
+	putnum(maxpar);
+	endevent();
+	snaptimer.deadline = epoch + SNAPSHOT_INTERVAL;
+	evloop_sched(&snaptimer);
+	return true;
+}
+
+void events_queued(uint id, const struct task_desc *desc) {
+	if (!events_on) return;
+	taskevent("queued", id);
+	put0t(",\"argv\":[");
+	for (const char *const *pp = desc->argv; *pp; ++pp) {
+		if (pp != desc->argv) put(",", 1);
+		putstr(*pp);
+	}
+	put0t("],\"workdir\":");
+	putstr(desc->workdir);
+	endevent();
+}
+
+void events_started(uint id) {
+	if (!events_on) return;
+	taskevent("started", id);
+	endevent();
+}
+
+void events_blocked(uint id) {
+	if (!events_on) return;
+	taskevent("blocked", id);
+	endevent();
+}
+
+void events_unblocked(uint id) {
+	if (!events_on) return;
+	taskevent("unblocked", id);
+	endevent();
+}
+
+void events_finished(uint id, int status, const char *title, uint durms,
+		uvlong errbytes) {
+	if (!events_on) return;
+	taskevent("finished", id);
+	put0t(",\"status\":");
+	putnum(status);
+	if (title) {
+		put0t(",\"title\":");
+		putstr(title);
+	}
+	put0t(",\"duration_ms\":");
+	putnum(durms);
+	put0t(",\"stderr_bytes\":");
+	putnum(errbytes);
+	endevent();
+}
+
+void events_finish(int status) {
+	if (!events_on) return;
+	flush(); // make room, if possible
+	if (!events_on) return;
+	event("exit");
+	put0t(",\"status\":");
+	putnum(status);
+	endevent();
+	// there's no event loop to hold up anymore, so it's fine to wait a bit, but
+	// a reader that's stopped reading still mustn't keep us from exiting
+	for (int i = 0; i < 10 && events_on && head < tail; ++i) {
+		if (i) poll(&(struct pollfd){fd, POLLOUT}, 1, 100);
+		flush();
+	}
+	events_on = false;
+}
+
+// vi: sw=4 ts=4 noet tw=80 cc=80
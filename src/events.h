@@ -0,0 +1,47 @@
+/* This file is dedicated to the public domain. */
+
+#ifndef INC_EVENTS_H
+#define INC_EVENTS_H
+
+#include <stdbool.h>
+
+#include <intdefs.h>
+
+#include "defs.h"
+
+/*
+ * -E writes a live stream of what's going on as newline-delimited JSON, for
+ * dashboards and the like: one object per line for each task being queued,
+ * starting, blocking, unblocking and finishing, plus a snapshot of the
+ * scheduler's counts every so often. tasks are identified by the same IDs as
+ * build-query uses. output is buffered in memory and only written when the
+ * other end can take it, so a slow reader can never hold the build up; if it
+ * falls too far behind, events get dropped (and it's told how many)
+ */
+
+extern bool events_on;
+
+/*
+ * sets up the stream: dest is either a file descriptor number, which gets
+ * duplicated so the original can be closed or reused, or a path to a file to
+ * create. returns false on failure (errno is set)
+ */
+bool events_init(const char *dest);
+
+/* the rest of these do nothing unless events_init() has been called */
+
+void events_queued(uint id, const struct task_desc *desc);
+void events_started(uint id);
+void events_blocked(uint id);
+void events_unblocked(uint id);
+
+/* title may be null; durms is time spent running, not queued or blocked */
+void events_finished(uint id, int status, const char *title, uint durms,
+		uvlong errbytes);
+
+/* writes the last event and whatever's left over; called at exit */
+void events_finish(int status);
+
+#endif
+
+// vi: sw=4 ts=4 noet tw=80 cc=80
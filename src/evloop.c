@@ -92,16 +92,12 @@ noreturn evloop_run(void) {
 		struct timespec *timeout = 0;
 		struct evloop_timer *nexttimer = timers.x[0]; // XXX add skiplist_peek!
 		if (nexttimer) {
-			vlong now = time_now();
-			if (nexttimer->deadline <= now) {
-				// deadline passed within the time it took to get here, don't
-				// wait any longer
-				skiplist_pop__evloop_timer(&timers);
-				nexttimer->cb(nexttimer);
-				continue;
-			}
-			ts = (struct timespec){(nexttimer->deadline - now) / 1000,
-					(nexttimer->deadline - now) % 1000 * 1000000};
+			// if the deadline's passed already, still poll, just without
+			// waiting; otherwise a timer that keeps rescheduling itself (see
+			// task.c) would stop any events from ever being handled
+			vlong wait = nexttimer->deadline - time_now();
+			if (wait < 0) wait = 0;
+			ts = (struct timespec){wait / 1000, wait % 1000 * 1000000};
 			timeout = &ts;
 		}
 		int polled = ppoll(pfds, nfds, timeout, &(sigset_t){0});
@@ -118,11 +114,6 @@ noreturn evloop_run(void) {
 			}
 			sigemptyset((sigset_t *)&gotsigs);
 		}
-		else if (polled == 0) {
-			// nexttimer _has to_ be set, no need to null check again
-			skiplist_pop__evloop_timer(&timers);
-			nexttimer->cb(nexttimer);
-		}
 		else for (int i = 0; polled; ++i) {
 			if (pfds[i].revents) {
 				--polled;
@@ -139,6 +130,12 @@ noreturn evloop_run(void) {
 				}
 			}
 		}
+		// one timer per go around at most, so events get a look in between
+		nexttimer = timers.x[0];
+		if (nexttimer && nexttimer->deadline <= time_now()) {
+			skiplist_pop__evloop_timer(&timers);
+			nexttimer->cb(nexttimer);
+		}
 	}
 }
 
@@ -1,7 +1,11 @@
 /* This file is dedicated to the public domain. */
 
+#include <errno.h>
 #include <stdbool.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include <intdefs.h>
 
@@ -16,9 +20,35 @@ bool fd_writeall(int fd, const void *_buf, uint sz) {
 	return true;
 }
 
+long fd_readall(int fd, void *_buf, uint sz) {
+	char *buf = _buf;
+	uint off = 0;
+	while (off < sz) {
+		long nread = read(fd, buf + off, sz - off);
+		if (nread == -1) return -1;
+		if (!nread) break;
+		off += nread;
+	}
+	return off;
+}
+
 bool fd_transferall(int diskf, int to) {
-	char buf[16386];
 	uint off = 0, foff = 0;
+#ifdef __linux__
+	// let the kernel do the copying if it can. this doesn't work if the output
+	// is opened with O_APPEND (and wouldn't on really old kernels either),
+	// but in that case nothing's been written yet, so just fall back below
+	for (;;) {
+		long n = sendfile(to, diskf, &(off_t){foff}, 1 << 30);
+		if (n == 0) return true;
+		if (n == -1) {
+			if (foff || errno != EINVAL && errno != ENOSYS) return false;
+			break;
+		}
+		foff += n;
+	}
+#endif
+	char buf[65536];
 	long nread;
 	while (nread = pread(diskf, buf + off, sizeof(buf) - off, foff)) {
 		if (nread == -1) return false;
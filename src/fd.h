@@ -8,6 +8,7 @@
 #include <intdefs.h>
 
 bool fd_writeall(int fd, const void *buf, uint sz);
+long fd_readall(int fd, void *buf, uint sz); // gives less than sz only at EOF
 bool fd_transferall(int diskf, int to);
 
 #endif
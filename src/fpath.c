@@ -25,6 +25,66 @@
 #include "fpath.h"
 #include "unreachable.h"
 
+// these are baseline on 64-bit x86 and ARM, and on anything else the compiler
+// only says they're there if it's been told it can use them; either way,
+// there's no need to check at runtime
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define VEC16
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define VEC16
+#endif
+
+#ifdef VEC16
+// bitmasks of which of 16 bytes from p are \0 and which are slashes, with bit
+// i set if byte i is; NEON has no movemask, so there it's 4 bits per byte
+#ifdef __SSE2__
+#define MASKSHIFT 0
+#define LOAD(v, p) __m128i v = _mm_loadu_si128((const __m128i *)(p))
+#define STORE(p, v) _mm_storeu_si128((__m128i *)(p), v)
+#define MASK(v, c) \
+		(uvlong)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)))
+#else
+#define MASKSHIFT 2
+#define LOAD(v, p) uint8x16_t v = vld1q_u8((const uchar *)(p))
+#define STORE(p, v) vst1q_u8((uchar *)(p), v)
+#define MASK(v, c) vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16( \
+		vreinterpretq_u16_u8(vceqq_u8(v, vdupq_n_u8(c))), 4)), 0)
+#endif
+#endif
+
+// copies the rest of a path component, returning a pointer to the slash or
+// \0 that ends it. nearly all the time in fpath_canon() goes here, so where the
+// CPU allows, it's done 16 bytes at a time. the loads are unaligned but never
+// cross into another page, so they can't fault even if they go past the end of
+// path; the last few bytes of path are always done one at a time, meaning
+// nothing is stored past its length in canon either (see fpath.h). the reads
+// past the end are fine, but ASan can't know that, hence the attribute
+#ifdef VEC16
+__attribute__((no_sanitize_address))
+#endif
+static inline const char *copyrest(const char *path, char **canonp) {
+	char *canon = *canonp;
+#ifdef VEC16
+	while (((ulong)path & 4095) <= 4096 - 16) {
+		LOAD(v, path);
+		if (MASK(v, '\0')) break;
+		STORE(canon, v);
+		uvlong slash = MASK(v, '/');
+		if (slash) {
+			uint n = __builtin_ctzll(slash) >> MASKSHIFT;
+			*canonp = canon + n;
+			return path + n;
+		}
+		path += 16; canon += 16;
+	}
+#endif
+	for (; *path != '/' && *path; ++path) *canon++ = *path;
+	*canonp = canon;
+	return path;
+}
+
 enum fpath_err fpath_canon(const char *path, char *canon, int *reldepth) {
 	if (*path == '\0') return FPATH_EMPTY;
 	if (*path == '/') return FPATH_ABSOLUTE;
@@ -76,13 +136,7 @@ enum fpath_err fpath_canon(const char *path, char *canon, int *reldepth) {
 				*canon++ = *path;
 				goto mid;
 		}
-mid:	for (;;) {
-			switch (*++path) {
-				case '/': goto slash;
-				case '\0': goto r;
-				default: *canon++ = *path;
-			}
-		}
+mid:	if (*(path = copyrest(path + 1, &canon)) == '\0') goto r;
 slash:	++depth;
 		*canon++ = '/';
 nosl:	while (*++path == '/');
@@ -0,0 +1,54 @@
+/* This file is dedicated to the public domain. */
+
+#include <string.h>
+
+#include <intdefs.h>
+
+#include "hash.h"
+
+uvlong hash_seed = 0;
+
+// high bit of each byte in w that's zero, and nothing else (the cheaper, more
+// common version of this can also flag bytes right after a zero, which only
+// works out if the first zero is also the lowest)
+static inline uvlong zerobytes(uvlong w) {
+	const uvlong x = 0x7F7F7F7F7F7F7F7Full;
+	return ~(((w & x) + x) | w | x);
+}
+
+// the word loads can go past the end of s, though never into another page, so
+// they can't fault; ASan doesn't know that though
+#ifdef __GNUC__
+__attribute__((no_sanitize_address))
+#endif
+uint hash_str(const char *s, uint *len) {
+	const char *p = s;
+	uvlong h = hash_seed;
+	for (;; p += 8) {
+		uvlong w;
+		if (((ulong)p & 4095) <= 4096 - 8) {
+			memcpy(&w, p, 8);
+		}
+		else {
+			// might be right at the end of the mapping, so stop at the \0
+			w = 0;
+			for (int i = 0; i < 8 && (((char *)&w)[i] = p[i]); ++i);
+		}
+		uvlong z = zerobytes(w);
+		if (z) {
+			// throw away everything from the \0 on, then finish up
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+			uint n = __builtin_clzll(z) >> 3;
+			w &= ~(~0ull >> (n << 3));
+#else
+			uint n = __builtin_ctzll(z) >> 3;
+			w &= (1ull << (n << 3)) - 1;
+#endif
+			*len = p - s + n;
+			return hash_fold(hash_mix(h ^ w, HASH_K) ^ *len);
+		}
+		h = hash_mix(h ^ w, HASH_K);
+	}
+}
+
+// vi: sw=4 ts=4 noet tw=80 cc=80
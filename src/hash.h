@@ -0,0 +1,49 @@
+/* This file is dedicated to the public domain. */
+
+#ifndef INC_HASH_H
+#define INC_HASH_H
+
+#include <intdefs.h>
+
+/*
+ * Hashing for the string pool and for task descs, done a whole word at a time.
+ * Everything is seeded with hash_seed, which is set randomly once per run (see
+ * strpool_init()) so that no particular set of paths can be reliably bad for
+ * the tables - which means hash values must never be saved anywhere.
+ */
+
+extern uvlong hash_seed;
+
+#define HASH_K 0x9E3779B97F4A7C15ull // an odd constant with well-mixed bits
+
+/* multiplies two words out to 128 bits and folds the halves together */
+static inline uvlong hash_mix(uvlong a, uvlong b) {
+#ifdef __SIZEOF_INT128__
+	__extension__ typedef unsigned __int128 u128; // (shush, -pedantic)
+	u128 r = (u128)a * b;
+	return (uvlong)r ^ (uvlong)(r >> 64);
+#else
+	// same thing the long way round, for 32-bit platforms
+	uvlong al = (uint)a, ah = a >> 32, bl = (uint)b, bh = b >> 32;
+	uvlong ll = al * bl, lh = al * bh, hl = ah * bl, hh = ah * bh;
+	uvlong mid = (ll >> 32) + (uint)lh + (uint)hl;
+	uvlong hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+	return (mid << 32 | (uint)ll) ^ hi;
+#endif
+}
+
+/* gets a 32-bit table hash out of a mixed-up word */
+static inline uint hash_fold(uvlong h) {
+	h = hash_mix(h, HASH_K);
+	return h ^ h >> 32;
+}
+
+/*
+ * Hashes a null-terminated string and gives back its length as well, both in
+ * a single pass.
+ */
+uint hash_str(const char *s, uint *len);
+
+#endif
+
+// vi: sw=4 ts=4 noet tw=80 cc=80
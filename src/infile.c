@@ -20,6 +20,7 @@
 #include <string.h>
 #include <sys/stat.h>
 
+#include <basichashes.h>
 #include <intdefs.h>
 #include <iobuf.h>
 #include <str.h>
@@ -27,21 +28,37 @@
 
 #include "build.h"
 #include "db.h"
+#include "infile.h"
+#include "stats.h"
 
+// what was seen to change about each infile in this run, for explaining
+// reruns; only changed files get an entry so this stays small
+struct change { const char *path; uint what; };
+static inline const char *kmemb_change(const struct change *c) {
+	return c->path;
+}
+DECL_TABLE(static, change, const char *, struct change)
+DEF_TABLE(static, change, hash_ptr, table_ideq, kmemb_change)
+static struct table_change changes;
+
+// returns a mask of INFILE_* bits (0 if nothing changed), or -1 on error
 static int update(const char *path, struct db_infile *i) {
 	struct stat s;
+	++stats.infilestats;
 	if (stat(path, &s) == -1) {
 		if (errno != ENOENT && errno != EACCES) return -1;
 		if (i->len == -1ull) return 0; // no change
 		i->len = -1;
-		return 1;
+		return INFILE_GONE;
 	}
 	int diff = 0;
-	if (i->len   != s.st_size ) { diff = 1; i->len   = s.st_size; }
-	if (i->inode != s.st_ino  ) { diff = 1; i->inode = s.st_ino;  }
-	if (i->mode  != s.st_mode ) { diff = 1; i->mode  = s.st_mode; }
-	if (i->uid   != s.st_uid  ) { diff = 1; i->uid   = s.st_uid;  }
-	if (i->gid   != s.st_gid  ) { diff = 1; i->gid   = s.st_gid;  }
+	if (i->len == -1ull) diff = INFILE_CREATED; // rest is undefined, so...
+	if (i->len   != s.st_size ) { diff |= INFILE_LEN;   i->len   = s.st_size; }
+	if (i->inode != s.st_ino  ) { diff |= INFILE_INODE; i->inode = s.st_ino;  }
+	if (i->mode  != s.st_mode ) { diff |= INFILE_MODE;  i->mode  = s.st_mode; }
+	if (i->uid   != s.st_uid  ) { diff |= INFILE_OWNER; i->uid   = s.st_uid;  }
+	if (i->gid   != s.st_gid  ) { diff |= INFILE_OWNER; i->gid   = s.st_gid;  }
+	if (diff & INFILE_CREATED) diff = INFILE_CREATED; // ...don't list it all
 	return diff;
 }
 
@@ -67,9 +84,28 @@ int infile_query(const char *path, uint tgtnewness) {
 		if (r) {
 			i->newness = db_newness;
 			db_commitinfile(i);
+			// just for explaining things, so failing here isn't a big deal
+			if (changes.data || table_init_change(&changes)) {
+				struct change *c = table_put_change(&changes, path);
+				if (c) { c->path = path; c->what = r; }
+			}
 		}
 	}
 	return i->newness > tgtnewness;
 }
 
+uint infile_changes(const char *path) {
+	if (!changes.data) return 0;
+	struct change *c = table_get_change(&changes, path);
+	return c ? c->what : 0;
+}
+
+int infile_peek(const char *path) {
+	struct db_infile *i = db_findinfile(path);
+	if (!i) return 1; // never recorded, so it may as well have changed
+	struct db_infile copy = *i; // compare against a copy so nothing's updated
+	int r = update(path, &copy);
+	return r == -1 ? -1 : !!r;
+}
+
 // vi: sw=4 ts=4 noet tw=80 cc=80
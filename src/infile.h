@@ -23,9 +23,33 @@
 
 bool infile_ensure(const char *path);
 
+/* what can be seen to have changed about an infile (see infile_changes()) */
+enum {
+	INFILE_LEN = 1,
+	INFILE_INODE = 2,
+	INFILE_MODE = 4,
+	INFILE_OWNER = 8,
+	INFILE_CREATED = 16, // the rest isn't given in this case
+	INFILE_GONE = 32
+};
+
 /* returns 1 if changed, 0 if not, or -1 on error */
 int infile_query(const char *path, uint tgtnewness);
 
+/*
+ * returns a mask of INFILE_* bits for what infile_query() saw change about the
+ * file in this run, or 0 if it wasn't seen to change (which, if infile_query()
+ * still said it had, means it changed in some earlier run instead)
+ */
+uint infile_changes(const char *path);
+
+/*
+ * returns 1 if the file has changed since it was last recorded in the db, 0 if
+ * not, or -1 on error; unlike infile_query(), nothing is updated (for
+ * build-query, which has to leave the db alone)
+ */
+int infile_peek(const char *path);
+
 #endif
 
 // vi: sw=4 ts=4 noet tw=80 cc=80
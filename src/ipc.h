@@ -17,10 +17,18 @@
 #ifndef INC_IPC_H
 #define INC_IPC_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
+
 #include <intdefs.h>
 
 #include "defs.h"
 
+// biggest single datagram either end will deal with. requests bigger than this
+// can only be sent over a task's own socket, as continuations; the shared
+// socket just rejects them
+#define IPC_MSGMAX 65536
+
 /* this header is common to ipcserver/ipcclient - just include one of those */
 
 enum ipc_req_type {
@@ -28,19 +36,96 @@ enum ipc_req_type {
 	IPC_REQ_WAIT,
 	IPC_REQ_INFILE,
 	IPC_REQ_TASKTITLE, // note: NOT interned on server, unlike most strings
+	IPC_REQ_DEPS,
+	IPC_REQ_WAITSOME,
+	IPC_REQ_WORKNEXT, // from a worker; the reply is its next task (see below)
+	IPC_REQ_WORKDONE,
+	IPC_REQ_INFILES,
+	// these last two are only used to set up and poke the ring (see below), so
+	// the proc code deals with them and they never actually get decoded
+	IPC_REQ_RING, // passes the memfd along; gets a 1-byte reply, 1 if accepted
+	IPC_REQ_RINGWAKE
+};
+
+// once a task has made IPC_RING_AFTER requests, libbuild (on Linux) tries to
+// set up a ring buffer in shared memory for the rest of them, so that a task
+// making thousands and thousands of requests isn't limited by syscall overhead.
+// each request is the same bytes that would have been sent as a datagram,
+// prefixed by its length and padded out to a multiple of 4 bytes. the server
+// reads everything in the ring before it reads anything from the socket, so
+// it's fine to fall back on the socket if the ring fills up (and
+// IPC_REQ_WAIT, which needs to block for a reply anyway, always uses it)
+#define IPC_RING_AFTER 64
+#define IPC_RINGSZ (1u << 20) // must be a power of 2
+struct ipc_ring {
+	_Atomic uint head; // read position, only moved by the server
+	char _pad1[60]; // (keep each end's stuff on different cache lines)
+	_Atomic uint tail; // write position, only moved by the client
+	// set by the server once it runs out of things to read. if the client sees
+	// this after writing, it clears it and sends an IPC_REQ_RINGWAKE
+	_Atomic uint needwake;
+	char _pad2[56];
+	char data[];
+};
+
+// a batch of deps sharing a working directory, equivalent to an IPC_REQ_DEP for
+// each. the client splits big batches across as many requests as needed; on the
+// server end, argvs belongs to whatever made the request, and only lasts until
+// it's handled (each argv lasts forever, being from db_internargv())
+struct ipc_deps {
+	const char *const *const *argvs;
+	const char *workdir;
+	int n;
+};
+
+// a batch of infiles, equivalent to an IPC_REQ_INFILE for each, except that
+// paths outside the tree are just dropped rather than being errors (since the
+// usual source of these is a compiler's depfile, which lists system headers
+// too). split up like ipc_deps; on the server end, paths only lasts until
+// handled like argvs above, and the paths themselves are interned
+struct ipc_infiles {
+	const char *const *paths;
+	int n;
 };
 
 struct ipc_req {
 	enum ipc_req_type type;
+	// for IPC_REQ_DEP, identifies the dep in results from IPC_REQ_WAITSOME; for
+	// IPC_REQ_DEPS, the same for the first dep, then tag + 1 for the next, etc.
+	int tag;
 	union {
 		struct task_desc dep; // IPC_REQ_DEP
+		struct ipc_deps deps; // IPC_REQ_DEPS
+		int waitmax; // IPC_REQ_WAITSOME: most results to send back at once
+		int workstatus; // IPC_REQ_WORKDONE
 		const char *infile; // IPC_REQ_INFILE
+		struct ipc_infiles infiles; // IPC_REQ_INFILES
 		char *title; // IPC_REQ_TASKTITLE
 	};
 };
 
+struct ipc_depresult {
+	int tag;
+	uchar status;
+	bool rerun; // false if an existing result was used
+	// char padding[2];
+};
+
+// most results that'll fit in a reply (after the maxstatus byte)
+#define IPC_RESULTSMAX ((IPC_MSGMAX - 1) / sizeof(struct ipc_depresult))
+
 struct ipc_reply {
-	uchar maxstatus; // yeah... this is it
+	uchar maxstatus; // for IPC_REQ_WAITSOME, just the highest in results
+	// for IPC_REQ_WAITSOME; when receiving, nresults is initially how many
+	// will fit in the results buffer
+	uint nresults;
+	struct ipc_depresult *results;
+	// for IPC_REQ_WORKNEXT: the worker's next task, if work.argv is non-null,
+	// along with an fd for it to use as stderr while doing that task. this is
+	// sent as a 1 byte (in place of maxstatus), then the workdir and each arg,
+	// all null-terminated. a plain reply (just a 0 byte) tells it to exit
+	struct task_desc work;
+	int workerrfd;
 };
 
 #endif
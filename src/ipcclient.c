@@ -14,34 +14,310 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE // for the F_SEAL_* constants
+
 #include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/memfd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 
+#include <intdefs.h>
 #include <iobuf.h>
 
 #include "ipc.h"
+#include "ipcclient.h"
+
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC 0
+#endif
+
+static struct obuf *O = OBUF(-1, IPC_MSGMAX);
+
+// see ipc.h for the general idea. the ring is only used with the shared socket,
+// where each process gets its own replies; on a task's own socket, another
+// process in the same task could end up reading the reply to IPC_REQ_RING
+#if defined(__linux__) && defined(SYS_memfd_create)
+#define USE_RING
+static struct ipc_ring *ring = 0;
+static bool ringtried = false;
+static uint nsent = 0;
+
+// after a fork, there would be two processes writing to the one ring with no
+// coordination, which would go very badly. the child just sticks to the socket
+static void onfork(void) { ring = 0; ringtried = true; }
+
+static void setupring(int fd, uvlong token) {
+	ringtried = true;
+	int memfd = syscall(SYS_memfd_create, "build-ipc",
+			MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd == -1) return;
+	ulong sz = sizeof(struct ipc_ring) + IPC_RINGSZ;
+	struct ipc_ring *r = MAP_FAILED;
+	if (ftruncate(memfd, sz) == -1) goto e;
+	// the server won't take it otherwise: if the size could still change, we
+	// (or anything else that got hold of the fd) could make it crash
+	if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+			F_SEAL_SEAL) == -1) {
+		goto e;
+	}
+	r = mmap(0, sz, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (r == MAP_FAILED) goto e;
+	// nothing's been read yet, so the first write has to wake the server up
+	atomic_store(&r->needwake, 1);
+	if (pthread_atfork(0, 0, &onfork)) goto e;
+	char buf[sizeof(token) + 1];
+	memcpy(buf, &token, sizeof(token));
+	buf[sizeof(token)] = IPC_REQ_RING;
+	union {
+		struct cmsghdr hdr; // (for alignment)
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsg = {0};
+	struct msghdr mh = {
+		.msg_iov = &(struct iovec){buf, sizeof(buf)},
+		.msg_iovlen = 1,
+		.msg_control = cmsg.buf,
+		.msg_controllen = sizeof(cmsg.buf)
+	};
+	struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(c), &memfd, sizeof(int));
+	if (sendmsg(fd, &mh, 0) == -1) goto e;
+	// the server answers this right away. it says no if some other process in
+	// the same task already has a ring (or if anything went wrong at its end)
+	struct ipc_reply reply = {0};
+	if (!ipcclient_recv(fd, &reply) || !reply.maxstatus) goto e;
+	close(memfd);
+	ring = r;
+	return;
+
+e:	if (r != MAP_FAILED) munmap(r, sz);
+	close(memfd);
+}
+
+static void ringcopy(uint off, const void *p, uint n) {
+	off &= IPC_RINGSZ - 1;
+	uint first = IPC_RINGSZ - off;
+	if (first > n) first = n;
+	memcpy(ring->data + off, p, first);
+	memcpy(ring->data, (const char *)p + first, n - first);
+}
+
+// returns 1 if the request went into the ring, 0 if there's no room (so it
+// should go over the socket instead), or -1 on failure
+static int ringput(int fd, uvlong token, const char *p, uint n) {
+	uint tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	uint head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	uint recsz = (sizeof(n) + n + 3) & ~3u;
+	if (recsz > IPC_RINGSZ - (tail - head)) return 0;
+	ringcopy(tail, &n, sizeof(n));
+	ringcopy(tail + sizeof(n), p, n);
+	// this and the exchange below are sequentially consistent, as is the
+	// server setting needwake and then checking tail again; that way, either
+	// it sees the new request or we see that it needs waking up
+	atomic_store(&ring->tail, tail + recsz);
+	if (!atomic_exchange(&ring->needwake, 0)) return 1;
+	char buf[sizeof(token) + 1];
+	memcpy(buf, &token, sizeof(token));
+	buf[sizeof(token)] = IPC_REQ_RINGWAKE;
+	return send(fd, buf, sizeof(buf), 0) == -1 ? -1 : 1;
+}
+#endif
+
+// sends whatever's been put in O. off is where the request starts, after the
+// token; whole says whether it all fit in O, so nothing's been flushed yet
+static bool transmit(int fd, uvlong token, uint off, bool whole,
+		bool canring) {
+#ifdef USE_RING
+	if (!ringtried && token && ++nsent == IPC_RING_AFTER) setupring(fd, token);
+	if (ring && whole && canring) {
+		int ret = ringput(fd, token, O->buf + off, O->n - off);
+		if (ret == -1) return false;
+		if (ret == 1) { O->n = 0; return true; }
+	}
+#endif
+	return obuf_flush(O);
+}
+
+int ipcclient_connect(const char *name) {
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	ulong len = strlen(name);
+	if (len >= sizeof(addr.sun_path)) { errno = ENAMETOOLONG; return -1; }
+	// abstract address: NUL, then the name (with no terminator!)
+	memcpy(addr.sun_path + 1, name, len);
+	int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) return -1;
+	// binding with *just* the family gets us an automatically-named address,
+	// which is what the server then sends replies back to
+	if (bind(fd, (struct sockaddr *)&(struct sockaddr_un){
+				.sun_family = AF_UNIX}, sizeof(sa_family_t)) == -1 ||
+			connect(fd, (struct sockaddr *)&addr,
+				offsetof(struct sockaddr_un, sun_path) + 1 + len) == -1) {
+		int e = errno;
+		close(fd);
+		errno = e;
+		return -1;
+	}
+	return fd;
+}
+
+static ulong argvsize(const char *const *argv) {
+	ulong sz = sizeof(int);
+	for (const char *const *pp = argv; *pp; ++pp) sz += strlen(*pp) + 1;
+	return sz;
+}
+
+static bool putargv(const char *const *argv) {
+	int argc = 0;
+	for (const char *const *pp = argv; *pp; ++pp) ++argc;
+	if (!obuf_putbytes(O, (char *)&argc, sizeof(argc))) return false;
+	for (const char *const *pp = argv; *pp; ++pp) {
+		if (!obuf_put0t(O, *pp) || !obuf_putc(O, '\0')) return false;
+	}
+	return true;
+}
 
-static struct obuf *O = OBUF(-1, 16384);
+// the shared socket needs every request in one piece, so work out the size
+// first to be able to give a sensible error rather than sending half a request
+static ulong reqsize(const struct ipc_req *msg) {
+	ulong sz = 1;
+	switch (msg->type) {
+		case IPC_REQ_DEP:
+			sz += sizeof(int) + argvsize(msg->dep.argv) +
+					strlen(msg->dep.workdir) + 1;
+			break;
+		case IPC_REQ_WAIT: break;
+		case IPC_REQ_WAITSOME: case IPC_REQ_WORKDONE: sz += sizeof(int); break;
+		case IPC_REQ_WORKNEXT: break;
+		case IPC_REQ_INFILE: sz += strlen(msg->infile) + 1; break;
+		case IPC_REQ_TASKTITLE: sz += strlen(msg->title) + 1; break;
+		case IPC_REQ_DEPS: case IPC_REQ_INFILES: // see senddeps() etc. below
+		case IPC_REQ_RING: case IPC_REQ_RINGWAKE:; // (internal only)
+	}
+	return sz;
+}
+
+// sends as many deps per request as will fit in one datagram, so that a batch
+// of any size can go over the shared socket
+static bool senddeps(int fd, uvlong token, const struct ipc_req *msg) {
+	const struct ipc_deps *deps = &msg->deps;
+	ulong hdrsz = sizeof(token) + 1 + 2 * sizeof(int) +
+			strlen(deps->workdir) + 1;
+	for (int i = 0; i < deps->n;) {
+		ulong sz = hdrsz + argvsize(deps->argvs[i]);
+		// a single huge dep can still go over a task's own socket (just
+		// getting split up like any other huge request), but not a shared one
+		if (sz > IPC_MSGMAX && token) { errno = EMSGSIZE; return false; }
+		int n = 1;
+		for (; i + n < deps->n; ++n) {
+			ulong argsz = argvsize(deps->argvs[i + n]);
+			if (sz + argsz > IPC_MSGMAX) break;
+			sz += argsz;
+		}
+		O->fd = fd; O->n = 0;
+		if (token && !obuf_putbytes(O, (char *)&token, sizeof(token))) {
+			return false;
+		}
+		int tag = msg->tag + i;
+		if (!obuf_putc(O, IPC_REQ_DEPS) ||
+				!obuf_putbytes(O, (char *)&n, sizeof(n)) ||
+				!obuf_putbytes(O, (char *)&tag, sizeof(tag)) ||
+				!obuf_put0t(O, deps->workdir) || !obuf_putc(O, '\0')) {
+			return false;
+		}
+		for (int j = i; j < i + n; ++j) {
+			if (!putargv(deps->argvs[j])) return false;
+		}
+		uint off = token ? sizeof(token) : 0;
+		if (!transmit(fd, token, off, sz <= IPC_MSGMAX, true)) return false;
+		i += n;
+	}
+	return true;
+}
 
-bool ipcclient_send(int fd, const struct ipc_req *msg) {
+// likewise for infiles
+static bool sendinfiles(int fd, uvlong token, const struct ipc_req *msg) {
+	const struct ipc_infiles *infiles = &msg->infiles;
+	ulong hdrsz = sizeof(token) + 1 + sizeof(int);
+	for (int i = 0; i < infiles->n;) {
+		ulong sz = hdrsz + strlen(infiles->paths[i]) + 1;
+		if (sz > IPC_MSGMAX && token) { errno = EMSGSIZE; return false; }
+		int n = 1;
+		for (; i + n < infiles->n; ++n) {
+			ulong pathsz = strlen(infiles->paths[i + n]) + 1;
+			if (sz + pathsz > IPC_MSGMAX) break;
+			sz += pathsz;
+		}
+		O->fd = fd; O->n = 0;
+		if (token && !obuf_putbytes(O, (char *)&token, sizeof(token))) {
+			return false;
+		}
+		if (!obuf_putc(O, IPC_REQ_INFILES) ||
+				!obuf_putbytes(O, (char *)&n, sizeof(n))) {
+			return false;
+		}
+		for (int j = i; j < i + n; ++j) {
+			if (!obuf_put0t(O, infiles->paths[j]) || !obuf_putc(O, '\0')) {
+				return false;
+			}
+		}
+		uint off = token ? sizeof(token) : 0;
+		if (!transmit(fd, token, off, sz <= IPC_MSGMAX, true)) return false;
+		i += n;
+	}
+	return true;
+}
+
+bool ipcclient_send(int fd, uvlong token, const struct ipc_req *msg) {
+	if (msg->type == IPC_REQ_DEPS) return senddeps(fd, token, msg);
+	if (msg->type == IPC_REQ_INFILES) return sendinfiles(fd, token, msg);
 	O->fd = fd; O->n = 0;
 
+	ulong sz = reqsize(msg);
+	uint off = 0;
+	if (token) {
+		if (sz > IPC_MSGMAX - sizeof(token)) {
+			errno = EMSGSIZE;
+			return false;
+		}
+		if (!obuf_putbytes(O, (char *)&token, sizeof(token))) return false;
+		off = sizeof(token);
+	}
 	if (!obuf_putc(O, msg->type)) return false;
 	switch (msg->type) {
-		case IPC_REQ_DEP:;
-			int argc = 0;
-			const char *const *argv = msg->dep.argv;
-			for (const char *const *pp = argv; *pp; ++pp) ++argc;
-			if (!obuf_putbytes(O, (char *)&argc, sizeof(argc))) return false;
-			for (const char *const *pp = argv; *pp; ++pp) {
-				if (!obuf_put0t(O, *pp) || !obuf_putc(O, '\0')) return false;
-			}
-			if (!obuf_put0t(O, msg->dep.workdir) || !obuf_putc(O, '\0')) {
+		case IPC_REQ_DEP:
+			if (!obuf_putbytes(O, (char *)&msg->tag, sizeof(msg->tag)) ||
+					!putargv(msg->dep.argv) ||
+					!obuf_put0t(O, msg->dep.workdir) || !obuf_putc(O, '\0')) {
 				return false;
 			}
 			break;
 		case IPC_REQ_WAIT: break; // nothing else!
+		case IPC_REQ_WAITSOME:
+			if (!obuf_putbytes(O, (char *)&msg->waitmax,
+					sizeof(msg->waitmax))) {
+				return false;
+			}
+			break;
+		case IPC_REQ_WORKNEXT: break;
+		case IPC_REQ_WORKDONE:
+			if (!obuf_putbytes(O, (char *)&msg->workstatus,
+					sizeof(msg->workstatus))) {
+				return false;
+			}
+			break;
 		case IPC_REQ_INFILE:
 			if (!obuf_put0t(O, msg->infile) || !obuf_putc(O, '\0')) {
 				return false;
@@ -51,17 +327,58 @@ bool ipcclient_send(int fd, const struct ipc_req *msg) {
 			if (!obuf_put0t(O, msg->title) || !obuf_putc(O, '\0')) {
 				return false;
 			}
+			break;
+		case IPC_REQ_DEPS: case IPC_REQ_INFILES: // handled above
+		case IPC_REQ_RING: case IPC_REQ_RINGWAKE:; // (internal only)
 	}
-	return obuf_flush(O);
+	// waiting has to block for a reply, so there's no point using the ring
+	return transmit(fd, token, off, off + sz <= IPC_MSGMAX,
+			msg->type != IPC_REQ_WAIT && msg->type != IPC_REQ_WAITSOME &&
+			msg->type != IPC_REQ_WORKNEXT);
 }
 
 bool ipcclient_recv(int fd, struct ipc_reply *msg) {
+	struct iovec iov[2] = {
+		{&msg->maxstatus, 1},
+		{msg->results, msg->nresults * sizeof(*msg->results)}
+	};
+	struct msghdr mh = {.msg_iov = iov, .msg_iovlen = 2};
 	do {
-		int nread = read(fd, &msg->maxstatus, 1);
-		if (nread == 1) return true;
+		long nread = recvmsg(fd, &mh, 0);
+		if (nread > 0) {
+			msg->nresults = (nread - 1) / sizeof(*msg->results);
+			return true;
+		}
 		if (nread == 0) return false;
 	} while (errno == EINTR); // assuming -1
 	return false;
 }
 
+long ipcclient_recvwork(int fd, char *buf, uint sz, int *errfd) {
+	union {
+		struct cmsghdr hdr; // (for alignment)
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsg;
+	struct msghdr mh = {
+		.msg_iov = &(struct iovec){buf, sz},
+		.msg_iovlen = 1,
+		.msg_control = cmsg.buf,
+		.msg_controllen = sizeof(cmsg.buf)
+	};
+	long nread;
+	do nread = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+	while (nread == -1 && errno == EINTR);
+	if (nread <= 0) return -1;
+	*errfd = -1;
+	for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c)) {
+		if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+		for (uint i = 0; i < (c->cmsg_len - CMSG_LEN(0)) / sizeof(int); ++i) {
+			int newfd;
+			memcpy(&newfd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+			if (*errfd == -1) *errfd = newfd; else close(newfd);
+		}
+	}
+	return nread;
+}
+
 // vi: sw=4 ts=4 noet tw=80 cc=80
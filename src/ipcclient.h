@@ -21,9 +21,28 @@
 
 #include "ipc.h"
 
-bool ipcclient_send(int fd, const struct ipc_req *msg);
+#include <intdefs.h>
+
+/*
+ * Creates a socket connected to the given abstract address (Linux only), for
+ * use with a nonzero token in ipcclient_send(). Returns -1 on failure.
+ */
+int ipcclient_connect(const char *name);
+
+/*
+ * Sends a request. token is the task's token if talking to a shared socket, or
+ * 0 if fd is the task's own socket.
+ */
+bool ipcclient_send(int fd, uvlong token, const struct ipc_req *msg);
 bool ipcclient_recv(int fd, struct ipc_reply *msg);
 
+/*
+ * Receives the reply to IPC_REQ_WORKNEXT, which gets left in its raw form in
+ * buf (see struct ipc_reply). Returns its size, or -1 on failure; errfd is set
+ * to the fd that was passed along with it, or -1 if there wasn't one.
+ */
+long ipcclient_recvwork(int fd, char *buf, uint sz, int *errfd);
+
 #endif
 
 // vi: sw=4 ts=4 noet tw=80 cc=80
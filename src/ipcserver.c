@@ -14,114 +14,453 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE // for struct ucred and the F_SEAL_* constants
+
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include <errmsg.h>
+#include <intdefs.h>
 #include <iobuf.h>
 #include <str.h>
+#include <table.h>
+#include <vec.h>
 
 #include "db.h"
 #include "fpath.h"
+#include "hash.h"
 #include "ipc.h"
+#include "stats.h"
+
+static struct ibuf *I = IBUF(-1, IPC_MSGMAX);
+// ring requests are copied into here instead, as reading the ring usually
+// happens in between receiving a request from the socket and decoding it
+static struct ibuf *R = IBUF(-1, IPC_MSGMAX);
+static struct ibuf *cur = 0; // whichever of the above gets decoded next
+static int rxfd = -1; // fd passed along with the most recent request, if any
 
-static struct ibuf *I = IBUF(-1, 16384);
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC 0 // only Linux passes fds anyway (see ipcclient.c)
+#endif
 
 // this is a bit crude but it covers "should never happen" cases, so who cares
 #define INVAL(cond) \
 	(!!(cond) && (errmsg_warnx(msg_error, "invalid IPC request"), \
 			errno = EINVAL, 1))
 
-static void warn_fpath(const char *msg, const char *path, enum fpath_err err) {
+static void warn_fpath(const char *msg, const char *workdir, const char *rel,
+		enum fpath_err err) {
 	if (err == FPATH_EMPTY) {
 		errmsg_warnx(msg_fatal, msg, ": ", fpath_errorstring(err));
 	}
 	else {
-		errmsg_warnx(msg_fatal, msg, " ", path, ": ", fpath_errorstring(err));
+		errmsg_warnx(msg_fatal, msg, " ", workdir, "/", rel, ": ",
+				fpath_errorstring(err));
+	}
+}
+
+// if uid is non-null, it's set to the sender's user ID, or -1 if that wasn't
+// passed along for whatever reason (the receiving socket needs SO_PASSCRED)
+static long recvwithfd(int fd, struct sockaddr_un *from, socklen_t *fromlen,
+		uid_t *uid) {
+	if (rxfd != -1) { close(rxfd); rxfd = -1; } // nobody wanted it
+	union {
+		struct cmsghdr hdr; // (for alignment)
+#ifdef SCM_CREDENTIALS
+		char buf[CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(struct ucred))];
+#else
+		char buf[CMSG_SPACE(sizeof(int))];
+#endif
+	} cmsg;
+	struct msghdr mh = {
+		.msg_name = from,
+		.msg_namelen = from ? *fromlen : 0,
+		.msg_iov = &(struct iovec){I->buf, I->sz},
+		.msg_iovlen = 1,
+		.msg_control = cmsg.buf,
+		.msg_controllen = sizeof(cmsg.buf)
+	};
+	long n = recvmsg(fd, &mh, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if (n == -1) return -1;
+	cur = I;
+	if (from) *fromlen = mh.msg_namelen;
+	if (uid) *uid = (uid_t)-1;
+	for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c)) {
+		if (c->cmsg_level != SOL_SOCKET) continue;
+#ifdef SCM_CREDENTIALS
+		if (c->cmsg_type == SCM_CREDENTIALS && uid &&
+				c->cmsg_len >= CMSG_LEN(sizeof(struct ucred))) {
+			struct ucred cred;
+			memcpy(&cred, CMSG_DATA(c), sizeof(cred));
+			*uid = cred.uid;
+			continue;
+		}
+#endif
+		if (c->cmsg_type != SCM_RIGHTS) continue;
+		for (uint i = 0; i < (c->cmsg_len - CMSG_LEN(0)) / sizeof(int); ++i) {
+			int newfd;
+			memcpy(&newfd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+			if (rxfd == -1) rxfd = newfd; else close(newfd);
+		}
+	}
+	return n;
+}
+
+bool ipcserver_recv(int fd) {
+	long n = recvwithfd(fd, 0, 0, 0);
+	if (n == -1) return false;
+	if (n == 0) { errno = EPIPE; return false; } // other end hung up
+	// if the client had to split a huge request up, the rest will get read
+	// (blocking) from here as it's decoded
+	I->fd = fd; I->r = 0; I->w = n;
+	return true;
+}
+
+bool ipcserver_recvshared(int fd, uvlong *token, struct sockaddr_un *from,
+		socklen_t *fromlen) {
+	*fromlen = sizeof(*from);
+	uid_t uid;
+	long n = recvwithfd(fd, from, fromlen, &uid);
+	if (n == -1) return false;
+	// anyone on the system can send to an abstract address, so anything not
+	// from the same user gets thrown out (the kernel won't let the sender lie
+	// about this without privileges it could misuse plenty of other ways)
+	if (uid != geteuid()) {
+		if (rxfd != -1) { close(rxfd); rxfd = -1; }
+		errno = EPERM;
+		return false;
+	}
+	if (n < (long)sizeof(*token)) { errno = EBADMSG; return false; }
+	memcpy(token, I->buf, sizeof(*token));
+	// nothing can follow on from a shared socket request, so there's no fd to
+	// read more from - a truncated request will just fail to decode
+	I->fd = -1; I->r = sizeof(*token); I->w = n;
+	return true;
+}
+
+// decoding keeps what it needs between requests, and uses strings right out of
+// the request wherever it can (see getstr()), so that a typical request doesn't
+// allocate anything at all. the lists put in ipc_req are these ones here
+struct vec_str VEC(const char *);
+static struct vec_str args = {0}, paths = {0};
+struct vec_argv VEC(const char *const *);
+static struct vec_argv argvs = {0};
+static struct str spill = {0};
+
+// gives the next string in the request, setting n the same way ibuf_getstr()
+// would. it's usually all there in the buffer to be used in place, but if the
+// client had to split a huge request up, there might only be part of it, in
+// which case the rest is read in along with it into spill
+static const char *getstr(int *n) {
+	const char *p = cur->buf + cur->r;
+	const char *end = memchr(p, '\0', cur->w - cur->r);
+	if (end) {
+		*n = end - p + 1;
+		cur->r += *n;
+		return p;
+	}
+	free(spill.data);
+	spill = (struct str){0};
+	if (!str_clear(&spill)) { *n = -1; return 0; }
+	*n = ibuf_getstr(cur, &spill, '\0');
+	return spill.data;
+}
+
+// the same few paths tend to get sent over and over again (headers especially),
+// so the result of joining each one onto the task's workdir and canonicalising
+// it - or the reason that failed - is cached, by interned workdir and the path
+// as sent
+struct pathkey { const char *workdir, *rel; };
+struct pathent {
+	const char *workdir, *rel;
+	const char *canon; // interned, or "" if err isn't FPATH_OK
+	enum fpath_err err;
+};
+DECL_TABLE(static, path, struct pathkey, struct pathent)
+static uint hash_pathkey(struct pathkey k) {
+	uint len;
+	return hash_fold(hash_mix(hash_seed ^ (ulong)k.workdir, HASH_K) ^
+			hash_str(k.rel, &len));
+}
+static bool eq_pathkey(struct pathkey k1, struct pathkey k2) {
+	return k1.workdir == k2.workdir && !strcmp(k1.rel, k2.rel);
+}
+static struct pathkey kmemb_path(const struct pathent *e) {
+	return (struct pathkey){e->workdir, e->rel};
+}
+DEF_TABLE(static, path, hash_pathkey, eq_pathkey, kmemb_path)
+static struct table_path pathcache = {0};
+
+// first half is for the joined path, second half for the canonical one
+static char *joinbuf = 0;
+static ulong joinbufsz = 0;
+
+// returns the cached entry for rel relative to workdir, or null on failure
+static const struct pathent *resolve(const char *workdir, const char *rel) {
+	if (!pathcache.data && !table_init_path(&pathcache)) return 0;
+	bool isnew;
+	struct pathent *e = table_putget_transact_path(&pathcache,
+			(struct pathkey){workdir, rel}, &isnew);
+	if (!e || !isnew) return e;
+	ulong wdlen = strlen(workdir), len = strlen(rel), sz = wdlen + len + 2;
+	if (sz > joinbufsz) {
+		char *p = realloc(joinbuf, sz * 2);
+		if (!p) return 0;
+		joinbuf = p; joinbufsz = sz;
 	}
+	// joining paths like this is pretty much guaranteed to introduce
+	// silliness, but we canonicalise regardless so it's fine
+	memcpy(joinbuf, workdir, wdlen);
+	joinbuf[wdlen] = '/';
+	memcpy(joinbuf + wdlen + 1, rel, len + 1);
+	char *canon = joinbuf + joinbufsz;
+	enum fpath_err err = fpath_canon(joinbuf, canon, 0);
+	const char *ret = err == FPATH_OK ? db_intern_tmp(canon) : "";
+	char *relcopy = malloc(len + 1);
+	if (!ret || !relcopy) { free(relcopy); return 0; }
+	*e = (struct pathent){workdir, memcpy(relcopy, rel, len + 1), ret, err};
+	table_transactcommit_path(&pathcache);
+	return e;
 }
 
-bool ipcserver_recv(int fd, struct ipc_req *msg, const char *taskworkdir) {
-	I->fd = fd; I->w = 0; I->r = 0;
+static const char *const *decodeargv(void) {
+	int argc = 0;
+	int n = ibuf_getbytes(cur, &argc, sizeof(argc));
+	if (n == -1 || INVAL(n != sizeof(argc)) || INVAL(argc < 1)) return 0;
+	args.sz = 0;
+	for (int i = 0; i < argc; ++i) {
+		const char *s = getstr(&n);
+		if (n == -1 || INVAL(n == 0)) return 0;
+		if (!(s = db_intern_tmp(s)) || !vec_push(&args, s)) return 0;
+	}
+	if (!vec_push(&args, 0)) return 0;
+	return db_internargv(args.data);
+}
+
+static const char *decodeworkdir(const char *taskworkdir) {
+	int n;
+	// the workdir specified over IPC is *relative to* the task's dir
+	const char *rel = getstr(&n);
+	if (n == -1 || INVAL(n < 2)) return 0;
+	// as in decodeinfile(), the join would hide an absolute path
+	enum fpath_err err = FPATH_ABSOLUTE;
+	const char *workdir = "";
+	if (*rel != '/') {
+		const struct pathent *e = resolve(taskworkdir, rel);
+		if (!e) return 0;
+		err = e->err; workdir = e->canon;
+	}
+	if (err != FPATH_OK) {
+		warn_fpath("invalid dependency working directory", taskworkdir, rel,
+				err);
+		errno = EINVAL;
+		return 0;
+	}
+	return workdir;
+}
+
+// same deal as above, for infiles. if lenient, paths outside the tree come
+// back as "" to be skipped over, instead of being errors
+static const char *decodeinfile(const char *taskworkdir, bool lenient) {
+	int n;
+	const char *rel = getstr(&n);
+	if (n == -1 || INVAL(n < 0)) return 0;
+	// the join would make an absolute path look relative, so check first
+	enum fpath_err err = FPATH_ABSOLUTE;
+	const char *infile = "";
+	if (*rel != '/') {
+		const struct pathent *e = resolve(taskworkdir, rel);
+		if (!e) return 0;
+		err = e->err; infile = e->canon;
+	}
+	if (err != FPATH_OK) {
+		if (lenient && (err == FPATH_ABSOLUTE || err == FPATH_OUTSIDE)) {
+			return "";
+		}
+		warn_fpath("invalid infile path", taskworkdir, rel, err);
+		errno = EINVAL;
+		return 0;
+	}
+	return infile;
+}
+
+int ipcserver_peektype(void) {
+	if (cur->r == cur->w) return -1;
+	return (uchar)cur->buf[cur->r];
+}
+
+int ipcserver_takefd(void) {
+	int ret = rxfd;
+	rxfd = -1;
+	return ret;
+}
 
-	short type = ibuf_getc(I);
+// seals the client has to have put on a ring's memfd, so that its size can't
+// change out from under us (shrinking it would get us killed with SIGBUS)
+#ifdef F_GET_SEALS
+#define RING_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+#endif
+
+struct ipc_ring *ipcserver_mapring(int fd) {
+	struct ipc_ring *ring = 0;
+#ifdef RING_SEALS
+	int seals = fcntl(fd, F_GET_SEALS);
+	if (seals == -1) goto r; // not a memfd (or too old a kernel to check)
+	if ((seals & RING_SEALS) != RING_SEALS) {
+		errno = EINVAL;
+		goto r;
+	}
+#else
+	// only Linux clients ever send rings (see ipcclient.c), but just in case
+	errno = ENOTSUP;
+	goto r;
+#endif
+	// the client could technically have made the memfd any size; make sure it
+	// matches what we expect so we don't go reading past the end of it
+	struct stat st;
+	if (fstat(fd, &st) == -1) goto r;
+	if (st.st_size != sizeof(struct ipc_ring) + IPC_RINGSZ) {
+		errno = EINVAL;
+		goto r;
+	}
+	ring = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED) ring = 0;
+r:	close(fd);
+	return ring;
+}
+
+void ipcserver_unmapring(struct ipc_ring *ring) {
+	munmap(ring, sizeof(struct ipc_ring) + IPC_RINGSZ);
+}
+
+static void ringcopy(void *p, const struct ipc_ring *ring, uint off, uint n) {
+	off &= IPC_RINGSZ - 1;
+	uint first = IPC_RINGSZ - off;
+	if (first > n) first = n;
+	memcpy(p, ring->data + off, first);
+	memcpy((char *)p + first, ring->data, n - first);
+}
+
+bool ipcserver_recvring(struct ipc_ring *ring) {
+	uint head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint tail = atomic_load(&ring->tail);
+	if (head == tail) {
+		// going to sleep; if the client got something in just now, it won't
+		// know to wake us, so check again after saying so (see ipcclient.c)
+		atomic_store(&ring->needwake, 1);
+		tail = atomic_load(&ring->tail);
+		if (head == tail) {
+			cur = I;
+			errno = EAGAIN;
+			return false;
+		}
+		atomic_store(&ring->needwake, 0);
+	}
+	// everything here is written by the client, so trust none of it!
+	uint avail = tail - head, len;
+	if (avail > IPC_RINGSZ || avail < sizeof(len)) goto e;
+	ringcopy(&len, ring, head, sizeof(len));
+	uint recsz = (sizeof(len) + len + 3) & ~3u;
+	if (!len || len > R->sz || recsz > avail) goto e;
+	ringcopy(R->buf, ring, head + sizeof(len), len);
+	atomic_store_explicit(&ring->head, head + recsz, memory_order_release);
+	R->fd = -1; R->r = 0; R->w = len;
+	cur = R;
+	return true;
+
+e:	cur = I;
+	errno = EBADMSG;
+	return false;
+}
+
+bool ipcserver_decode(struct ipc_req *msg, const char *taskworkdir) {
+	short type = ibuf_getc(cur);
 	if (type == -1 || type == IOBUF_EOF) return false;
 	msg->type = type;
+	if (type <= IPC_REQ_RINGWAKE) ++stats.ipcreqs[type];
 
 	struct str s;
+	int n;
 	switch (msg->type) {
 		case IPC_REQ_DEP:;
-			int argc = 0;
-			int n = ibuf_getbytes(I, &argc, sizeof(argc));
-			if (n == -1 || INVAL(n != sizeof(argc))) return false;
-			// FIXME this currently leaks the alloc for each and every request;
-			// do we want to intern these like strings or just have logic to
-			// free if already in the build db??? how would that logic work???
-			const char **argv = malloc(sizeof(*argv) * (argc + 1));
+			n = ibuf_getbytes(cur, &msg->tag, sizeof(msg->tag));
+			if (n == -1 || INVAL(n != sizeof(msg->tag))) return false;
+			const char *const *argv = decodeargv();
 			if (!argv) return false;
-			for (const char **pp = argv; pp - argv < argc; ++pp) {
-				s = (struct str){0};
-				if (!str_clear(&s)) goto freeav;
-				n = ibuf_getstr(I, &s, '\0');
-				if (n == -1 || INVAL(n == 0) || !(*pp = db_intern_free(s.data))) {
-					goto freeav;
-				}
-			}
-			argv[argc] = 0;
-			s = (struct str){0};
-			// the workdir specified over IPC is *relative to* the task's dir
-			if (!str_clear(&s) || !str_append0t(&s, taskworkdir) ||
-					!str_appendc(&s, '/')) {
-				goto freeav;
-			}
-			n = ibuf_getstr(I, &s, '\0');
-			if (n == -1 || INVAL(n < 2)) goto freeav;
-			// joining paths as above is pretty much guaranteed to introduce
-			// silliness, but we canonicalise regardless so it's fine
-			char *canon = malloc(s.sz - 1);
-			if (!canon) goto freeav;
-			enum fpath_err err = fpath_canon(s.data, canon, 0);
-			if (err != FPATH_OK) {
-				warn_fpath("invalid dependency working directory", s.data, err);
-				free(canon);
-				errno = EINVAL;
-				goto freeav;
-			}
-			const char *workdir = db_intern_free(canon);
-			if (!workdir) goto freeav;
+			const char *workdir = decodeworkdir(taskworkdir);
+			if (!workdir) return false;
 			msg->dep.argv = argv;
 			msg->dep.workdir = workdir;
 			break;
-freeav:		free(argv);
-			goto e;
+		case IPC_REQ_DEPS:;
+			int ndeps;
+			n = ibuf_getbytes(cur, &ndeps, sizeof(ndeps));
+			if (n == -1 || INVAL(n != sizeof(ndeps))) return false;
+			// each dep takes up at least a few bytes, so this is a cheap way to
+			// rule out a silly allocation
+			if (INVAL(ndeps < 1 || ndeps > IPC_MSGMAX)) return false;
+			n = ibuf_getbytes(cur, &msg->tag, sizeof(msg->tag));
+			if (n == -1 || INVAL(n != sizeof(msg->tag))) return false;
+			if (!(msg->deps.workdir = decodeworkdir(taskworkdir))) return false;
+			argvs.sz = 0;
+			for (int i = 0; i < ndeps; ++i) {
+				const char *const *argv = decodeargv();
+				if (!argv || !vec_push(&argvs, argv)) return false;
+			}
+			msg->deps.argvs = argvs.data;
+			msg->deps.n = ndeps;
+			break;
 		case IPC_REQ_WAIT: break; // nothing else!
+		case IPC_REQ_WAITSOME:
+			n = ibuf_getbytes(cur, &msg->waitmax, sizeof(msg->waitmax));
+			if (n == -1 || INVAL(n != sizeof(msg->waitmax))) return false;
+			if (INVAL(msg->waitmax < 1)) return false;
+			if (msg->waitmax > (int)IPC_RESULTSMAX) {
+				msg->waitmax = IPC_RESULTSMAX;
+			}
+			break;
+		case IPC_REQ_WORKNEXT: break;
+		case IPC_REQ_WORKDONE:
+			n = ibuf_getbytes(cur, &msg->workstatus, sizeof(msg->workstatus));
+			if (n == -1 || INVAL(n != sizeof(msg->workstatus))) return false;
+			if (INVAL(msg->workstatus < 0 || msg->workstatus > 255)) {
+				return false;
+			}
+			break;
+		case IPC_REQ_RING: case IPC_REQ_RINGWAKE:
+			// these are only for proc.c, and never get decoded
+			if (INVAL(1)) return false;
 		case IPC_REQ_INFILE:
-			s = (struct str){0};
-			if (!str_clear(&s)) return false;
-			// same deal, append paths and then canonicalise
-			if (!str_append0t(&s, taskworkdir) || !str_appendc(&s, '/')) goto e;
-			n = ibuf_getstr(I, &s, '\0');
-			if (n == -1 || INVAL(n < 0)) goto e;
-			canon = malloc(s.sz - 1);
-			if (!canon) goto e;
-			err = fpath_canon(s.data, canon, 0);
-			if (err != FPATH_OK) {
-				warn_fpath("invalid infile path", s.data, err);
-				free(canon);
-				errno = EINVAL;
-				goto e;
+			if (!(msg->infile = decodeinfile(taskworkdir, false))) return false;
+			break;
+		case IPC_REQ_INFILES:;
+			int ninfiles;
+			n = ibuf_getbytes(cur, &ninfiles, sizeof(ninfiles));
+			if (n == -1 || INVAL(n != sizeof(ninfiles))) return false;
+			if (INVAL(ninfiles < 1 || ninfiles > IPC_MSGMAX)) return false;
+			paths.sz = 0;
+			for (int i = 0; i < ninfiles; ++i) {
+				const char *path = decodeinfile(taskworkdir, true);
+				if (!path) return false;
+				if (*path && !vec_push(&paths, path)) return false;
 			}
-			const char *infile = db_intern_free(canon);
-			if (!infile) goto e;
-			msg->infile = infile;
+			msg->infiles.paths = paths.data;
+			msg->infiles.n = paths.sz;
 			break;
 		case IPC_REQ_TASKTITLE:
 			s = (struct str){0};
 			if (!str_clear(&s)) return false;
-			n = ibuf_getstr(I, &s, '\0');
+			n = ibuf_getstr(cur, &s, '\0');
 			if (n == -1 || INVAL(n < 0)) goto e;
 			msg->title = s.data;
 	}
@@ -131,8 +470,60 @@ e:	free(s.data);
 	return false;
 }
 
+static uint putstr(char *buf, uint n, const char *s) {
+	uint len = strlen(s) + 1;
+	if (len > IPC_MSGMAX - n) return 0;
+	memcpy(buf + n, s, len);
+	return n + len;
+}
+
+// puts a worker's next task into buf, returning its size, or 0 if too big
+static uint encodework(char *buf, const struct task_desc *work) {
+	buf[0] = 1;
+	uint n = putstr(buf, 1, work->workdir);
+	for (const char *const *pp = work->argv; *pp && n; ++pp) {
+		n = putstr(buf, n, *pp);
+	}
+	return n;
+}
+
+bool ipcserver_sendto(int fd, const struct sockaddr_un *to, socklen_t tolen,
+		const struct ipc_reply *msg) {
+	struct iovec iov[2] = {
+		{(void *)&msg->maxstatus, 1},
+		{msg->results, msg->nresults * sizeof(*msg->results)}
+	};
+	struct msghdr mh = {
+		.msg_name = (void *)to,
+		.msg_namelen = tolen,
+		.msg_iov = iov,
+		.msg_iovlen = msg->nresults ? 2 : 1
+	};
+	union {
+		struct cmsghdr hdr; // (for alignment)
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsg = {0};
+	if (msg->work.argv) {
+		static char buf[IPC_MSGMAX];
+		uint n = encodework(buf, &msg->work);
+		if (!n) { errno = EMSGSIZE; return false; }
+		iov[0] = (struct iovec){buf, n};
+		mh.msg_iovlen = 1;
+		mh.msg_control = cmsg.buf;
+		mh.msg_controllen = sizeof(cmsg.buf);
+		struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+		c->cmsg_level = SOL_SOCKET;
+		c->cmsg_type = SCM_RIGHTS;
+		c->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(c), &msg->workerrfd, sizeof(int));
+	}
+	// never block the whole build on a reply; the client should be sitting
+	// waiting for this anyway so this can only fail if something's gone wrong
+	return sendmsg(fd, &mh, MSG_DONTWAIT) != -1;
+}
+
 bool ipcserver_send(int fd, const struct ipc_reply *msg) {
-	return write(fd, msg, 1) != -1; // lol
+	return ipcserver_sendto(fd, 0, 0, msg);
 }
 
 // vi: sw=4 ts=4 noet tw=80 cc=80
@@ -18,11 +18,71 @@
 #define INC_IPCSERVER_H
 
 #include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <intdefs.h>
 
 #include "ipc.h"
 
-bool ipcserver_recv(int fd, struct ipc_req *msg, const char *taskworkdir);
+/*
+ * Reads the next request from a task's own socket without blocking, returning
+ * false with errno set to EAGAIN if there isn't one. The request is held in an
+ * internal buffer until ipcserver_decode() is called.
+ */
+bool ipcserver_recv(int fd);
+
+/*
+ * Same as ipcserver_recv(), but for the shared socket: also gives back the
+ * token the request was sent with and the address it was sent from. Malformed
+ * requests result in false being returned with errno set to EBADMSG. Requests
+ * from any other user are rejected with errno set to EPERM; the socket must
+ * have SO_PASSCRED set, otherwise the sender is unknown and everything is.
+ */
+bool ipcserver_recvshared(int fd, uvlong *token, struct sockaddr_un *from,
+		socklen_t *fromlen);
+
+/*
+ * Gives the type of the request that'll be decoded next without decoding it, or
+ * -1 if it's empty. Used to pick out IPC_REQ_RING and IPC_REQ_RINGWAKE.
+ */
+int ipcserver_peektype(void);
+
+/*
+ * Takes the file descriptor that was passed along with the request most
+ * recently received, or returns -1 if there wasn't one. Anything not taken is
+ * closed on the next receive.
+ */
+int ipcserver_takefd(void);
+
+/*
+ * Maps in a ring passed with IPC_REQ_RING, taking ownership of the fd (it's
+ * closed either way). The fd has to be a memfd sealed against shrinking,
+ * growing and further sealing, and be the right size. Returns null on failure.
+ */
+struct ipc_ring *ipcserver_mapring(int fd);
+void ipcserver_unmapring(struct ipc_ring *ring);
+
+/*
+ * Reads the next request out of a ring, which then gets decoded *instead* of
+ * whatever was received from a socket. Once the ring is empty, false is
+ * returned with errno set to EAGAIN, the client is told to wake us up next
+ * time, and the socket request is decoded next again. If the ring has garbage
+ * in it, errno is set to EBADMSG instead.
+ */
+bool ipcserver_recvring(struct ipc_ring *ring);
+
+/*
+ * Decodes the request most recently read by any of the above functions.
+ * Strings are interned, and paths are resolved relative to taskworkdir. Lists
+ * of deps and infiles are only valid until the next request is decoded (see
+ * ipc.h).
+ */
+bool ipcserver_decode(struct ipc_req *msg, const char *taskworkdir);
+
 bool ipcserver_send(int fd, const struct ipc_reply *msg);
+bool ipcserver_sendto(int fd, const struct sockaddr_un *to, socklen_t tolen,
+		const struct ipc_reply *msg);
 
 #endif
 
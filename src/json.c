@@ -0,0 +1,29 @@
+/* This file is dedicated to the public domain. */
+
+#include <intdefs.h>
+
+#include "json.h"
+
+void json_putstr(const char *s, void (*put)(const char *p, uint n, void *ctxt),
+		void *ctxt) {
+	static const char hex[] = "0123456789abcdef";
+	put("\"", 1, ctxt);
+	const char *run = s; // start of what's yet to be put
+	for (; *s; ++s) {
+		uchar c = *s;
+		if (c >= 0x20 && c != '"' && c != '\\') continue;
+		if (s > run) put(run, s - run, ctxt);
+		run = s + 1;
+		if (c >= 0x20) {
+			put((char[2]){'\\', c}, 2, ctxt);
+		}
+		else {
+			put((char[6]){'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]}, 6,
+					ctxt);
+		}
+	}
+	if (s > run) put(run, s - run, ctxt);
+	put("\"", 1, ctxt);
+}
+
+// vi: sw=4 ts=4 noet tw=80 cc=80
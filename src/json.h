@@ -0,0 +1,19 @@
+/* This file is dedicated to the public domain. */
+
+#ifndef INC_JSON_H
+#define INC_JSON_H
+
+#include <intdefs.h>
+
+/*
+ * Writes s out as a JSON string, quotes and all, by handing it to put one piece
+ * at a time; runs of characters that don't need escaping are passed through in
+ * one go. Control characters are escaped as \u00XX, and everything else is left
+ * as-is, since the strings this is used for are taken to be UTF-8 already.
+ */
+void json_putstr(const char *s, void (*put)(const char *p, uint n, void *ctxt),
+		void *ctxt);
+
+#endif
+
+// vi: sw=4 ts=4 noet tw=80 cc=80
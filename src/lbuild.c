@@ -61,8 +61,58 @@ static int f_dep(lua_State *L) {
 		lua_pop(L, 1);
 	}
 	argv[argc] = 0;
-	build_dep(argv, luaL_checkstring(L, 2));
-	return 0;
+	lua_pushinteger(L, build_dep(argv, luaL_checkstring(L, 2)));
+	return 1;
+}
+
+// all the argvs for dep_many go into one array, with pointers to each one going
+// into another, both kept around and reused like the one above
+int manymax = 0, manyargsmax = 0;
+const char **manyargs = 0;
+const char *const **manyargvs = 0;
+
+static int f_dep_many(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	const char *workdir = luaL_checkstring(L, 2);
+	int n = lua_rawlen(L, 1);
+	if (n > manymax) {
+		const char *const **new = reallocarray(manyargvs, n,
+				sizeof(*manyargvs));
+		if (!new) luaL_error(L, "panic: out of memory");
+		manymax = n;
+		manyargvs = new;
+	}
+	int nargs = 0;
+	for (int i = 1; i <= n; ++i) {
+		lua_rawgeti(L, 1, i);
+		if (!lua_istable(L, -1)) luaL_argerror(L, 1, "expected argv tables");
+		int argc = lua_rawlen(L, -1);
+		if (argc < 1) luaL_argerror(L, 1, "argv length must be at least 1");
+		nargs += argc + 1;
+		lua_pop(L, 1);
+	}
+	if (nargs > manyargsmax) {
+		const char **new = reallocarray(manyargs, nargs, sizeof(*manyargs));
+		if (!new) luaL_error(L, "panic: out of memory");
+		manyargsmax = nargs;
+		manyargs = new;
+	}
+	// strings are kept alive by the tables, which are kept alive by the caller
+	const char **pp = manyargs;
+	for (int i = 1; i <= n; ++i) {
+		lua_rawgeti(L, 1, i);
+		manyargvs[i - 1] = pp;
+		int argc = lua_rawlen(L, -1);
+		for (int j = 1; j <= argc; ++j) {
+			lua_rawgeti(L, -1, j);
+			*pp++ = luaL_checkstring(L, -1);
+			lua_pop(L, 1);
+		}
+		*pp++ = 0;
+		lua_pop(L, 1);
+	}
+	lua_pushinteger(L, build_dep_many(manyargvs, n, workdir));
+	return 1;
 }
 
 static int f_dep_wait(lua_State *L) {
@@ -70,16 +120,70 @@ static int f_dep_wait(lua_State *L) {
 	return 1;
 }
 
+int resultsmax = 0;
+struct build_depresult *results = 0;
+
+static int f_dep_waitsome(lua_State *L) {
+	lua_Integer max = luaL_optinteger(L, 1, 64);
+	if (max < 1) luaL_argerror(L, 1, "must be at least 1");
+	if (max > 65536) max = 65536; // more than can come back at once anyway
+	if (max > resultsmax) {
+		struct build_depresult *new = reallocarray(results, max,
+				sizeof(*results));
+		if (!new) luaL_error(L, "panic: out of memory");
+		resultsmax = max;
+		results = new;
+	}
+	int n = build_dep_waitsome(results, max);
+	lua_createtable(L, n, 0);
+	for (int i = 0; i < n; ++i) {
+		lua_createtable(L, 0, 3);
+		lua_pushinteger(L, results[i].id);
+		lua_setfield(L, -2, "id");
+		lua_pushinteger(L, results[i].status);
+		lua_setfield(L, -2, "status");
+		lua_pushboolean(L, results[i].rerun);
+		lua_setfield(L, -2, "rerun");
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
 static int f_infile(lua_State *L) {
 	build_infile(luaL_checkstring(L, 1));
 	return 0;
 }
 
+static int f_infile_depfile(lua_State *L) {
+	build_infile_depfile(luaL_checkstring(L, 1));
+	return 0;
+}
+
 static int f_tasktitle(lua_State *L) {
 	build_tasktitle(luaL_checkstring(L, 1));
 	return 0;
 }
 
+static int f_worker_next(lua_State *L) {
+	const char *const *argv = build_worker_next();
+	if (!argv) return 0;
+	int argc = 0;
+	while (argv[argc]) ++argc;
+	lua_createtable(L, argc, 0);
+	for (int i = 0; i < argc; ++i) {
+		lua_pushstring(L, argv[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
+static int f_worker_done(lua_State *L) {
+	lua_Integer status = luaL_checkinteger(L, 1);
+	if (status < 0 || status > 255) luaL_argerror(L, 1, "invalid exit status");
+	build_worker_done(status);
+	return 0;
+}
+
 #define ADDF(name) do { \
 	lua_pushliteral(L, #name); \
 	lua_pushcfunction(L, &f_##name); \
@@ -90,14 +194,31 @@ static int f_tasktitle(lua_State *L) {
  * API usage something along the lines of:
  *   local build = require("lbuild")
  *   build.dep({"./cmd", "arg"}, "")
+ *   build.dep_many({{"./cmd", "arg1"}, {"./cmd", "arg2"}}, "")
  *   local status = build.dep_wait()
  *   if status ~= 0 then
  *       # oh no!
  *   endif
+ * or, to deal with each dep as soon as it's done:
+ *   local first = build.dep_many({{"./cmd", "arg1"}, {"./cmd", "arg2"}}, "")
+ *   repeat
+ *       local results = build.dep_waitsome()
+ *       for _, r in ipairs(results) do
+ *           # r.id - first is the index into the list; also r.status, r.rerun
+ *       end
+ *   until #results == 0
+ * to pick up exact header dependencies after running a compiler:
+ *   build.infile_depfile("foo.d") # as written by cc -MD -MF foo.d
+ * and, for a worker (see build(1)):
+ *   for argv in build.worker_next do
+ *       build.worker_done(main(argv))
+ *   end
  */
 export int luaopen_lbuild(lua_State *L) {
 	lua_newtable(L);
-	ADDF(dep); ADDF(dep_wait); ADDF(infile); ADDF(tasktitle);
+	ADDF(dep); ADDF(dep_many); ADDF(dep_wait); ADDF(dep_waitsome);
+	ADDF(infile); ADDF(infile_depfile); ADDF(tasktitle);
+	ADDF(worker_next); ADDF(worker_done);
 	return 1;
 }
 
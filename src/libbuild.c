@@ -14,19 +14,43 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <errmsg.h>
+#include <intdefs.h>
+#include <vec.h>
 
+#include "../include/build.h"
 #include "defs.h"
+#include "depfile.h"
 #include "ipcclient.h"
 
 #define export __attribute__((visibility("default")))
 
 static int sockfd = -1;
+static uvlong token = 0; // if nonzero, sockfd is our link to a shared socket
+static int nexttag = 1; // dep IDs, as reported back by build_dep_waitsome()
 
 static void init(const char *forfunc) {
+	const char *sockaddr_var = getenv(ENV_SOCKADDR);
+	if (sockaddr_var) {
+		const char *token_var = getenv(ENV_TOKEN);
+		if (token_var) token = strtoull(token_var, 0, 10);
+		if (!token) {
+			errmsg_diex(50, "libbuild: ", msg_fatal, "tried to call ", forfunc,
+					" but build(1) didn't provide a task token");
+		}
+		sockfd = ipcclient_connect(sockaddr_var);
+		if (sockfd == -1) {
+			errmsg_die(100, "libbuild: ", msg_fatal,
+					"couldn't connect to build(1)");
+		}
+		return;
+	}
 	const char *sockfd_var = getenv(ENV_SOCKFD);
 	if (!sockfd_var) {
 		errmsg_diex(50, "libbuild: ", msg_fatal, "tried to call ", forfunc,
@@ -35,7 +59,7 @@ static void init(const char *forfunc) {
 	sockfd = atoi(sockfd_var); // eh, just assume this is correct
 }
 
-export void build_dep(const char *const *argv, const char *workdir) {
+export int build_dep(const char *const *argv, const char *workdir) {
 	if (sockfd == -1) init("build_dep");
 	// validate strings: the IPC server code is lazy and just says
 	// "invalid message" and crashes the whole build, whereas it's easier to put
@@ -48,28 +72,83 @@ export void build_dep(const char *const *argv, const char *workdir) {
 	}
 	struct ipc_req req;
 	req.type = IPC_REQ_DEP;
+	req.tag = nexttag;
 	req.dep.argv = argv;
 	req.dep.workdir = workdir;
-	if (!ipcclient_send(sockfd, &req)) {
+	if (!ipcclient_send(sockfd, token, &req)) {
+		errmsg_die(100, "libbuild: ", msg_fatal, "couldn't send IPC request");
+	}
+	return nexttag++;
+}
+
+export int build_dep_many(const char *const *const *argvs, int n,
+		const char *workdir) {
+	if (sockfd == -1) init("build_dep_many");
+	if (!workdir[0]) {
+		errmsg_diex(2, "libbuild: ", msg_fatal,
+				"working directory cannot be empty");
+	}
+	if (n < 0) errmsg_diex(2, "libbuild: ", msg_fatal, "negative dep count");
+	if (!n) return nexttag;
+	for (int i = 0; i < n; ++i) {
+		if (!argvs[i][0]) {
+			errmsg_diex(2, "libbuild: ", msg_fatal, "argv cannot be empty");
+		}
+	}
+	struct ipc_req req;
+	req.type = IPC_REQ_DEPS;
+	req.deps.argvs = argvs;
+	req.deps.workdir = workdir;
+	req.deps.n = n;
+	req.tag = nexttag;
+	if (!ipcclient_send(sockfd, token, &req)) {
 		errmsg_die(100, "libbuild: ", msg_fatal, "couldn't send IPC request");
 	}
+	nexttag += n;
+	return req.tag;
 }
 
 export int build_dep_wait(void) {
 	if (sockfd == -1) init("build_dep_wait");
 	struct ipc_req req;
 	req.type = IPC_REQ_WAIT;
-	if (!ipcclient_send(sockfd, &req)) {
+	if (!ipcclient_send(sockfd, token, &req)) {
 		errmsg_die(100, "libbuild: ", msg_fatal, "couldn't send IPC request");
 	}
 	// this one actually takes a reply!
-	struct ipc_reply reply;
+	struct ipc_reply reply = {0};
 	if (!ipcclient_recv(sockfd, &reply)) {
 		errmsg_die(100, "libbuild: ", msg_fatal, "couldn't read IPC reply");
 	}
 	return reply.maxstatus;
 }
 
+export int build_dep_waitsome(struct build_depresult *out, int max) {
+	if (sockfd == -1) init("build_dep_waitsome");
+	if (max < 1) {
+		errmsg_diex(2, "libbuild: ", msg_fatal,
+				"result count must be positive");
+	}
+	static struct ipc_depresult results[IPC_RESULTSMAX];
+	if (max > (int)IPC_RESULTSMAX) max = IPC_RESULTSMAX;
+	struct ipc_req req;
+	req.type = IPC_REQ_WAITSOME;
+	req.waitmax = max;
+	if (!ipcclient_send(sockfd, token, &req)) {
+		errmsg_die(100, "libbuild: ", msg_fatal, "couldn't send IPC request");
+	}
+	struct ipc_reply reply = {0, max, results};
+	if (!ipcclient_recv(sockfd, &reply)) {
+		errmsg_die(100, "libbuild: ", msg_fatal, "couldn't read IPC reply");
+	}
+	for (uint i = 0; i < reply.nresults; ++i) {
+		out[i] = (struct build_depresult){
+			results[i].tag, results[i].status, results[i].rerun
+		};
+	}
+	return reply.nresults;
+}
+
 export void build_infile(const char *path) {
 	if (sockfd == -1) init("build_infile");
 	if (!path[0]) {
@@ -78,11 +157,67 @@ export void build_infile(const char *path) {
 	struct ipc_req req;
 	req.type = IPC_REQ_INFILE;
 	req.infile = path;
-	if (!ipcclient_send(sockfd, &req)) {
+	if (!ipcclient_send(sockfd, token, &req)) {
 		errmsg_die(100, "libbuild: ", msg_fatal, "couldn't send IPC request");
 	}
 }
 
+struct vec_path VEC(const char *);
+
+static bool adddepfilepath(const char *path, void *ctxt) {
+	// absolute paths are always outside the project (probably system headers)
+	// and build would only throw them away, so don't bother sending them
+	if (*path == '/') return true;
+	return vec_push((struct vec_path *)ctxt, path);
+}
+
+export void build_infile_depfile(const char *path) {
+	if (sockfd == -1) init("build_infile_depfile");
+	if (!path[0]) {
+		errmsg_diex(2, "libbuild: ", msg_fatal, "depfile path cannot be empty");
+	}
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		errmsg_die(errno == ENOENT ? 2 : 100, "libbuild: ", msg_fatal,
+				"couldn't open depfile ", path);
+	}
+	char *buf = 0;
+	uint len = 0, max = 0;
+	for (;;) {
+		// always leave a spare byte at the end, for depfile_parse()
+		if (max - len < 2) {
+			max = max ? max * 2 : 16384;
+			if (!(buf = realloc(buf, max))) goto nomem;
+		}
+		long nread = read(fd, buf + len, max - len - 1);
+		if (nread == -1) {
+			if (errno == EINTR) continue;
+			errmsg_die(100, "libbuild: ", msg_fatal, "couldn't read depfile ",
+					path);
+		}
+		if (!nread) break;
+		len += nread;
+	}
+	close(fd);
+	struct vec_path paths = {0};
+	if (!depfile_parse(buf, len, &adddepfilepath, &paths)) goto nomem;
+	if (paths.sz) {
+		struct ipc_req req;
+		req.type = IPC_REQ_INFILES;
+		req.infiles.paths = paths.data;
+		req.infiles.n = paths.sz;
+		if (!ipcclient_send(sockfd, token, &req)) {
+			errmsg_die(100, "libbuild: ", msg_fatal,
+					"couldn't send IPC request");
+		}
+	}
+	free(paths.data);
+	free(buf);
+	return;
+
+nomem:	errmsg_die(100, "libbuild: ", msg_fatal, "couldn't allocate memory");
+}
+
 export void build_tasktitle(const char *s) {
 	if (sockfd == -1) init("build_tasktitle");
 	if (!s[0]) {
@@ -91,7 +226,120 @@ export void build_tasktitle(const char *s) {
 	struct ipc_req req;
 	req.type = IPC_REQ_TASKTITLE;
 	req.title = (char *)s; // XXX hmmm
-	if (!ipcclient_send(sockfd, &req)) {
+	if (!ipcclient_send(sockfd, token, &req)) {
+		errmsg_die(100, "libbuild: ", msg_fatal, "couldn't send IPC request");
+	}
+}
+
+// worker state: the directory and stderr the worker started with, and whether
+// it's in the middle of a task
+static int rootfd = -1, origerr = -1;
+static bool working = false;
+
+// sets BUILD_ROOT_DIR to lead back out of workdir (which build gives us in
+// canonical form, so each component just needs a ../)
+static bool setrootdir(const char *workdir) {
+	char buf[4096];
+	if (workdir[0] == '.' && !workdir[1]) return !setenv(ENV_ROOT_DIR, ".", 1);
+	uint n = 0;
+	for (const char *p = workdir; *p; ++p) {
+		if (p != workdir && p[-1] != '/') continue;
+		if (n + 3 >= sizeof(buf)) { errno = ENAMETOOLONG; return false; }
+		memcpy(buf + n, "../", 3);
+		n += 3;
+	}
+	buf[n] = '\0';
+	return !setenv(ENV_ROOT_DIR, buf, 1);
+}
+
+export const char *const *build_worker_next(void) {
+	static char buf[IPC_MSGMAX];
+	static const char **argv = 0;
+	static uint argvmax = 0;
+	if (sockfd == -1) {
+		// not being run by build at all is just another way of not being a
+		// worker, so let the program get on with it
+		if (!getenv(ENV_SOCKADDR) && !getenv(ENV_SOCKFD)) return 0;
+		init("build_worker_next");
+	}
+	if (working) {
+		errmsg_diex(2, "libbuild: ", msg_fatal,
+				"worker asked for another task without finishing the last");
+	}
+	if (rootfd == -1) {
+		rootfd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		origerr = fcntl(2, F_DUPFD_CLOEXEC, 3);
+		if (rootfd == -1 || origerr == -1) {
+			errmsg_die(100, "libbuild: ", msg_fatal,
+					"couldn't set up to be a worker");
+		}
+	}
+	struct ipc_req req;
+	req.type = IPC_REQ_WORKNEXT;
+	if (!ipcclient_send(sockfd, token, &req)) {
+		errmsg_die(100, "libbuild: ", msg_fatal, "couldn't send IPC request");
+	}
+	int errfd;
+	long n = ipcclient_recvwork(sockfd, buf, sizeof(buf), &errfd);
+	if (n == -1) {
+		errmsg_die(100, "libbuild: ", msg_fatal, "couldn't read IPC reply");
+	}
+	if (!buf[0]) {
+		if (errfd != -1) close(errfd);
+		return 0;
+	}
+	if (errfd == -1 || buf[n - 1]) {
+		errmsg_diex(100, "libbuild: ", msg_fatal, "got an invalid task");
+	}
+	// the workdir comes first, then the args
+	uint argc = 0;
+	for (const char *p = buf + 1; p - buf < n; p += strlen(p) + 1) ++argc;
+	if (argc >= argvmax) {
+		const char **new = realloc(argv, (argc + 1) * sizeof(*argv));
+		if (!new) {
+			errmsg_die(100, "libbuild: ", msg_fatal, "couldn't allocate argv");
+		}
+		argv = new;
+		argvmax = argc + 1;
+	}
+	argc = 0;
+	for (char *p = buf + 1; p - buf < n; p += strlen(p) + 1) argv[argc++] = p;
+	argv[argc] = 0;
+	const char *workdir = argv[0];
+	dup2(errfd, 2);
+	close(errfd);
+	working = true;
+	if (fchdir(rootfd) == -1 || chdir(workdir) == -1) {
+		// same deal as build does for a process: a missing directory is a
+		// perfectly cacheable result, anything else isn't
+		int e = errno;
+		errmsg_warn("libbuild: ", msg_error, "couldn't enter directory ",
+				workdir);
+		build_worker_done(e == ENOENT || e == EACCES ? 2 : 100);
+		return build_worker_next();
+	}
+	if (!setrootdir(workdir)) {
+		errmsg_die(100, "libbuild: ", msg_fatal, "couldn't set environment");
+	}
+	return argv + 1;
+}
+
+export void build_worker_done(int status) {
+	if (!working) {
+		errmsg_diex(2, "libbuild: ", msg_fatal,
+				"build_worker_done() called without a task");
+	}
+	if (status < 0 || status > 255) {
+		errmsg_diex(2, "libbuild: ", msg_fatal, "invalid exit status");
+	}
+	// stop writing to the task's error output before it's done with
+	dup2(origerr, 2);
+	working = false;
+	setenv(ENV_ROOT_DIR, ".", 1);
+	struct ipc_req req;
+	req.type = IPC_REQ_WORKDONE;
+	req.workstatus = status;
+	if (!ipcclient_send(sockfd, token, &req)) {
 		errmsg_die(100, "libbuild: ", msg_fatal, "couldn't send IPC request");
 	}
 }
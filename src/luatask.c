@@ -0,0 +1,533 @@
+/* This file is dedicated to the public domain. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef LUA_HEADER
+#include LUA_HEADER
+#include LUA_AUX_HEADER
+#include LUA_LIB_HEADER
+#endif
+
+#include <intdefs.h>
+#include <vec.h>
+
+#include "db.h"
+#include "depfile.h"
+#include "fd.h"
+#include "fpath.h"
+#include "ipc.h"
+#include "luatask.h"
+
+struct luatask {
+#ifdef LUA_HEADER
+	lua_State *co; // the task's coroutine, or null if it's not running
+	int ref; // keeps co from being collected
+	int nargs; // passed in on the first resume
+	int nexttag; // dep IDs, same as libbuild (but per task)
+	bool waiting; // suspended until the reply comes in
+	bool replied; // reply has come in since the last request
+	// char padding[2];
+	uint resultsmax;
+	struct ipc_reply reply;
+#endif
+	int status; // exit status, once co is gone (or if it never got going)
+	const char *workdir;
+	void *ctxt;
+	char *errout;
+	uint errsz, errmax;
+};
+
+static void (*reqcb)(void *ctxt, struct ipc_req *req);
+
+void luatask_init(void (*req)(void *ctxt, struct ipc_req *req)) {
+	reqcb = req;
+}
+
+// if this runs out of memory the output just gets lost, which is the least of
+// our worries at that point
+static void putout(struct luatask *lt, const char *p, uint n) {
+	if (lt->errsz + n > lt->errmax) {
+		uint newmax = lt->errmax ? lt->errmax : 256;
+		while (newmax < lt->errsz + n) newmax *= 2;
+		char *new = realloc(lt->errout, newmax);
+		if (!new) return;
+		lt->errout = new;
+		lt->errmax = newmax;
+	}
+	memcpy(lt->errout + lt->errsz, p, n);
+	lt->errsz += n;
+}
+
+static void putout0t(struct luatask *lt, const char *s) {
+	putout(lt, s, strlen(s));
+}
+
+#ifdef LUA_HEADER
+
+static lua_State *L0 = 0; // only created once there's a Lua task to run
+static int envmt; // metatable for each task's globals, to fall back on _G
+static struct luatask *running = 0; // the task whose coroutine is running
+
+// joins a path onto the task's workdir and canonicalises it, as ipcserver does
+// for paths coming over IPC; returns the interned result, or raises an error
+static const char *taskpath(lua_State *L, const char *path, const char *what) {
+	// the join would make an absolute path look relative, so check first
+	if (*path == '/') {
+		luaL_error(L, "invalid %s %s: %s", what, path,
+				fpath_errorstring(FPATH_ABSOLUTE));
+	}
+	size_t len;
+	const char *joined = lua_pushfstring(L, "%s/%s", running->workdir, path);
+	lua_tolstring(L, -1, &len);
+	char *canon = malloc(len + 1);
+	if (!canon) luaL_error(L, "out of memory");
+	enum fpath_err err = fpath_canon(joined, canon, 0);
+	if (err != FPATH_OK) {
+		free(canon);
+		luaL_error(L, "invalid %s %s: %s", what, path, fpath_errorstring(err));
+	}
+	lua_pop(L, 1);
+	const char *ret = db_intern_free(canon);
+	if (!ret) luaL_error(L, "out of memory");
+	return ret;
+}
+
+// makes sure argv (at idx) is a table of non-empty strings, returning argc
+static int checkargv(lua_State *L, int idx, int arg) {
+	if (!lua_istable(L, idx)) luaL_argerror(L, arg, "expected argv tables");
+	int argc = lua_rawlen(L, idx);
+	if (argc < 1) luaL_argerror(L, arg, "argv length must be at least 1");
+	for (int i = 1; i <= argc; ++i) {
+		lua_rawgeti(L, idx, i);
+		if (lua_type(L, -1) != LUA_TSTRING || !lua_rawlen(L, -1)) {
+			luaL_argerror(L, arg, "argv must be non-empty strings");
+		}
+		lua_pop(L, 1);
+	}
+	return argc;
+}
+
+// interns an argv that's already been checked; can't raise errors, since it
+// allocates stuff that would leak. returns null if out of memory
+static const char *const *makeargv(lua_State *L, int idx, int argc) {
+	const char **argv = malloc(sizeof(*argv) * (argc + 1));
+	if (!argv) return 0;
+	for (int i = 0; i < argc; ++i) {
+		lua_rawgeti(L, idx, i + 1);
+		argv[i] = db_intern_tmp(lua_tostring(L, -1));
+		lua_pop(L, 1);
+		if (!argv[i]) { free(argv); return 0; }
+	}
+	argv[argc] = 0;
+	const char *const *ret = db_internargv(argv);
+	free(argv);
+	return ret;
+}
+
+static int f_dep(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int argc = checkargv(L, 1, 1);
+	const char *workdir = luaL_checkstring(L, 2);
+	if (!*workdir) luaL_argerror(L, 2, "working directory cannot be empty");
+	workdir = taskpath(L, workdir, "dependency working directory");
+	const char *const *argv = makeargv(L, 1, argc);
+	if (!argv) luaL_error(L, "out of memory");
+	struct ipc_req req = {
+		.type = IPC_REQ_DEP, .tag = running->nexttag, .dep = {argv, workdir}
+	};
+	reqcb(running->ctxt, &req);
+	lua_pushinteger(L, running->nexttag++);
+	return 1;
+}
+
+static int f_dep_many(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int n = lua_rawlen(L, 1);
+	for (int i = 1; i <= n; ++i) {
+		lua_rawgeti(L, 1, i);
+		checkargv(L, lua_gettop(L), 1);
+		lua_pop(L, 1);
+	}
+	const char *workdir = luaL_checkstring(L, 2);
+	if (!*workdir) luaL_argerror(L, 2, "working directory cannot be empty");
+	workdir = taskpath(L, workdir, "dependency working directory");
+	if (!n) {
+		lua_pushinteger(L, running->nexttag);
+		return 1;
+	}
+	const char *const **argvs = malloc(sizeof(*argvs) * n);
+	if (!argvs) luaL_error(L, "out of memory");
+	for (int i = 0; i < n; ++i) {
+		lua_rawgeti(L, 1, i + 1);
+		argvs[i] = makeargv(L, lua_gettop(L), lua_rawlen(L, -1));
+		lua_pop(L, 1);
+		if (!argvs[i]) { free(argvs); luaL_error(L, "out of memory"); }
+	}
+	struct ipc_req req = {
+		.type = IPC_REQ_DEPS, .tag = running->nexttag,
+		.deps = {argvs, workdir, n}
+	};
+	reqcb(running->ctxt, &req);
+	free(argvs);
+	lua_pushinteger(L, running->nexttag);
+	running->nexttag += n;
+	return 1;
+}
+
+// these pick up the reply, either straight away or once the task is resumed
+static int k_dep_wait(lua_State *L, int status, lua_KContext ctx) {
+	running->waiting = false;
+	lua_pushinteger(L, running->reply.maxstatus);
+	return 1;
+}
+
+static int k_dep_waitsome(lua_State *L, int status, lua_KContext ctx) {
+	running->waiting = false;
+	const struct ipc_reply *r = &running->reply;
+	lua_createtable(L, r->nresults, 0);
+	for (uint i = 0; i < r->nresults; ++i) {
+		lua_createtable(L, 0, 3);
+		lua_pushinteger(L, r->results[i].tag);
+		lua_setfield(L, -2, "id");
+		lua_pushinteger(L, r->results[i].status);
+		lua_setfield(L, -2, "status");
+		lua_pushboolean(L, r->results[i].rerun);
+		lua_setfield(L, -2, "rerun");
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
+static int waitreply(lua_State *L, struct ipc_req *req, lua_KFunction k) {
+	// yielding from some other coroutine would just resume whatever resumed
+	// that, rather than suspending the task until the reply comes in
+	if (L != running->co) {
+		luaL_error(L, "can't wait for dependencies from another coroutine");
+	}
+	running->replied = false;
+	reqcb(running->ctxt, req);
+	if (running->replied) return k(L, LUA_OK, 0);
+	running->waiting = true;
+	return lua_yieldk(L, 0, 0, k);
+}
+
+static int f_dep_wait(lua_State *L) {
+	struct ipc_req req = {.type = IPC_REQ_WAIT};
+	return waitreply(L, &req, &k_dep_wait);
+}
+
+static int f_dep_waitsome(lua_State *L) {
+	lua_Integer max = luaL_optinteger(L, 1, 64);
+	if (max < 1) luaL_argerror(L, 1, "must be at least 1");
+	if (max > IPC_RESULTSMAX) max = IPC_RESULTSMAX;
+	struct ipc_req req = {.type = IPC_REQ_WAITSOME, .waitmax = max};
+	return waitreply(L, &req, &k_dep_waitsome);
+}
+
+static int f_infile(lua_State *L) {
+	const char *path = luaL_checkstring(L, 1);
+	if (!*path) luaL_argerror(L, 1, "infile path cannot be empty");
+	// absolute paths are outside the tree, so skip them like depfile paths
+	if (*path == '/') return 0;
+	struct ipc_req req = {
+		.type = IPC_REQ_INFILE, .infile = taskpath(L, path, "infile path")
+	};
+	reqcb(running->ctxt, &req);
+	return 0;
+}
+
+struct vec_path VEC(const char *);
+
+// canonicalises each path from a depfile, like taskpath() (but without raising
+// errors, so nothing leaks). paths outside the tree are skipped, as they would
+// be by ipcserver
+static bool adddepfilepath(const char *path, void *ctxt) {
+	if (*path == '/') return true;
+	uint wdlen = strlen(running->workdir), len = strlen(path);
+	char *joined = malloc(wdlen + len + 2);
+	if (!joined) return false;
+	memcpy(joined, running->workdir, wdlen); joined[wdlen] = '/';
+	memcpy(joined + wdlen + 1, path, len + 1);
+	char *canon = malloc(wdlen + len + 2);
+	if (!canon) { free(joined); return false; }
+	enum fpath_err err = fpath_canon(joined, canon, 0);
+	free(joined);
+	if (err != FPATH_OK) { free(canon); return true; }
+	const char *infile = db_intern_free(canon);
+	return infile && vec_push((struct vec_path *)ctxt, infile);
+}
+
+static int f_infile_depfile(lua_State *L) {
+	const char *path = luaL_checkstring(L, 1);
+	if (!*path) luaL_argerror(L, 1, "depfile path cannot be empty");
+	const char *full = *path == '/' ? path :
+			lua_pushfstring(L, "%s/%s", running->workdir, path);
+	int fd = open(full, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		luaL_error(L, "couldn't open depfile %s: %s", path, strerror(errno));
+	}
+	struct stat s;
+	char *buf = 0;
+	long nread = -1;
+	// (the extra byte is for depfile_parse())
+	if (fstat(fd, &s) != -1 && (buf = malloc(s.st_size + 1))) {
+		nread = fd_readall(fd, buf, s.st_size);
+		if (nread == -1) free(buf);
+	}
+	int err = errno;
+	close(fd);
+	if (nread == -1) {
+		luaL_error(L, "couldn't read depfile %s: %s", path, strerror(err));
+	}
+	struct vec_path paths = {0};
+	bool ok = depfile_parse(buf, nread, &adddepfilepath, &paths);
+	free(buf);
+	if (!ok) { free(paths.data); luaL_error(L, "out of memory"); }
+	if (!paths.sz) { free(paths.data); return 0; }
+	struct ipc_req req = {
+		.type = IPC_REQ_INFILES, .infiles = {paths.data, paths.sz}
+	};
+	reqcb(running->ctxt, &req);
+	free(paths.data);
+	return 0;
+}
+
+static int f_tasktitle(lua_State *L) {
+	const char *s = luaL_checkstring(L, 1);
+	if (!*s) luaL_argerror(L, 1, "task title cannot be empty");
+	struct ipc_req req = {.type = IPC_REQ_TASKTITLE, .title = strdup(s)};
+	if (!req.title) luaL_error(L, "out of memory");
+	reqcb(running->ctxt, &req);
+	return 0;
+}
+
+// stdout belongs to build (and the tui), so print goes to error output instead
+static int f_print(lua_State *L) {
+	int n = lua_gettop(L);
+	for (int i = 1; i <= n; ++i) {
+		size_t len;
+		const char *s = luaL_tolstring(L, i, &len);
+		if (i > 1) putout(running, "\t", 1);
+		putout(running, s, len);
+		lua_pop(L, 1);
+	}
+	putout(running, "\n", 1);
+	return 0;
+}
+
+static int f_exit(lua_State *L) {
+	return luaL_error(L, "os.exit() would exit the entire build; "
+			"return a status from the script instead");
+}
+
+static int f_require(lua_State *L) {
+	lua_pushvalue(L, lua_upvalueindex(1));
+	return 1;
+}
+
+static const luaL_Reg buildfuncs[] = {
+	{"dep", &f_dep},
+	{"dep_many", &f_dep_many},
+	{"dep_wait", &f_dep_wait},
+	{"dep_waitsome", &f_dep_waitsome},
+	{"infile", &f_infile},
+	{"infile_depfile", &f_infile_depfile},
+	{"tasktitle", &f_tasktitle},
+	{0, 0}
+};
+
+static int initlua(lua_State *L) {
+	luaL_openlibs(L);
+	lua_newtable(L);
+	luaL_setfuncs(L, buildfuncs, 0);
+	// scripts written for the lbuild module work as-is
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "preload");
+	lua_pushvalue(L, -3);
+	lua_pushcclosure(L, &f_require, 1);
+	lua_setfield(L, -2, "lbuild");
+	lua_pop(L, 2);
+	lua_setglobal(L, "build");
+	lua_pushcfunction(L, &f_print);
+	lua_setglobal(L, "print");
+	lua_getglobal(L, "os");
+	lua_pushcfunction(L, &f_exit);
+	lua_setfield(L, -2, "exit");
+	lua_pop(L, 1);
+	// each task gets its own globals, falling back on the shared ones, so that
+	// tasks can't trip each other up
+	lua_createtable(L, 0, 1);
+	lua_pushglobaltable(L);
+	lua_setfield(L, -2, "__index");
+	envmt = luaL_ref(L, LUA_REGISTRYINDEX);
+	return 0;
+}
+
+// does all the setup for a task in protected mode, so running out of memory
+// gives an error instead of a panic
+static int setup(lua_State *L) {
+	struct luatask *lt = lua_touserdata(L, 1);
+	const char *const *argv = lua_touserdata(L, 2);
+	lua_State *co = lua_newthread(L);
+	const char *path = argv[1][0] == '/' ? argv[1] :
+			lua_pushfstring(L, "%s/%s", lt->workdir, argv[1]);
+	if (luaL_loadfile(co, path) != LUA_OK) {
+		lua_xmove(co, L, 1);
+		return lua_error(L);
+	}
+	lua_createtable(L, 0, 1); // globals
+	lua_rawgeti(L, LUA_REGISTRYINDEX, envmt);
+	lua_setmetatable(L, -2);
+	int nargs = 0;
+	for (const char *const *pp = argv + 2; *pp; ++pp) ++nargs;
+	lua_createtable(L, nargs, 1); // like the standalone interpreter's arg
+	for (int i = 0; i <= nargs; ++i) {
+		lua_pushstring(L, argv[i + 1]);
+		lua_rawseti(L, -2, i);
+	}
+	lua_setfield(L, -2, "arg");
+	if (!lua_checkstack(co, nargs + 1)) luaL_error(L, "too many arguments");
+	lua_xmove(L, co, 1);
+	lua_setupvalue(co, -2, 1); // the chunk's _ENV
+	for (int i = 0; i < nargs; ++i) lua_pushstring(L, argv[i + 2]);
+	lua_xmove(L, co, nargs);
+	lt->nargs = nargs;
+	lt->nexttag = 1;
+	lua_pushvalue(L, 3);
+	lt->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lt->co = co;
+	return 0;
+}
+
+#endif
+
+struct luatask *luatask_new(const char *const *argv, const char *workdir,
+		void *ctxt) {
+	struct luatask *lt = calloc(1, sizeof(*lt));
+	if (!lt) return 0;
+	lt->workdir = workdir;
+	lt->ctxt = ctxt;
+#ifdef LUA_HEADER
+	if (!argv[1]) {
+		putout0t(lt, "usage: @lua SCRIPT [ARGS...]\n");
+		lt->status = 2;
+		return lt;
+	}
+	if (!L0) {
+		L0 = luaL_newstate();
+		if (!L0) goto nomem;
+		lua_pushcfunction(L0, &initlua);
+		if (lua_pcall(L0, 0, 0, 0) != LUA_OK) {
+			lua_close(L0);
+			L0 = 0;
+			goto nomem;
+		}
+	}
+	lua_pushcfunction(L0, &setup);
+	lua_pushlightuserdata(L0, lt);
+	lua_pushlightuserdata(L0, (void *)argv);
+	int ret = lua_pcall(L0, 2, 0, 0);
+	if (ret != LUA_OK) {
+		if (ret == LUA_ERRMEM) { lua_pop(L0, 1); goto nomem; }
+		putout0t(lt, "@lua: ");
+		putout0t(lt, lua_tostring(L0, -1));
+		putout0t(lt, "\n");
+		lua_pop(L0, 1);
+		lt->status = 1;
+	}
+	return lt;
+
+nomem:
+	putout0t(lt, "@lua: out of memory\n");
+	lt->status = 100;
+#else
+	putout0t(lt, "@lua: build was compiled without Lua support\n");
+	lt->status = 2;
+#endif
+	return lt;
+}
+
+int luatask_resume(struct luatask *lt) {
+#ifdef LUA_HEADER
+	if (!lt->co) return lt->status;
+	struct luatask *prev = running;
+	running = lt;
+	int nres;
+	int ret = lua_resume(lt->co, L0, lt->nargs, &nres);
+	running = prev;
+	lt->nargs = 0;
+	if (ret == LUA_YIELD) {
+		lua_pop(lt->co, nres);
+		if (lt->waiting) return -1;
+		putout0t(lt, "@lua: task script yielded without waiting on anything\n");
+		lt->status = 1;
+	}
+	else if (ret == LUA_OK) {
+		lt->status = 0;
+		// the script can return its exit status, just like main() would
+		if (nres && !lua_isnil(lt->co, -nres)) {
+			int isnum;
+			lua_Integer n = lua_tointegerx(lt->co, -nres, &isnum);
+			if (isnum && n >= 0 && n <= 255) {
+				lt->status = n;
+			}
+			else {
+				putout0t(lt, "@lua: script returned an invalid exit status\n");
+				lt->status = 1;
+			}
+		}
+	}
+	else {
+		const char *msg = lua_tostring(lt->co, -1);
+		putout0t(lt, "@lua: ");
+		putout0t(lt, msg ? msg : "(error object isn't a string)");
+		putout0t(lt, "\n");
+		lt->status = ret == LUA_ERRMEM ? 100 : 1;
+	}
+	luaL_unref(L0, LUA_REGISTRYINDEX, lt->ref);
+	lt->co = 0;
+#endif
+	return lt->status;
+}
+
+bool luatask_reply(struct luatask *lt, const struct ipc_reply *r) {
+#ifdef LUA_HEADER
+	if (r->nresults > lt->resultsmax) {
+		struct ipc_depresult *new = realloc(lt->reply.results,
+				r->nresults * sizeof(*r->results));
+		if (!new) return false;
+		lt->reply.results = new;
+		lt->resultsmax = r->nresults;
+	}
+	if (r->nresults) {
+		memcpy(lt->reply.results, r->results,
+				r->nresults * sizeof(*r->results));
+	}
+	lt->reply.maxstatus = r->maxstatus;
+	lt->reply.nresults = r->nresults;
+	lt->replied = true;
+#endif
+	return true;
+}
+
+const char *luatask_errout(const struct luatask *lt, uint *len) {
+	*len = lt->errsz;
+	return lt->errout;
+}
+
+void luatask_free(struct luatask *lt) {
+#ifdef LUA_HEADER
+	if (lt->co) luaL_unref(L0, LUA_REGISTRYINDEX, lt->ref);
+	free(lt->reply.results);
+#endif
+	free(lt->errout);
+	free(lt);
+}
+
+// vi: sw=4 ts=4 noet tw=80 cc=80
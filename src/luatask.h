@@ -0,0 +1,53 @@
+/* This file is dedicated to the public domain. */
+
+#ifndef INC_LUATASK_H
+#define INC_LUATASK_H
+
+#include <stdbool.h>
+
+#include <intdefs.h>
+
+#include "ipc.h"
+
+/*
+ * @lua SCRIPT [ARGS...] tasks run a Lua build script inside build itself, each
+ * in its own coroutine, rather than in a separate interpreter process. Scripts
+ * get the same API as the lbuild module (also available via require "lbuild"),
+ * except that waiting on deps suspends the coroutine instead of a process.
+ */
+
+struct luatask;
+
+/*
+ * Sets the function that handles requests from Lua tasks, exactly as if they'd
+ * come in over IPC; ctxt is whatever was passed to luatask_new(). A request
+ * that gets a reply must be answered with luatask_reply() - either right away,
+ * or later on, in which case the task waits until luatask_resume() is called.
+ */
+void luatask_init(void (*req)(void *ctxt, struct ipc_req *req));
+
+/*
+ * Sets up a task to run the given argv (starting with @lua) in workdir. It
+ * doesn't start running until the first call to luatask_resume(). Returns null
+ * if out of memory.
+ */
+struct luatask *luatask_new(const char *const *argv, const char *workdir,
+		void *ctxt);
+
+/*
+ * Runs a task until it finishes, or until it has to wait for a reply. Returns
+ * the task's exit status, or -1 if it's waiting.
+ */
+int luatask_resume(struct luatask *lt);
+
+/* Gives a task the reply to its last request; false if out of memory. */
+bool luatask_reply(struct luatask *lt, const struct ipc_reply *r);
+
+/* Gets whatever the task printed, or had to say about its errors, so far. */
+const char *luatask_errout(const struct luatask *lt, uint *len);
+
+void luatask_free(struct luatask *lt);
+
+#endif
+
+// vi: sw=4 ts=4 noet tw=80 cc=80
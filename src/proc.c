@@ -16,11 +16,19 @@
 
 #include <errno.h>
 #include <limits.h>
+#include <poll.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #include <alloc.h>
 #include <basichashes.h>
@@ -30,6 +38,7 @@
 #include <path.h>
 #include <noreturn.h>
 #include <table.h>
+#include <vec.h>
 
 #include "build.h"
 #include "defs.h"
@@ -37,6 +46,8 @@
 #include "fpath.h"
 #include "ipcserver.h"
 #include "proc.h"
+#include "stats.h"
+#include "time.h"
 #include "tui.h"
 
 static struct q {
@@ -53,6 +64,22 @@ int nactive, nblocked;
 static char **procenv;
 static proc_ev_cb ev_cb;
 
+// every process we've started and not yet reaped, in no particular order; each
+// proc_info knows its own index so removal is just a swap with the last entry
+struct vec_procp VEC(struct proc_info *);
+static struct vec_procp live = {0};
+
+// on Linux, we get a pidfd for each child and poll it like any other fd, which
+// means exits get handled right alongside IO without any SIGCHLD interruption
+// or waitpid(-1) guessing game. everywhere else (and on ancient kernels) we
+// fall back on the signal, plus a table to figure out which process is which
+#if defined(__linux__) && defined(SYS_pidfd_open)
+#define USE_PIDFD
+static bool usepidfd = false;
+#else
+#define usepidfd false
+#endif
+
 static inline uint hash_pid(pid_t x) {
 	if (sizeof(pid_t) <= 4) return hash_int(x);
 	return hash_vlong(x);
@@ -61,41 +88,243 @@ static inline pid_t proc_hash_memb(struct proc_info **p) { return (*p)->_pid; }
 
 DECL_TABLE(static, pid_proc, pid_t, struct proc_info *)
 DEF_TABLE(static, pid_proc, hash_pid, table_ideq, proc_hash_memb)
-static struct table_pid_proc by_pid = {0};
-
-static void doerrio(int fd, struct proc_info *p) {
-	char buf[65536];
-	int nread;
-	while ((nread = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
-		ev_cb(PROC_EV_STDERR, (union proc_ev_param){.buf = buf, .sz = nread}, p);
-	}
-#ifdef __NetBSD__
-	// NetBSD's poll() is a stupid idiot and gives POLLIN instead of POLLHUP for
-	// sockets. I really like NetBSD as a project and everything but come on.
-	if (nread == 0) evloop_onfd_remove(fd);
+static struct table_pid_proc by_pid = {0}; // only used without pidfds
+
+// resolved paths of commands run via PATH, keyed by name - argv strings are
+// always interned, so the pointer alone identifies a name. PATH itself never
+// changes during a run so there's no point scanning it over and over again,
+// let alone allocating a new string every time
+struct progpath { const char *name, *path; };
+static inline const char *kmemb_progpath(const struct progpath *p) {
+	return p->name;
+}
+DECL_TABLE(static, progpath, const char *, struct progpath)
+DEF_TABLE(static, progpath, hash_ptr, table_ideq, kmemb_progpath)
+static struct table_progpath progpaths = {0};
+
+static const char *findprog(const char *name) {
+	bool isnew;
+	struct progpath *p = table_putget_transact_progpath(&progpaths, name,
+			&isnew);
+	if (!p) return 0;
+	if (!isnew) return p->path;
+	// NOTE: right now this makes build die rather than just creating a failing
+	// task like if you depend on ./notreal; this was an accident but it
+	// actually makes sense since there's no dependency on a system command so
+	// we don't really want to save failures. it's kind of better to instead
+	// fail the whole build since something is probably wrong with the actual
+	// dev environment... so that's what we'll continue to do.
+	const char *path = getenv("PATH");
+	if (!path) {
+		errmsg_warnx(msg_error, "couldn't find \"", name,
+				"\": no PATH variable set");
+		return 0;
+	}
+	const char *prog = path_search(path, name);
+	if (!prog) {
+		errmsg_warn(msg_error, "couldn't find \"", name, "\"");
+		return 0;
+	}
+	p->name = name; p->path = prog;
+	table_transactcommit_progpath(&progpaths);
+	return prog;
+}
+
+// on Linux, tasks all talk to one shared socket with an abstract address rather
+// than each getting a socket pair of their own. that saves a few syscalls per
+// spawn and, more importantly, means a blocked task doesn't cost a file
+// descriptor or a poll() slot. each running task gets a token to identify
+// itself with: the low half is an index into slots, and the high half is just
+// random junk, so stale or made-up tokens don't get mixed up with real ones
+#ifdef __linux__
+#define USE_SHAREDSOCK
 #endif
+static int sharedsock = -1; // -1 if each task has its own socket instead
+static struct vec_procp slots = {0};
+struct vec_uint VEC(uint);
+static struct vec_uint freeslots = {0};
+
+static bool newtoken(struct proc_info *proc) {
+	uint slot;
+	if (freeslots.sz) {
+		slot = freeslots.data[--freeslots.sz];
+		slots.data[slot] = proc;
+	}
+	else {
+		if (!vec_push(&slots, proc)) return false;
+		slot = slots.sz - 1;
+	}
+	proc->_token = (uvlong)(arc4random() | 1) << 32 | slot;
+	return true;
 }
 
-static void cb_err(int fd, short revents, void *ctxt) {
-#ifndef __NetBSD__
-	if (revents & POLLHUP) {
-		evloop_onfd_remove(fd);
-		// note: don't close() yet; that gets taken care of when the process
-		// exits and we don't wanna double-close and clobber something else
-		return;
-	} // else assume POLLIN
+static void freetoken(struct proc_info *proc) {
+	uint slot = proc->_token;
+	slots.data[slot] = 0;
+	// if this fails the slot just never gets reused, which is no big deal
+	vec_push(&freeslots, slot);
+}
+
+static struct proc_info *tokenproc(uvlong token) {
+	uint slot = token;
+	if (slot >= slots.sz) return 0;
+	struct proc_info *proc = slots.data[slot];
+	if (!proc || proc->_token != token) return 0;
+	return proc;
+}
+
+// handles everything sitting in a task's ring, if it has one. this has to be
+// done before anything from the socket, since ring requests always come first
+static bool drainring(struct proc_info *proc) {
+	if (!proc->_ring) return true;
+	while (ipcserver_recvring(proc->_ring)) {
+		ev_cb(PROC_EV_IPC, (union proc_ev_param){0}, proc);
+	}
+	if (errno == EAGAIN) return true;
+	errmsg_warnx(msg_error, "task put an invalid request in its IPC ring");
+	errno = EINVAL;
+	ev_cb(PROC_EV_ERROR, (union proc_ev_param){0}, proc);
+	return false;
+}
+
+// deals with the ring-related requests that don't need to go through ev_cb;
+// returns false if the request is something else
+static bool ringctl(struct proc_info *proc, const struct sockaddr_un *from,
+		socklen_t fromlen) {
+	switch (ipcserver_peektype()) {
+		case IPC_REQ_RINGWAKE:
+			++stats.ipcreqs[IPC_REQ_RINGWAKE];
+			return true; // draining was the whole point
+		case IPC_REQ_RING:;
+			++stats.ipcreqs[IPC_REQ_RING];
+			int fd = ipcserver_takefd();
+			// only one ring per task; if some other process in the same task
+			// already has one, the new one just gets refused
+			struct ipc_reply reply = {0};
+			if (fd != -1 && !proc->_ring) {
+				proc->_ring = ipcserver_mapring(fd);
+				reply.maxstatus = !!proc->_ring;
+			}
+			else if (fd != -1) {
+				close(fd);
+			}
+			// reply directly to the sender rather than via _replyaddr, in case
+			// some other process in the task is waiting on a reply of its own
+			bool ok = from ?
+					ipcserver_sendto(sharedsock, from, fromlen, &reply) :
+					ipcserver_send(proc->_ipcsock, &reply);
+			if (!ok) ev_cb(PROC_EV_ERROR, (union proc_ev_param){0}, proc);
+			return true;
+	}
+	return false;
+}
+
+// most datagrams handled per socket each time round the event loop
+#define IPC_BATCH 64
+
+// returns false once there's nothing (more) to read
+static bool doipc(int fd, struct proc_info *proc) {
+	if (!ipcserver_recv(fd)) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) return false;
+		// NetBSD's poll() is a stupid idiot and gives POLLIN instead of POLLHUP
+		// for sockets, so we find out about hangups here instead
+		if (errno == EPIPE) { evloop_onfd_remove(fd); return false; }
+#ifdef __DragonFly__
+		// ECONNRESET on connectionless sockets, brought to you by Matt
+		if (errno == ECONNRESET) return false;
 #endif
-	doerrio(fd, (struct proc_info *)ctxt);
+		ev_cb(PROC_EV_ERROR, (union proc_ev_param){0}, proc);
+		return false;
+	}
+	if (!drainring(proc)) return false;
+	if (ringctl(proc, 0, 0)) return true;
+	ev_cb(PROC_EV_IPC, (union proc_ev_param){0}, proc);
+	return true;
 }
 
 static void cb_ipc(int fd, short revents, void *ctxt) {
 #ifndef __NetBSD__
 	if (revents & POLLHUP) {
 		evloop_onfd_remove(fd);
+		// note: don't close() yet; that gets taken care of when the process
+		// exits and we don't wanna double-close and clobber something else
 		return;
 	} // else assume POLLIN
 #endif
-	ev_cb(PROC_EV_IPC, (union proc_ev_param){0}, (struct proc_info *)ctxt);
+	++stats.ipcwakeups;
+	// take what's queued up in one go rather than one datagram per trip round
+	// the event loop, but only up to a point, so one chatty task can't starve
+	// the others; anything left over just makes the next poll return at once
+	for (int n = 0; n < IPC_BATCH && doipc(fd, (struct proc_info *)ctxt); ++n);
+}
+
+// same deal as above, but for the shared socket
+static bool doshared(void) {
+	uvlong token;
+	struct sockaddr_un from;
+	socklen_t fromlen;
+	if (!ipcserver_recvshared(sharedsock, &token, &from, &fromlen)) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) return false;
+		if (errno == EBADMSG) {
+			errmsg_warnx(msg_warn, "ignoring a malformed IPC request");
+			return true;
+		}
+		if (errno == EPERM) {
+			// requests can come from anything a task runs, so there's no PID
+			// worth checking, but they should never come from someone else
+			errmsg_warnx(msg_warn, "ignoring an IPC request from another user");
+			return true;
+		}
+		errmsg_warn(msg_warn, "couldn't receive IPC request");
+		return false;
+	}
+	struct proc_info *proc = tokenproc(token);
+	if (!proc) {
+		// probably a leftover background process from a task that's finished.
+		// nothing to be done about it, but also no reason to give up entirely
+		errmsg_warnx(msg_warn, "ignoring an IPC request from an unknown task");
+		return true;
+	}
+	if (!drainring(proc)) return true;
+	if (ringctl(proc, &from, fromlen)) return true;
+	// replies go wherever the most recent request came from. libbuild always
+	// binds to an automatically-named address, so this will fit; if it
+	// doesn't, someone's being weird and any reply will just fail
+	ulong len = fromlen - offsetof(struct sockaddr_un, sun_path);
+	if (fromlen <= offsetof(struct sockaddr_un, sun_path) ||
+			len > sizeof(proc->_replyaddr)) {
+		len = 0;
+	}
+	memcpy(proc->_replyaddr, from.sun_path, len);
+	proc->_replyaddrlen = len;
+	ev_cb(PROC_EV_IPC, (union proc_ev_param){0}, proc);
+	return true;
+}
+
+// tasks that have exited but might still have requests in the shared socket,
+// queued up behind everyone else's. rather than reading everything up to them
+// straight away, which would mean dealing with all the other tasks' requests
+// out of turn, they're left to be finished off below. left is how many more
+// datagrams have to be read before giving up on seeing anything else from them
+struct exiting { struct proc_info *proc; int status; uint left; };
+struct vec_exiting VEC(struct exiting);
+static struct vec_exiting exiting = {0};
+
+static void finishexit(struct proc_info *proc, int status);
+
+static void cb_shared(int fd, short revents, void *ctxt) {
+	++stats.ipcwakeups;
+	// everyone's in the same queue here, so fairness is just arrival order
+	uint n = 0;
+	while (n < IPC_BATCH && doshared()) ++n;
+	bool dry = n < IPC_BATCH;
+	// going backwards, so anything that exits in the meantime gets skipped
+	for (uint i = exiting.sz; i-- > 0; ) {
+		struct exiting e = exiting.data[i];
+		if (!dry && e.left > n) { exiting.data[i].left -= n; continue; }
+		exiting.data[i] = exiting.data[--exiting.sz];
+		finishexit(e.proc, e.status);
+	}
 }
 
 static char rootdirvar[sizeof(ENV_ROOT_DIR "=") - 1 + PATH_MAX] =
@@ -116,72 +345,121 @@ static void setsockfdvar(int fd) {
 			fmt_fixed_u32(sockfdvar + sizeof(ENV_SOCKFD "=") - 1, fd)] = '\0';
 }
 
+// these two are used instead of the above with the shared socket
+static char sockaddrvar[sizeof(ENV_SOCKADDR "=") - 1 + 16] = ENV_SOCKADDR "=";
+static char tokenvar[sizeof(ENV_TOKEN "=") - 1 + 21] = ENV_TOKEN "=";
+static void settokenvar(uvlong token) {
+	tokenvar[sizeof(ENV_TOKEN "=") - 1 +
+			fmt_fixed_u64(tokenvar + sizeof(ENV_TOKEN "=") - 1, token)] = '\0';
+}
+
+// we can potentially have thousands of tasks running and/or blocked at once,
+// so the (usually fairly stingy) soft fd limit gets raised as far as allowed.
+// tasks get the original limit back, since plenty of older programs (anything
+// using select(), for a start) won't appreciate the change
+static struct rlimit origfdlimit;
+static bool raisedfdlimit = false;
+
+#ifdef USE_SHAREDSOCK
+static bool initsharedsock(void) {
+	int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) return false;
+	// empty address = autobind, giving NUL followed by 5 hex digits (no need to
+	// know what it is exactly, it just gets passed on as-is)
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	socklen_t len = sizeof(sa_family_t);
+	if (bind(fd, (struct sockaddr *)&addr, len) == -1) goto e;
+	// needed to tell who sent each request; see ipcserver_recvshared().
+	// NOTE: this has to come after bind(), as it autobinds an unbound socket
+	if (setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &(int){1}, sizeof(int)) == -1) {
+		goto e;
+	}
+	len = sizeof(addr);
+	if (getsockname(fd, (struct sockaddr *)&addr, &len) == -1) goto e;
+	ulong namelen = len - offsetof(struct sockaddr_un, sun_path) - 1;
+	if (len <= offsetof(struct sockaddr_un, sun_path) + 1 || addr.sun_path[0] ||
+			namelen >= sizeof(sockaddrvar) - sizeof(ENV_SOCKADDR "=") + 1 ||
+			memchr(addr.sun_path + 1, '\0', namelen)) {
+		goto e; // not what we were expecting, don't wanna risk it
+	}
+	if (!evloop_onfd(fd, EV_IN, &cb_shared, 0)) goto e;
+	char *p = sockaddrvar + sizeof(ENV_SOCKADDR "=") - 1;
+	memcpy(p, addr.sun_path + 1, namelen);
+	p[namelen] = '\0';
+	sharedsock = fd;
+	return true;
+
+e:	close(fd);
+	return false;
+}
+#endif
+
+static void reap(struct proc_info *proc, int status);
+
+#ifdef USE_PIDFD
+static void cb_pidfd(int fd, short revents, void *ctxt) {
+	struct proc_info *proc = ctxt;
+	int status;
+	// the pidfd only becomes readable once the process has exited, so this
+	// shouldn't ever come back empty, but no harm in making sure
+	if (waitpid(proc->_pid, &status, WNOHANG) <= 0) return;
+	evloop_onfd_remove(fd);
+	close(fd);
+	reap(proc, status);
+}
+#endif
+
 static void do_start(const char *const *argv, const char *workdir,
 		struct proc_info *proc) {
-	const char *prog;
-	if (path_isfull(argv[0])) {
-		prog = argv[0];
+	const char *prog = path_isfull(argv[0]) ? argv[0] : findprog(argv[0]);
+	if (!prog) goto e;
+	// stderr goes straight into a file provided by the task code, so there's
+	// nothing at all for us to do with it while the task runs
+	int errfd = -1;
+	ev_cb(PROC_EV_START, (union proc_ev_param){.errfd = &errfd}, proc);
+	if (errfd == -1) goto e;
+	int ipcsock[2] = {-1, -1};
+	if (sharedsock != -1) {
+		if (!newtoken(proc)) {
+			errmsg_warn(msg_error, "couldn't allocate token for task");
+			goto e1;
+		}
+		settokenvar(proc->_token);
 	}
 	else {
-		// NOTE: right now this makes build die rather than just creating a
-		// failing task like if you depend on ./notreal; this was an accident
-		// but it actually makes sense since there's no dependency on a system
-		// command so we don't really want to save failures. it's kind of
-		// better to instead fail the whole build since something is probably
-		// wrong with the actual dev environment... so that's what we'll
-		// continue to do.
-		const char *path = getenv("PATH");
-		if (!path) {
-			errmsg_warnx(msg_error, "couldn't find \"", argv[0],
-					"\": no PATH variable set");
-			goto e;
+		// we have to preserve boundaries since we do blocking, buffered IO
+		// (if boundaries aren't preserved, messages bleed into the buffer and
+		// get dropped as the buffer is cleared between reads)
+		// note: could also use SOCK_SEQPACKET, it doesn't really matter here,
+		// but DGRAM *might* be more portable, so using that one
+		if (socketpair(AF_UNIX, SOCK_DGRAM, 0, ipcsock) == -1) {
+			errmsg_warn(msg_error, "couldn't create IPC socket for task");
+			goto e1;
 		}
-		prog = path_search(path, argv[0]);
-		if (!prog) {
-			errmsg_warn(msg_error, "couldn't find \"", argv[0], "\"");
-			goto e;
+		if (!evloop_onfd(ipcsock[0], EV_IN, &cb_ipc, proc)) {
+			errmsg_warn(msg_error, "couldn't handle IPC socket events");
+			goto e2;
 		}
+		setsockfdvar(ipcsock[1]);
 	}
-	int errsock[2];
-	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, errsock) == -1) {
-		errmsg_warn(msg_error, "couldn't create stderr socket for task");
-		goto e;
-	}
-	if (!evloop_onfd(errsock[0], EV_IN, &cb_err, proc)) {
-		errmsg_warn(msg_error, "couldn't handle stderr socket events");
-		goto e1;
-	}
-	proc->_errsock = errsock[0];
-	int ipcsock[2];
-	// we have to preserve boundaries since we do blocking, buffered IO
-	// (if boundaries aren't preserved, messages bleed into the buffer and get
-	// dropped as the buffer is cleared between reads)
-	// note: could also use SOCK_SEQPACKET, it doesn't really matter here, but
-	// DGRAM *might* be more portable, so using that one
-	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, ipcsock) == -1) {
-		errmsg_warn(msg_error, "couldn't create IPC socket for task");
-		goto e2;
-	}
-	if (!evloop_onfd(ipcsock[0], EV_IN, &cb_ipc, proc)) {
-		errmsg_warn(msg_error, "couldn't handle IPC socket events");
-		goto e3;
-	}
-	proc->ipcsock = ipcsock[0];
+	proc->_ipcsock = ipcsock[0];
+	proc->_ring = 0;
 	if (!setrootdirvar(workdir)) { // ENAMETOOLONG: unlikely, but could happen!
 		errmsg_warn(msg_error, "couldn't calculate relative file path");
-		goto e4;
+		goto e3;
 	}
-	setsockfdvar(ipcsock[1]);
+	vlong spawnstart = time_nowus();
 	tui_prevfork();
 	proc->_pid = vfork();
 	if (proc->_pid == -1) {
 		errmsg_warn(msg_error, "couldn't fork new process");
-		goto e4;
+		goto e3;
 	}
 	if (!proc->_pid) {
 		setpgid(0, 0); // see proc_killall() below
-		close(ipcsock[0]);
-		dup2(errsock[1], 2);
+		if (ipcsock[0] != -1) close(ipcsock[0]);
+		dup2(errfd, 2);
+		if (raisedfdlimit) setrlimit(RLIMIT_NOFILE, &origfdlimit);
 		// unblock all signals - NOTE! this may cause handlers to run in the
 		// child, for now this is _assumed_ not to be an issue
 		sigprocmask(SIG_SETMASK, &(sigset_t){0}, 0);
@@ -200,24 +478,60 @@ ce:		if (errno == ENOENT || errno == EACCES) {
 		_exit(100);
 	}
 	tui_postvfork();
+	// vfork() only comes back once the child has exec'd (or given up)
+	uvlong spawntime = time_nowus() - spawnstart;
+	++stats.spawns;
+	stats.spawnus += spawntime;
+	if (spawntime > stats.spawnmaxus) stats.spawnmaxus = spawntime;
+#ifdef USE_PIDFD
+	if (usepidfd) {
+		proc->_pidfd = syscall(SYS_pidfd_open, proc->_pid, 0);
+		if (proc->_pidfd == -1 ||
+				!evloop_onfd(proc->_pidfd, EV_IN, &cb_pidfd, proc)) {
+			errmsg_warn(msg_error, "couldn't watch task process");
+			if (proc->_pidfd != -1) close(proc->_pidfd);
+			// it's already running; no way to keep track of it, so get rid of
+			// it right away (no pgid race here since vfork() waited for exec)
+			kill(-proc->_pid, SIGKILL);
+			waitpid(proc->_pid, &(int){0}, 0);
+			goto e3;
+		}
+	}
+	else
+#endif
+	{
+		struct proc_info **ent = table_put_pid_proc(&by_pid, proc->_pid);
+		// FIXME work out how to gracefully recover here
+		if (!ent) {
+			errmsg_die(200, msg_fatal, "couldn't store process information");
+		}
+		*ent = proc;
+	}
+	// same deal as above
+	if (!vec_push(&live, proc)) {
+		errmsg_die(200, msg_fatal, "couldn't store process information");
+	}
+	proc->_liveidx = live.sz - 1;
 	++nactive;
-	// path search allocates a new string, so free only if != what was passed
-	if (prog != argv[0]) free((char *)prog);
-	struct proc_info **ent = table_put_pid_proc(&by_pid, proc->_pid);
-	// FIXME work out how to gracefully recover here
-	if (!ent) errmsg_die(200, msg_fatal, "couldn't store process information");
-	*ent = proc;
-	close(ipcsock[1]);
-	close(errsock[1]);
+	if (ipcsock[1] != -1) close(ipcsock[1]);
+	close(errfd);
 	return;
 
-e4:	evloop_onfd_remove(ipcsock[0]);
-e3:	close(ipcsock[0]); close(ipcsock[1]);
-e2:	evloop_onfd_remove(errsock[0]);
-e1:	close(errsock[0]); close(errsock[1]);
+e3:	if (ipcsock[0] != -1) evloop_onfd_remove(ipcsock[0]);
+e2:	if (ipcsock[0] != -1) { close(ipcsock[0]); close(ipcsock[1]); }
+	else if (sharedsock != -1) freetoken(proc);
+e1:	close(errfd);
 e:	ev_cb(PROC_EV_ERROR, (union proc_ev_param){0}, proc);
 }
 
+bool proc_reply(struct proc_info *proc, const struct ipc_reply *msg) {
+	if (proc->_ipcsock != -1) return ipcserver_send(proc->_ipcsock, msg);
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	memcpy(addr.sun_path, proc->_replyaddr, proc->_replyaddrlen);
+	return ipcserver_sendto(sharedsock, &addr,
+			offsetof(struct sockaddr_un, sun_path) + proc->_replyaddrlen, msg);
+}
+
 static void do_unblock(struct proc_info *proc) {
 	++nactive;
 	ev_cb(PROC_EV_UNBLOCK, (union proc_ev_param){0}, proc);
@@ -234,20 +548,45 @@ static void qpop(void) {
 	freelist_free_q(q);
 }
 
+static void finishexit(struct proc_info *proc, int status) {
+	if (proc->_ipcsock == -1) freetoken(proc);
+	if (proc->_ring) {
+		// if the last few requests didn't need a wakeup, they're still here
+		drainring(proc);
+		ipcserver_unmapring(proc->_ring);
+		proc->_ring = 0;
+	}
+	ev_cb(PROC_EV_EXIT, (union proc_ev_param){.status = status}, proc);
+	--nactive;
+	qpop();
+}
+
+static void reap(struct proc_info *proc, int status) {
+	struct proc_info *last = live.data[--live.sz];
+	live.data[proc->_liveidx] = last;
+	last->_liveidx = proc->_liveidx;
+	// in case the exit got noticed before the task's last few requests did,
+	// handle anything that's still waiting before saying it's done
+	if (proc->_ipcsock != -1) {
+		while (doipc(proc->_ipcsock, proc));
+		close(proc->_ipcsock);
+		evloop_onfd_remove(proc->_ipcsock);
+	}
+	else if (poll(&(struct pollfd){sharedsock, POLLIN}, 1, 0) == 1) {
+		// the socket can only hold net.unix.max_dgram_qlen datagrams (10 by
+		// default) before senders have to wait, so after a whole batch, or
+		// once it's been emptied out, anything the task sent will have shown up
+		struct exiting e = {proc, status, IPC_BATCH};
+		if (vec_push(&exiting, e)) return;
+		// else, too bad, it'll just have to miss out on whatever's left
+	}
+	finishexit(proc, status);
+}
+
 static void onchld(void) {
 	pid_t pid; int status;
 	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-		struct proc_info *proc = *table_del_pid_proc(&by_pid, pid);
-		// in case we got SIGCHLD right as IO happened, flush out the stderr
-		// socket a final time before closing
-		doerrio(proc->_errsock, proc);
-		close(proc->_errsock);
-		evloop_onfd_remove(proc->_errsock);
-		close(proc->ipcsock);
-		evloop_onfd_remove(proc->ipcsock);
-		ev_cb(PROC_EV_EXIT, (union proc_ev_param){.status = status}, proc);
-		--nactive;
-		qpop();
+		reap(*table_del_pid_proc(&by_pid, pid), status);
 	}
 }
 
@@ -255,7 +594,7 @@ void proc_killall(int sig) {
 	// every task has its own group so we can kill that group;
 	// amazingly, whoever designed kill(2) decided that kill(0) should kill the
 	// caller too, otherwise this would be way easier and less annoying!
-	TABLE_FOREACH_PTR(p, pid_proc, &by_pid) kill(-(*p)->_pid, sig);
+	for (uint i = 0; i < live.sz; ++i) kill(-live.data[i]->_pid, sig);
 }
 
 static void onterm(void) {
@@ -282,17 +621,45 @@ void proc_init(proc_ev_cb cb) {
 	ev_cb = cb;
 	long envsz = 0;
 	for (char **pp = environ; *pp; ++pp) ++envsz;
-	procenv = malloc((envsz + 3) * sizeof(*environ));
+	procenv = malloc((envsz + 4) * sizeof(*environ));
 	if (!procenv) errmsg_die(100, msg_fatal, "couldn't allocate environment");
 	memcpy(procenv, environ, sizeof(*environ) * envsz);
 	procenv[envsz] = rootdirvar;
 	procenv[envsz + 1] = sockfdvar;
 	procenv[envsz + 2] = 0;
-	evloop_onsig(SIGCHLD, &onchld);
+	procenv[envsz + 3] = 0;
+#ifdef USE_SHAREDSOCK
+	// if this doesn't work out it's no big deal, every task can just have its
+	// own socket like everywhere else
+	if (initsharedsock()) {
+		procenv[envsz + 1] = sockaddrvar;
+		procenv[envsz + 2] = tokenvar;
+	}
+#endif
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) != -1 && rl.rlim_cur < rl.rlim_max) {
+		origfdlimit = rl;
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl) != -1) raisedfdlimit = true;
+	}
+#ifdef USE_PIDFD
+	// pidfd_open() showed up in 5.3; if it's not there, don't bother using it
+	int fd = syscall(SYS_pidfd_open, getpid(), 0);
+	if (fd != -1) {
+		close(fd);
+		usepidfd = true;
+	}
+#endif
+	if (!usepidfd) {
+		evloop_onsig(SIGCHLD, &onchld);
+		if (!table_init_pid_proc(&by_pid)) {
+			errmsg_die(100, msg_fatal, "couldn't allocate process table");
+		}
+	}
 	evloop_onsig(SIGTERM, &onterm);
 	evloop_onsig(SIGINT, &onint);
-	if (!table_init_pid_proc(&by_pid)) {
-		errmsg_die(100, msg_fatal, "couldn't allocate process table");
+	if (!table_init_progpath(&progpaths)) {
+		errmsg_die(100, msg_fatal, "couldn't allocate command path table");
 	}
 }
 
@@ -310,7 +677,7 @@ void proc_start(struct proc_info *proc, const char *const *argv,
 		q->procaddr = (ulong)proc;
 		q->argv = argv; q->workdir = workdir;
 		q->next = 0; *q_tail = q; q_tail = &q->next;
-		++qlen;
+		if (++qlen > stats.maxqlen) stats.maxqlen = qlen;
 	}
 }
 
@@ -333,7 +700,7 @@ void proc_unblock(struct proc_info *proc) {
 		}
 		q->procaddr = (ulong)proc + 1;
 		q->next = 0; *q_tail = q; q_tail = &q->next;
-		++qlen;
+		if (++qlen > stats.maxqlen) stats.maxqlen = qlen;
 	}
 }
 
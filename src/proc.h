@@ -6,26 +6,34 @@
 
 #include <intdefs.h>
 
+#include "ipc.h"
+
 /* embeds into another struct (eg struct task) */
 struct proc_info {
 	pid_t _pid; // top-level pid; may have descendants
-	int _errsock, ipcsock; // our end of each socket (ipcsock is "public")
+	int _ipcsock; // our end of the task's own socket, if not using a shared one
+	int _pidfd; // only on Linux, where it's used instead of SIGCHLD
+	uint _liveidx; // position in the list of running processes
+	uvlong _token; // identifies the task if using a shared socket
+	uchar _replyaddrlen; char _replyaddr[7]; // also only for the shared socket
+	struct ipc_ring *_ring; // if the task asked for one (see ipc.h)
 };
 
 enum {
-	PROC_EV_STDERR,
+	PROC_EV_START,
 	PROC_EV_EXIT,
 	PROC_EV_UNBLOCK,
 	PROC_EV_IPC,
 	PROC_EV_ERROR
 };
 union proc_ev_param {
-	struct { /* PROC_EV_STDERR */
-		const char *buf;
-		uint sz;
-	};
+	// if PROC_EV_START, the handler should set this to a file descriptor to
+	// use as the process's stderr (which then gets closed once the process is
+	// started), or leave it as -1 to indicate an error
+	int *errfd;
 	int status; /* if PROC_EV_EXIT */
-	// if PROC_EV_UNBLOCK or PROC_EV_IPC, nothing
+	// if PROC_EV_UNBLOCK, nothing
+	// if PROC_EV_IPC, nothing; call ipcserver_decode() to get the request
 	// if PROC_EV_ERROR, nothing (errno will be set though)
 };
 typedef void (*proc_ev_cb)(int evtype, union proc_ev_param P,
@@ -51,6 +59,12 @@ void proc_block(void);
  */
 void proc_unblock(struct proc_info *proc);
 
+/*
+ * Sends a reply to whatever most recently made an IPC request on behalf of the
+ * given process.
+ */
+bool proc_reply(struct proc_info *proc, const struct ipc_reply *msg);
+
 /*
  * Kills all the task process groups that were created; call when build is about
  * to give up/crash.
@@ -0,0 +1,197 @@
+/* This file is dedicated to the public domain. */
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <errmsg.h>
+#include <fmt.h>
+#include <intdefs.h>
+#include <iobuf.h>
+
+#include "stats.h"
+#include "time.h"
+
+struct stats stats = {0};
+bool stats_print = false;
+const char *stats_file = 0;
+
+enum { COUNTER, GAUGE };
+enum { COUNT, BYTES, MICROS };
+
+// everything gets described once here and then printed in whichever format(s)
+struct metric {
+	const char *name; // for OpenMetrics (counters get _total on the end)
+	const char *desc; // for humans, and the HELP line
+	const char *label; // if non-null, a value for the "type" label
+	uchar type, unit;
+	// char padding[6];
+	uvlong val;
+};
+
+static const char *const ipcnames[IPC_REQ_RINGWAKE + 1] = {
+	[IPC_REQ_DEP] = "dep",
+	[IPC_REQ_WAIT] = "wait",
+	[IPC_REQ_INFILE] = "infile",
+	[IPC_REQ_TASKTITLE] = "tasktitle",
+	[IPC_REQ_DEPS] = "deps",
+	[IPC_REQ_WAITSOME] = "waitsome",
+	[IPC_REQ_WORKNEXT] = "worknext",
+	[IPC_REQ_WORKDONE] = "workdone",
+	[IPC_REQ_INFILES] = "infiles",
+	[IPC_REQ_RING] = "ring",
+	[IPC_REQ_RINGWAKE] = "ringwake"
+};
+
+#define NMETRICS (15 + sizeof(ipcnames) / sizeof(*ipcnames))
+
+static uint collect(struct metric *m) {
+	uint n = 0;
+	m[n++] = (struct metric){"build_run_seconds", "total run time", 0, GAUGE,
+			MICROS, time_nowus() - stats.startus};
+	m[n++] = (struct metric){"build_infile_stat_calls", "infile stat() calls",
+			0, COUNTER, COUNT, stats.infilestats};
+	m[n++] = (struct metric){"build_strpool_lookups", "string pool lookups",
+			"hit", COUNTER, COUNT, stats.strhits};
+	m[n++] = (struct metric){"build_strpool_lookups", "string pool lookups",
+			"miss", COUNTER, COUNT, stats.strmisses};
+	m[n++] = (struct metric){"build_strpool_rehashes", "string pool rehashes",
+			0, COUNTER, COUNT, stats.strrehashes};
+	m[n++] = (struct metric){"build_strpool_memory_bytes",
+			"string pool memory", 0, GAUGE, BYTES, stats.strmem};
+	m[n++] = (struct metric){"build_permalloc_memory_bytes",
+			"infile/task record memory", 0, GAUGE, BYTES, stats.permem};
+	for (uint i = 0; i < sizeof(ipcnames) / sizeof(*ipcnames); ++i) {
+		m[n++] = (struct metric){"build_ipc_requests", "IPC requests",
+				ipcnames[i], COUNTER, COUNT, stats.ipcreqs[i]};
+	}
+	m[n++] = (struct metric){"build_ipc_wakeups", "IPC socket wakeups", 0,
+			COUNTER, COUNT, stats.ipcwakeups};
+	m[n++] = (struct metric){"build_task_error_output_bytes",
+			"task error output", 0, COUNTER, BYTES, stats.errbytes};
+	m[n++] = (struct metric){"build_spawns", "processes started", 0,
+			COUNTER, COUNT, stats.spawns};
+	m[n++] = (struct metric){"build_spawn_seconds", "fork/exec time", 0,
+			COUNTER, MICROS, stats.spawnus};
+	m[n++] = (struct metric){"build_spawn_max_seconds", "slowest fork/exec",
+			0, GAUGE, MICROS, stats.spawnmaxus};
+	m[n++] = (struct metric){"build_db_init_seconds", "db_init() time", 0,
+			GAUGE, MICROS, stats.dbinitus};
+	m[n++] = (struct metric){"build_db_finalise_seconds",
+			"db_finalise() time", 0, GAUGE, MICROS, stats.dbfinaliseus};
+	m[n++] = (struct metric){"build_queue_length_max",
+			"peak tasks queued for a slot", 0, GAUGE, COUNT, stats.maxqlen};
+	return n;
+}
+
+static bool putnum(struct obuf *b, uvlong val) {
+	char buf[21];
+	return obuf_putbytes(b, buf, fmt_fixed_u64(buf, val));
+}
+
+// puts val / scale as a decimal, with the fractional part zero-padded to fit
+// ndigits (scale being 10 to the power of ndigits)
+static bool putfixed(struct obuf *b, uvlong val, uvlong scale, int ndigits) {
+	char buf[21];
+	if (!putnum(b, val / scale) || !obuf_putc(b, '.')) return false;
+	int n = fmt_fixed_u64(buf, val % scale);
+	for (; ndigits > n; --ndigits) if (!obuf_putc(b, '0')) return false;
+	return obuf_putbytes(b, buf, n);
+}
+
+static void printstats(const struct metric *m, uint n) {
+	static const char *const units[] = {"", " bytes", " ms"};
+	obuf_put0t(buf_err, "build stats:\n");
+	for (uint i = 0; i < n; ++i) {
+		obuf_put0t(buf_err, "  ");
+		obuf_put0t(buf_err, m[i].desc);
+		uint len = strlen(m[i].desc);
+		if (m[i].label) {
+			obuf_put0t(buf_err, " (");
+			obuf_put0t(buf_err, m[i].label);
+			obuf_putc(buf_err, ')');
+			len += strlen(m[i].label) + 3;
+		}
+		// line the values up in a column
+		for (; len < 40; ++len) obuf_putc(buf_err, ' ');
+		obuf_putc(buf_err, ' ');
+		if (m[i].unit == MICROS) putfixed(buf_err, m[i].val, 1000, 3);
+		else putnum(buf_err, m[i].val);
+		obuf_put0t(buf_err, units[m[i].unit]);
+		obuf_putc(buf_err, '\n');
+	}
+	obuf_flush(buf_err);
+	obuf_reset(buf_err);
+}
+
+// written to a temporary file and renamed over, so that anything scraping the
+// file (e.g. node_exporter's textfile collector) never sees half of it
+static bool writestats(const struct metric *m, uint n) {
+	uint len = strlen(stats_file);
+	char *tmp = malloc(len + 5);
+	if (!tmp) return false;
+	memcpy(tmp, stats_file, len);
+	memcpy(tmp + len, ".tmp", 5);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) { free(tmp); return false; }
+	struct obuf *b = OBUF(fd, 4096);
+	for (uint i = 0; i < n; ++i) {
+		if (!i || strcmp(m[i].name, m[i - 1].name)) {
+			if (!obuf_put0t(b, "# TYPE ") || !obuf_put0t(b, m[i].name) ||
+					!obuf_put0t(b, m[i].type == COUNTER ?
+						" counter\n" : " gauge\n")) {
+				goto e;
+			}
+			if (m[i].unit != COUNT && (!obuf_put0t(b, "# UNIT ") ||
+					!obuf_put0t(b, m[i].name) ||
+					!obuf_put0t(b, m[i].unit == BYTES ?
+						" bytes\n" : " seconds\n"))) {
+				goto e;
+			}
+			if (!obuf_put0t(b, "# HELP ") || !obuf_put0t(b, m[i].name) ||
+					!obuf_putc(b, ' ') || !obuf_put0t(b, m[i].desc) ||
+					!obuf_putc(b, '\n')) {
+				goto e;
+			}
+		}
+		if (!obuf_put0t(b, m[i].name)) goto e;
+		if (m[i].type == COUNTER && !obuf_put0t(b, "_total")) goto e;
+		if (m[i].label && (!obuf_put0t(b, "{type=\"") ||
+				!obuf_put0t(b, m[i].label) || !obuf_put0t(b, "\"}"))) {
+			goto e;
+		}
+		if (!obuf_putc(b, ' ')) goto e;
+		if (m[i].unit == MICROS) {
+			if (!putfixed(b, m[i].val, 1000000, 6)) goto e;
+		}
+		else {
+			if (!putnum(b, m[i].val)) goto e;
+		}
+		if (!obuf_putc(b, '\n')) goto e;
+	}
+	if (!obuf_put0t(b, "# EOF\n") || !obuf_flush(b)) goto e;
+	if (close(fd) == -1) { fd = -1; goto e; }
+	if (rename(tmp, stats_file) == -1) { fd = -1; goto e; }
+	free(tmp);
+	return true;
+
+e:	if (fd != -1) close(fd);
+	unlink(tmp);
+	free(tmp);
+	return false;
+}
+
+void stats_report(void) {
+	if (!stats_print && !stats_file) return;
+	struct metric m[NMETRICS];
+	uint n = collect(m);
+	if (stats_print) printstats(m, n);
+	if (stats_file && !writestats(m, n)) {
+		errmsg_warn(msg_warn, "couldn't write stats to ", stats_file);
+	}
+}
+
+// vi: sw=4 ts=4 noet tw=80 cc=80
@@ -0,0 +1,47 @@
+/* This file is dedicated to the public domain. */
+
+#ifndef INC_STATS_H
+#define INC_STATS_H
+
+#include <stdbool.h>
+
+#include <intdefs.h>
+
+#include "ipcserver.h"
+
+/*
+ * Counters for where build itself spends its time. these are always kept (it's
+ * just a few increments here and there), and only reported if asked for with
+ * -s or -S. times are in microseconds
+ */
+struct stats {
+	vlong startus; // when build started; the total gets reported as well
+	uvlong infilestats; // stat() calls made checking infiles
+	uvlong strhits, strmisses; // db_intern() finding a string vs. adding it
+	uvlong strrehashes; // times the string pool table had to grow
+	uvlong strmem; // rough bytes held by the string pool, all told
+	uvlong permem; // bytes of infile and task records from permalloc (db.c)
+	uvlong ipcreqs[IPC_REQ_RINGWAKE + 1]; // requests received, by type
+	uvlong ipcwakeups; // times an IPC socket was found ready to read
+	uvlong errbytes; // error output kept from tasks that ran
+	uvlong spawns; // processes started (see do_start() in proc.c)
+	uvlong spawnus, spawnmaxus; // from vfork() to the child having exec'd
+	uvlong dbinitus, dbfinaliseus;
+	uint maxqlen; // most tasks waiting for a job slot at once
+};
+
+extern struct stats stats;
+
+/* set from options in build.c: print a summary, and/or write a metrics file */
+extern bool stats_print;
+extern const char *stats_file;
+
+/*
+ * prints and/or writes out the stats, if either was asked for; called at exit
+ * (failing to write the file just gives a warning)
+ */
+void stats_report(void);
+
+#endif
+
+// vi: sw=4 ts=4 noet tw=80 cc=80
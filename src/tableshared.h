@@ -19,20 +19,20 @@
 
 #include <stdbool.h>
 
-#include <basichashes.h>
 #include <intdefs.h>
 
 #include "defs.h"
+#include "hash.h"
 
 /* a couple of hashtable-related functions used in more than one place */
 
 static inline uint hash_task_desc(struct task_desc d) {
-	uint h = HASH_ITER_INIT;
+	uvlong h = hash_seed;
 	for (const char *const *argv = d.argv; *argv; ++argv) {
 		// only hash the pointers, not the strings themselves (they're interned)
-		h = hash_iter_bytes(h, (const char *)argv, sizeof(*argv));
+		h = hash_mix(h ^ (ulong)*argv, HASH_K);
 	}
-	return hash_iter_bytes(h, (const char *)&d.workdir, sizeof(d.workdir));
+	return hash_fold(h ^ (ulong)d.workdir);
 }
 
 static inline bool eq_task_desc(struct task_desc d1, struct task_desc d2) {
@@ -30,6 +30,7 @@
 #include <errmsg.h>
 #include <fmt.h>
 #include <intdefs.h>
+#include <iobuf.h>
 #include <noreturn.h>
 #include <path.h>
 #include <str.h>
@@ -37,16 +38,24 @@
 #include <vec.h>
 
 #include "build.h"
+#include "builtin.h"
 #include "db.h"
 #include "defs.h"
+#include "desc.h"
+#include "events.h"
+#include "evloop.h"
 #include "fd.h"
 #include "fmt.h"
 #include "fpath.h"
 #include "infile.h"
 #include "ipcserver.h"
+#include "luatask.h"
 #include "proc.h"
 #include "sigstr.h"
+#include "stats.h"
 #include "tableshared.h"
+#include "time.h"
+#include "trace.h"
 #include "tui.h"
 
 DECL_TABLE(static, infile, const char *, const char *)
@@ -59,30 +68,88 @@ struct vec_int VEC(int);
 struct task;
 struct vec_taskp VEC(struct task *);
 struct vec_task_desc VEC(struct task_desc);
-struct vec_str VEC(const char *);
+struct waiter { struct task *t; int tag; };
+struct vec_waiter VEC(struct waiter);
+struct vec_depresult VEC(struct ipc_depresult);
+
+// how many deps and infiles fit in struct task before anything's allocated.
+// most tasks have few if any deps, and plenty only read a handful of files
+#define DEPS_INLINE 2
+#define INFILES_INLINE 4
 
 struct task {
 	struct proc_info base; // must be first member; pointer is casted
 						   // (if moved, would need something like container_of)
 	uint cyclecheck;
 	uchar maxdepstatus; // highest exit code from exited deps
+	uchar builtinstatus; // for built-ins, kept until they're "reaped"
+	uchar kind; // TASK_PROC, etc. (see below)
 	uint id; // id for creating/opening a unique error output filename
-	// char padding[3];
+	// char padding[1];
 	char *title; // user-provided friendly description for tui/logs
+	struct trace_task trace; // for -T
 	struct task_desc desc;
 	struct db_taskresult *outresult; // write to here when done
-	// on-disk file to store error output (note: fd is positive; top bit unused)
-	// (further note: if !haderr, file doesn't exist yet (to avoid EMFILE)
-	bool haderr : 1; uint fd_err : 31;
 	uint nblockers; // how many tasks we're waiting for before we can unblock
 					// (0 if not currently blocked)
 	struct vec_task_desc newdeps; // deps that will block this on next wait
 	struct vec_taskp blockees; // tasks that are blocked waiting for this task
-	struct table_taskdesc deps; // recorded deps from this run
-	struct table_infile infiles; // recorded infiles from this run
+	// per-dep results: every requested dep gets a result, either right away if
+	// it's already done, or by adding a waiter to it if it's still going. the
+	// results are handed out by IPC_REQ_WAITSOME, or thrown away by a full wait
+	struct vec_waiter waiters; // tasks that want our result, and their tags
+	struct vec_depresult results; // finished deps not yet handed out
+	uint npending; // deps we're still waiting on results from
+	// if blocked in IPC_REQ_WAITSOME, how many results to send back; this gets
+	// negated once we're already due to be unblocked, and 0 means not waiting
+	int waitsome;
+	bool closed; // done, but freeing is on hold until npending gets to 0
+	bool started; // has been running at some point (for events_started())
+	// char padding[2];
+	// recorded deps and infiles from this run. the first few go in the task
+	// itself, which covers most tasks without allocating anything; past that,
+	// they're moved to plain arrays that start out at the size they ended up
+	// at last time (max* hold that size until then), which can then be handed
+	// straight over to the db once the task is done. see handover() for that
+	// and adddep()/addinfile() for how duplicates get weeded out
+	struct task_desc *deps; // points at depsbuf until that's outgrown
+	const char **infiles; // same, with infilesbuf
+	uint ndeps, ninfiles;
+	uint depsmax, infilesmax;
+	struct task_desc depsbuf[DEPS_INLINE];
+	const char *infilesbuf[INFILES_INLINE];
+	struct taskidx *idx; // only allocated if the lists get long (usually not)
+	// how long it's spent actually running, as opposed to queued or blocked
+	// (see setphase()); this gets saved as the task's duration when it's done
+	vlong runsince; // when it last started running, or 0 if it isn't now
+	uint runms; // time from before that
+	uint startidx; // where it is in startorder (see task_estimate())
+	uint estms; // for task_estimate() to use
+	// char padding[4];
+	struct luatask *lua; // for Lua tasks, once they've started
+	struct task *worker; // for @worker tasks, the worker doing it (if any)
+	struct task *serving; // for workers, the task being done (if any)
 };
 DEF_FREELIST(task, struct task, 512)
 
+enum {
+	TASK_PROC, // the usual: a process, which proc.c deals with
+	TASK_BUILTIN, // done by builtin.c instead
+	TASK_LUA, // run as a coroutine by luatask.c
+	TASK_WORK, // handed to a worker (see below)
+	TASK_WORKER // not really a task; a persistent process doing TASK_WORKs
+};
+
+// a short list is faster to search through than a hashtable, and avoids
+// allocating two more arrays per table for every single task; beyond this size
+// though, the tables start to pay for themselves
+#define LINEAR_MAX 16
+
+struct taskidx {
+	struct table_taskdesc deps; // each only initialised if its list gets long
+	struct table_infile infiles;
+};
+
 static inline struct task_desc kmemb_activetask(struct task *const *t) {
 	return (*t)->desc;
 }
@@ -93,78 +160,235 @@ static struct table_activetask activetasks;
 struct task *goal; // HACK :(
 static int goalstatus;
 static int nstarted = 0;
+// the tasks still on the go, in the order they started, for task_estimate();
+// the ones that finish are left as nulls until that tidies up after them
+static struct vec_taskp startorder = {0};
+static uvlong donems = 0; // durations from last time of the ones that finished
 static int cyclecheckid = 0;
 
+// why a task needs to rerun, for -n and the "why" file (see explain()). only
+// the first reason found is kept, as that's plenty to go digging from
+enum {
+	WHY_NONE, // doesn't need to (or not yet known to)
+	WHY_NEW, // never run before
+	WHY_CLEAN, // -B
+	WHY_CYCLE, // recorded deps go round in a circle
+	WHY_DEPRAN, // a dep is being (or with -n, would be) rerun by this build
+	WHY_DEPNEWER, // a dep was rerun by some earlier build
+	WHY_INFILE, // an infile changed
+	WHY_INFILEERR // an infile couldn't be looked at
+};
+struct why {
+	uchar kind;
+	// char padding[3];
+	uint changes; // for WHY_INFILE, INFILE_* bits (0 if not seen this time)
+	struct task_desc dep; // for WHY_DEP*
+	const char *infile; // for WHY_INFILE*
+};
+
+static inline void because(struct why *w, struct why reason) {
+	if (!w->kind) *w = reason;
+}
+
+// the up-to-date check: a task from a previous run can only be reused once all
+// its deps have been checked (depth first, starting any that need to rerun)
+// and then its infiles. rather than recursing, which can run out of stack on a
+// deep enough graph, tasks partway through being checked are kept on an
+// explicit stack (see runcheck()). that way, the goal's check can also be
+// done a slice at a time from a timer, so tasks started near the beginning get
+// their requests and error output seen to without waiting for the rest of the
+// graph
+struct checkframe {
+	struct task_desc desc;
+	struct db_taskresult *r;
+	uint next; // next dep to look at; past ndeps, next infile + ndeps
+	struct why why; // kind is WHY_NONE unless this needs to rerun
+	bool isgoal;
+	// char padding[7];
+};
+struct vec_checkframe VEC(struct checkframe);
+static struct vec_checkframe checkstack = {0};
+
+// where each task on the stack is, so a task can ask for one of those directly
+struct checkidx { struct db_taskresult *r; uint idx; };
+static inline struct db_taskresult *kmemb_checkidx(const struct checkidx *c) {
+	return c->r;
+}
+DECL_TABLE(static, checking, struct db_taskresult *, struct checkidx)
+DEF_TABLE(static, checking, hash_ptr, table_ideq, kmemb_checkidx)
+static struct table_checking checking;
+
 // XXX this function only does part of the work - should just get inlined
-static struct task *opentask(struct task_desc d, uint id) {
+static struct task *opentask(struct task_desc d,
+		const struct db_taskresult *r) {
 	struct task *t = freelist_alloc_task();
 	if (t) {
 		t->desc = d;
-		t->haderr = false;
 		t->nblockers = 0;
 		t->blockees = (struct vec_taskp){0};
+		t->waiters = (struct vec_waiter){0};
+		t->results = (struct vec_depresult){0};
+		t->newdeps = (struct vec_task_desc){0};
+		t->npending = 0;
+		t->waitsome = 0;
+		t->closed = false;
+		t->started = false;
 		t->cyclecheck = 0;
 		t->title = 0;
-		t->id = id;
-		if (!table_init_taskdesc(&t->deps)) goto e;
-		if (!table_init_infile(&t->infiles)) goto e1;
+		t->trace.phase = 0;
+		t->id = r->id;
+		t->deps = t->depsbuf; t->ndeps = 0; t->depsmax = r->ndeps;
+		t->infiles = t->infilesbuf; t->ninfiles = 0;
+		t->infilesmax = r->ninfiles;
+		t->idx = 0;
+		t->runsince = 0;
+		t->runms = 0;
+		t->lua = 0;
+		t->worker = 0;
+		t->kind = !strcmp(d.argv[0], "@lua") ? TASK_LUA :
+				!strcmp(d.argv[0], "@worker") ? TASK_WORK :
+				builtin_is(d.argv[0]) ? TASK_BUILTIN : TASK_PROC;
 	}
 	return t;
-
-e1: free(t->deps.data); free(t->deps.flags);
-e:	freelist_free_task(t);
-	return 0;
 }
 
 static void closetask(struct task *t) {
-	if (t->haderr) close(t->fd_err);
 	// don't free here, title gets assigned to tui_lastdone before closetask is
 	// called; after that, tui_lastdone gets freed before next title is set
 	// free(t->title);
 	free(t->blockees.data);
-	free(t->deps.data); free(t->deps.flags);
-	free(t->infiles.data); free(t->infiles.flags);
-	freelist_free_task(t);
-}
-
-// this function *should* be safe, although it's only actually used for printing
-// user-friendly messages right now, not for actually doing anything shell-based
-static inline bool shellesc(struct str *s, const char *p) {
-	// if there's shell-looking characters, wrap in single quotes, escaping
-	// single quotes specially, otherwise try to keep it simple
-	if (strpbrk(p, " \t\n\"'`<>&#~*$|(){};?!\\")) {
-		if (!str_appendc(s, '\'')) return false;
-		for (; *p; ++p) {
-			if (*p == '\'') {
-				if (!str_appendbytes(s, "'\\''", 4)) return false;
-			}
-			else {
-				if (!str_appendc(s, *p)) return false;
+	free(t->waiters.data);
+	free(t->results.data);
+	free(t->newdeps.data);
+	if (t->deps != t->depsbuf) free(t->deps);
+	if (t->infiles != t->infilesbuf) free(t->infiles);
+	if (t->idx) {
+		free(t->idx->deps.data); free(t->idx->deps.flags);
+		free(t->idx->infiles.data); free(t->idx->infiles.flags);
+		free(t->idx);
+	}
+	// if a task doesn't wait for all its deps (which it shouldn't do, but
+	// still), they'll be pointing back at it until they finish
+	if (t->npending) t->closed = true; else freelist_free_task(t);
+}
+
+static bool ensureidx(struct task *t) {
+	if (t->idx) return true;
+	t->idx = calloc(1, sizeof(*t->idx));
+	return !!t->idx;
+}
+
+// grows one of the lists if it's full. buf is the inline storage it starts off
+// in, which fits nbuf; while it's still there, max is the size to move it to
+// the heap at, if that's bigger than it would be otherwise
+static bool growlist(void **data, void *buf, uint nbuf, uint n, uint *max,
+		uint elsz) {
+	bool inl = *data == buf;
+	if (n < (inl ? nbuf : *max)) return true;
+	uint newmax = n * 2;
+	if (inl && *max > newmax) newmax = *max;
+	void *new = realloc(inl ? 0 : *data, newmax * elsz);
+	if (!new) return false;
+	if (inl) memcpy(new, buf, n * elsz);
+	*data = new; *max = newmax;
+	return true;
+}
+
+// gives one of the lists to the db, in place of old (with oldn entries) from
+// last time. the db needs it on the heap, so if it's still inline, it's copied
+// into old if it fits, otherwise old is resized for it. returns null on
+// failure, or if the list is empty (in which case, old is freed)
+static void *handover(void *data, const void *buf, uint n, void *old,
+		uint oldn, uint elsz) {
+	if (data != buf) { free(old); return data; }
+	if (!n) { free(old); return 0; }
+	if (oldn < n) {
+		void *new = realloc(old, n * elsz);
+		if (!new) return 0;
+		old = new;
+	}
+	memcpy(old, buf, n * elsz);
+	return old;
+}
+
+// records d as a dep of t, setting isnew if it wasn't already
+static bool adddep(struct task *t, struct task_desc d, bool *isnew) {
+	if (t->ndeps < LINEAR_MAX) {
+		for (uint i = 0; i < t->ndeps; ++i) {
+			if (eq_task_desc(t->deps[i], d)) { *isnew = false; return true; }
+		}
+	}
+	else {
+		if (!ensureidx(t)) return false;
+		if (!t->idx->deps.data) {
+			if (!table_init_taskdesc(&t->idx->deps)) return false;
+			for (uint i = 0; i < t->ndeps; ++i) {
+				struct task_desc *p = table_put_taskdesc(&t->idx->deps,
+						t->deps[i]);
+				if (!p) return false;
+				*p = t->deps[i];
 			}
 		}
-		return str_appendc(s, '\'');
+		struct task_desc *p = table_putget_transact_taskdesc(&t->idx->deps, d,
+				isnew);
+		if (!p) return false;
+		if (!*isnew) return true;
+		*p = d;
+		if (!growlist((void **)&t->deps, t->depsbuf, DEPS_INLINE, t->ndeps,
+				&t->depsmax, sizeof(*t->deps))) {
+			return false;
+		}
+		table_transactcommit_taskdesc(&t->idx->deps);
+		t->deps[t->ndeps++] = d;
+		return true;
+	}
+	if (!growlist((void **)&t->deps, t->depsbuf, DEPS_INLINE, t->ndeps,
+			&t->depsmax, sizeof(*t->deps))) {
+		return false;
 	}
-	// if there's no special chars just use the string itself directly
-	return str_append0t(s, p);
+	t->deps[t->ndeps++] = d;
+	*isnew = true;
+	return true;
 }
 
-static char *desctostr(const struct task_desc *t) {
-	int e = errno;
-	struct str s = {0};
-	if (!str_clear(&s)) return 0;
-	if (!shellesc(&s, *t->argv)) goto e;
-	for (const char *const *argv = t->argv + 1; *argv; ++argv) {
-		if (!str_appendc(&s, ' ')) goto e;
-		if (!shellesc(&s, *argv)) goto e;
+// same as above, for infiles (which are interned, so pointers just compare)
+static bool addinfile(struct task *t, const char *infile, bool *isnew) {
+	if (t->ninfiles < LINEAR_MAX) {
+		for (uint i = 0; i < t->ninfiles; ++i) {
+			if (t->infiles[i] == infile) { *isnew = false; return true; }
+		}
 	}
-	if (t->workdir[0] != '.' || t->workdir[1]) { // not in base dir
-		if (!str_append0t(&s, "` in `")) goto e;
-		if (!str_append0t(&s, t->workdir)) goto e;
+	else {
+		if (!ensureidx(t)) return false;
+		if (!t->idx->infiles.data) {
+			if (!table_init_infile(&t->idx->infiles)) return false;
+			for (uint i = 0; i < t->ninfiles; ++i) {
+				const char **pp = table_put_infile(&t->idx->infiles,
+						t->infiles[i]);
+				if (!pp) return false;
+				*pp = t->infiles[i];
+			}
+		}
+		const char **pp = table_putget_transact_infile(&t->idx->infiles,
+				infile, isnew);
+		if (!pp) return false;
+		if (!*isnew) return true;
+		*pp = infile;
+		if (!growlist((void **)&t->infiles, t->infilesbuf, INFILES_INLINE,
+				t->ninfiles, &t->infilesmax, sizeof(*t->infiles))) {
+			return false;
+		}
+		table_transactcommit_infile(&t->idx->infiles);
+		t->infiles[t->ninfiles++] = infile;
+		return true;
 	}
-	return s.data;
-e:	free(s.data);
-	errno = e;
-	return 0;
+	if (!growlist((void **)&t->infiles, t->infilesbuf, INFILES_INLINE,
+			t->ninfiles, &t->infilesmax, sizeof(*t->infiles))) {
+		return false;
+	}
+	t->infiles[t->ninfiles++] = infile;
+	*isnew = true;
+	return true;
 }
 
 static void showerr(const char *taskcmd, int fd_err) {
@@ -176,53 +400,247 @@ static void showerr(const char *taskcmd, int fd_err) {
 	fd_transferall(fd_err, 2);
 }
 
+// reasons go to .builddb/why for real builds, or stdout for -n (see task_init)
+static struct obuf *whybuf = OBUF(-1, 4096);
+
+static void explain(struct task_desc desc, const struct why *why) {
+	static const char *const changenames[] = {
+		"size", "inode", "mode", "owner"
+	};
+	if (whybuf->fd == -1) return;
+	char *s = desctostr(&desc), *d = 0;
+	if (!s) return;
+	obuf_putc(whybuf, '`');
+	obuf_put0t(whybuf, s);
+	obuf_put0t(whybuf, "`: ");
+	switch (why->kind) {
+		case WHY_NEW: obuf_put0t(whybuf, "never run before"); break;
+		case WHY_CLEAN: obuf_put0t(whybuf, "clean build (-B)"); break;
+		case WHY_CYCLE:
+			obuf_put0t(whybuf, "recorded deps go round in a circle");
+			break;
+		case WHY_DEPRAN: case WHY_DEPNEWER:
+			d = desctostr(&why->dep);
+			if (!d) break;
+			obuf_put0t(whybuf, "dep `");
+			obuf_put0t(whybuf, d);
+			obuf_put0t(whybuf, why->kind == WHY_DEPNEWER ?
+					"` was rerun by an earlier build" :
+					dryrun ? "` would run" : "` ran in this build");
+			break;
+		case WHY_INFILE:
+			obuf_put0t(whybuf, "infile ");
+			obuf_put0t(whybuf, why->infile);
+			if (why->changes & INFILE_CREATED) {
+				obuf_put0t(whybuf, " was created");
+			}
+			else if (why->changes & INFILE_GONE) {
+				obuf_put0t(whybuf, " was deleted");
+			}
+			else if (why->changes) {
+				const char *sep = " changed (";
+				for (int i = 0; i < 4; ++i) if (why->changes & 1 << i) {
+					obuf_put0t(whybuf, sep);
+					obuf_put0t(whybuf, changenames[i]);
+					sep = ", ";
+				}
+				obuf_putc(whybuf, ')');
+			}
+			else {
+				obuf_put0t(whybuf, " changed before an earlier build");
+			}
+			break;
+		case WHY_INFILEERR:
+			obuf_put0t(whybuf, "couldn't check infile ");
+			obuf_put0t(whybuf, why->infile);
+	}
+	obuf_putc(whybuf, '\n');
+	free(d);
+	free(s);
+}
+
+static void stopworkers(void);
 static noreturn exit_clean(int status) {
-	db_finalise(); // XXX eh... should global cleanup happen somewhere else?
+	stopworkers();
+	obuf_flush(whybuf);
+	trace_finish();
+	events_finish(status);
+	// XXX eh... should global cleanup happen somewhere else?
+	if (!dryrun) { // dry runs mustn't make the next run miss stuff
+		vlong start = time_nowus();
+		db_finalise();
+		stats.dbfinaliseus = time_nowus() - start;
+	}
+	stats_report();
 	exit(status);
 }
 
 static noreturn exit_failure(int status) {
 	// ???
+	obuf_flush(whybuf);
+	trace_finish();
+	events_finish(status);
+	stats_report();
 	errmsg_warnx("killing tasks and giving up");
 	proc_killall(SIGTERM);
 	exit(status);
 }
 
+// error output goes straight from the task into a file named by its ID; this
+// opens that file (returning -1 if there isn't one or it's empty)
+static int openerr(char prefix, uint id) {
+	char buf[12];
+	buf[0] = prefix;
+	buf[1 + fmt_fixed_u32(buf + 1, id)] = '\0';
+	int fd = openat(db_dirfd, buf, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return -1;
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !st.st_size) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// creates the file for the task to write its error output to
+static int createerr(struct task *t) {
+	char buf[12];
+	buf[0] = 'e';
+	buf[1 + fmt_fixed_u32(buf + 1, t->id)] = '\0';
+	int fd = openat(db_dirfd, buf, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND |
+			O_CLOEXEC, 0644);
+	if (fd == -1) errmsg_warn(msg_error, "couldn't open "BUILDDB_DIR"/", buf);
+	return fd;
+}
+
 static noreturn handle_failure(struct task *t, int status) {
-	if (t->haderr) {
+	trace_end(&t->trace, &t->desc, t->title, status);
+	int fd = openerr('e', t->id);
+	if (events_on) {
+		struct stat s;
+		uvlong errbytes = fd != -1 && fstat(fd, &s) != -1 ? s.st_size : 0;
+		if (t->runsince) t->runms += time_now() - t->runsince;
+		events_finished(t->id, status, t->title, t->runms, errbytes);
+	}
+	if (fd != -1) {
 		obuf_put0t(buf_err, "* task's error output prior to failing:\n");
 		obuf_flush(buf_err);
 		obuf_reset(buf_err);
-		fd_transferall(t->fd_err, 2);
+		fd_transferall(fd, 2);
 	}
 	//closetask(t); pointless for now since we're just dying
 	exit_failure(status);
 }
 
+// built-in and Lua tasks don't have processes, so they get run from a
+// zero-delay timer instead. this way, they always finish *after* whoever
+// requested them has had a chance to watch them, just like a process would
+static struct vec_taskp deferred = {0};
+static void rundeferred(struct evloop_timer *unused);
+static struct evloop_timer defertimer = {.cb = &rundeferred};
+
+static void defer(struct task *t) {
+	if (!vec_push(&deferred, t)) {
+		errmsg_warn(msg_fatal, "couldn't queue task to run");
+		exit_failure(100);
+	}
+	if (deferred.sz == 1) {
+		defertimer.deadline = time_now();
+		evloop_sched(&defertimer);
+	}
+}
+
+static struct task *luarunning = 0; // the Lua task whose coroutine is running
+
+// these stand in for the proc functions of the same names, since a Lua task has
+// no process; instead, it gets resumed once it has its reply. @worker tasks do
+// have a process, it's just not their own
+static bool reply(struct task *t, const struct ipc_reply *r) {
+	if (t->kind == TASK_WORK) return proc_reply(&t->worker->base, r);
+	if (t->kind != TASK_LUA) return proc_reply(&t->base, r);
+	if (!luatask_reply(t->lua, r)) return false;
+	if (t != luarunning) defer(t); // it's suspended, waiting for this
+	return true;
+}
+
+// moves a task on to another phase (see trace.h), timing it as it goes
+static void setphase(struct task *t, int phase) {
+	trace_phase(&t->trace, phase);
+	vlong now = time_now();
+	if (t->runsince) t->runms += now - t->runsince;
+	t->runsince = phase == TRACE_RUNNING ? now : 0;
+	if (phase == TRACE_RUNNING && !t->started) {
+		t->started = true;
+		events_started(t->id);
+	}
+}
+
+static void block(struct task *t) {
+	setphase(t, TRACE_BLOCKED);
+	events_blocked(t->id);
+	if (t->kind != TASK_LUA) proc_block();
+}
+
+static bool unblocked(struct task *t);
+static void unblock(struct task *t) {
+	events_unblocked(t->id);
+	if (t->kind != TASK_LUA) {
+		setphase(t, TRACE_QUEUED); // for a job slot (see proc.c)
+		proc_unblock(&t->base);
+	}
+	else if (!unblocked(t)) {
+		errmsg_warn(msg_fatal, "couldn't resume Lua task");
+		exit_failure(100);
+	}
+}
+
 static void handle_success(struct task *t, int status) {
 	char *s = desctostr(&t->desc);
-	if (t->nblockers) {
+	if (t->nblockers || t->waitsome > 0) {
 		errmsg_warnx(msg_fatal, "task `", s, "` exited while supposedly "
 				"blocked - fix your code!");
 		handle_failure(t, 2);
 	}
+	for (struct waiter *w = t->waiters.data;
+			w - t->waiters.data < t->waiters.sz; ++w) {
+		if (!w->t->closed) trace_flow(&t->trace, &w->t->trace);
+	}
+	trace_end(&t->trace, &t->desc, t->title, status);
+	if (t->runsince) t->runms += time_now() - t->runsince;
+	t->runsince = 0;
+	struct db_taskresult *r = t->outresult;
+	int fd_err = openerr('e', r->id);
+	uvlong errbytes = 0;
+	struct stat st;
+	if (fd_err != -1 && fstat(fd_err, &st) != -1) errbytes = st.st_size;
+	stats.errbytes += errbytes;
+	// (before anything waiting on it gets going again, for the sake of order)
+	events_finished(t->id, status, t->title, t->runms, errbytes);
 
 	for (struct task **pp = t->blockees.data;
 			pp - t->blockees.data < t->blockees.sz; ++pp) {
 		if (status > (*pp)->maxdepstatus) (*pp)->maxdepstatus = status;
-		if (!--(*pp)->nblockers) proc_unblock(&(*pp)->base);
+		if (!--(*pp)->nblockers) unblock(*pp);
+	}
+	for (struct waiter *w = t->waiters.data;
+			w - t->waiters.data < t->waiters.sz; ++w) {
+		--w->t->npending;
+		if (w->t->closed) {
+			if (!w->t->npending) freelist_free_task(w->t);
+			continue;
+		}
+		if (!vec_push(&w->t->results,
+				((struct ipc_depresult){w->tag, status, true}))) {
+			errmsg_warn(msg_fatal, "couldn't store dependency result");
+			exit_failure(100);
+		}
+		if (w->t->waitsome > 0) {
+			w->t->waitsome = -w->t->waitsome;
+			unblock(w->t);
+		}
 	}
 
-	struct db_taskresult *r = t->outresult;
 	// XXX should really do some kinda ordering for deterministic error output
-	struct vec_task_desc deplist = {0};
-	TABLE_FOREACH_PTR(p, taskdesc, &t->deps) {
-		if (!vec_push(&deplist, *p)) goto e;
-	}
-	struct vec_str infilelist = {0};
-	TABLE_FOREACH_PTR(p, infile, &t->infiles) {
-		if (!vec_push(&infilelist, *p)) goto e;
-	}
 	char buf[12];
 	char buf2[12];
 	buf[0] = 'e';
@@ -231,33 +649,47 @@ static void handle_success(struct task *t, int status) {
 	memcpy(buf2 + 1, buf + 1, n);
 	buf[1 + n] = '\0';
 	buf2[1 + n] = '\0';
-	if (t->haderr) {
+	if (fd_err != -1) {
 		if (renameat(db_dirfd, buf, db_dirfd, buf2) == -1) goto e;
 	}
 	else {
-		// if no error output, delete (we shouldn't have created files, but
-		// there might have been output in some _previous_ run, and it can't
-		// hurt to also remove any temp junk while we're at it, just to be sure)
+		// if no error output, delete the empty file, along with any output
+		// from some _previous_ run
 		unlinkat(db_dirfd, buf, 0);
 		unlinkat(db_dirfd, buf2, 0);
 	}
-	free((void *)r->deps);
-	r->deps = deplist.data; r->ndeps = deplist.sz;
-	free((void *)r->infiles);
-	r->infiles = infilelist.data; r->ninfiles = infilelist.sz;
+	// the lists now belong to the db, so closetask() mustn't free them
+	void *deps = handover(t->deps, t->depsbuf, t->ndeps, (void *)r->deps,
+			r->ndeps, sizeof(*t->deps));
+	void *infiles = handover(t->infiles, t->infilesbuf, t->ninfiles,
+			(void *)r->infiles, r->ninfiles, sizeof(*t->infiles));
+	if ((!deps && t->ndeps) || (!infiles && t->ninfiles)) {
+		errmsg_warn(msg_fatal, "couldn't store task result");
+		exit_failure(100);
+	}
+	r->deps = deps; r->ndeps = t->ndeps;
+	t->deps = t->depsbuf;
+	r->infiles = infiles; r->ninfiles = t->ninfiles;
+	t->infiles = t->infilesbuf;
 	r->newness = db_newness;
 	r->status = status;
+	if (r->durms != -1u) donems += r->durms;
+	r->durms = t->runms;
 	db_committaskresult(r);
 	r->checked = true;
 	goto r;
 
-e:	free(deplist.data); free(infilelist.data);
-	errmsg_warn(msg_warn, "couldn't save result of task `", s);
+e:	errmsg_warn(msg_warn, "couldn't save result of task `", s);
 	errmsg_warnx(msg_note, "redundant reruns will happen later");
-r:	if (t->haderr) showerr(s, t->fd_err);
+r:	if (fd_err != -1) {
+		showerr(s, fd_err);
+		close(fd_err);
+	}
 	if (t == goal) goalstatus = status; // XXX stupid
-	if (!--nstarted) exit_clean(goalstatus); // "
+	// (if the check's still going, it might yet start something else)
+	if (!--nstarted && !checkstack.sz) exit_clean(goalstatus); // "
 	table_del_activetask(&activetasks, t->desc);
+	startorder.data[t->startidx] = 0;
 	if (t->title) {
 		free(tui_lastdone);
 		tui_lastdone = t->title;
@@ -268,89 +700,361 @@ r:	if (t->haderr) showerr(s, t->fd_err);
 
 static bool reqinfile(struct task *t, const char *infile) {
 	bool isnew;
-	const char **pp = table_putget_transact_infile(&t->infiles, infile, &isnew);
-	if (!pp) return false;
-	if (isnew) {
-		*pp = infile;
-		if (!infile_ensure(infile)) return false;
-		table_transactcommit_infile(&t->infiles);
+	if (!addinfile(t, infile, &isnew)) return false;
+	if (isnew && !infile_ensure(infile)) {
+		// back it out again so it doesn't get recorded unchecked
+		--t->ninfiles;
+		if (t->idx && t->idx->infiles.data) {
+			table_del_infile(&t->idx->infiles, infile);
+		}
+		return false;
 	}
 	return true;
 }
 
-// returns true if requester would need to rerun
-static bool reqdep(struct task *req, struct task_desc dep, bool isgoal,
-		int reqnewness) {
-	if (req) {
-		bool isnew;
-		struct task_desc *d = table_putget_taskdesc(&req->deps, dep, &isnew);
-		if (!d || isnew && !vec_push(&req->newdeps, dep)) goto e;
-		*d = dep;
-	}
-	// ideally we'd avoid doing a get and then a put later but transact doesn't
-	// work recursively (that was a fun time debugging...) so this is simpler
-	// than trying to put and then back out again later (also literally none of
-	// this matters since forking a process probably takes much longer than a
-	// typical hash insert, so literally who cares)
-	if (table_get_activetask(&activetasks, dep)) return true;
-	struct db_taskresult *r = db_gettaskresult(dep);
-	if (!r) goto e;
-	if (r->newness == 0) goto r; // it's newly created!
-	if (r->checked) return r->newness > reqnewness;
-	bool needrerun = cleanbuild; // usually false
-	// if haven't checked up-to-date-ness in this run, do a depth first search
-	// (even if cleanbuild, still start deps eagerly in parallel)
-	for (const struct task_desc *pp = r->deps; pp - r->deps < r->ndeps; ++pp) {
-		// currently rerunning all deps preemptively/concurrently
-		// it's up for debate/testing whether this is the universally
-		// best-performing approach, but it's the approach for now
-		if (reqdep(0, *pp, false, r->newness)) needrerun = true;
-	}
-	// ideally we wouldn't check these if we know we already need to rerun, but
-	// if we don't update the infiles themselves, they'll change later and
-	// that'll cause yet another rebuild for no reason
-	for (const char *const *pp = r->infiles; pp - r->infiles < r->ninfiles;
-			++pp) {
-		int ret = infile_query(*pp, r->newness);
-		if (ret == -1 && !needrerun) {
-			errmsg_warn(msg_warn, "couldn't query infile ", *pp);
-			errmsg_warnx(msg_note, "resorting to a maybe-redundant task rerun");
-		}
-		if (ret) needrerun = true;
-	}
-	if (needrerun) {
-r:;		struct task **tp = table_put_activetask(&activetasks, dep);
-		if (!tp) goto e;
-		*tp = opentask(dep, r->id);
-		if (!*tp) goto e;
-		// create the implicit infile, but only for in-tree executables
-		if (path_isfull(dep.argv[0])) {
-			// XXX should we just use a PATH_MAX array and avoid this malloc?
-			// this was the first thing I did and it works; should use brain at
-			// a later date
-			struct str frombase = {0};
-			if (!str_clear(&frombase) ||
-					!str_append0t(&frombase, dep.workdir) ||
-					!str_appendc(&frombase, '/') ||
-					!str_append0t(&frombase, dep.argv[0])) {
-				goto e;
+// records path, relative to workdir, as an infile of t - but only if it's
+// actually in the tree; returns false only if something went wrong
+static bool reqrelinfile(struct task *t, const char *workdir,
+		const char *path) {
+	// absolute paths are outside the tree as far as we're concerned, but the
+	// join below would make them look relative, so they're skipped up front
+	if (*path == '/') return true;
+	// XXX should we just use a PATH_MAX array and avoid this malloc?
+	// this was the first thing I did and it works; should use brain at
+	// a later date
+	struct str frombase = {0};
+	if (!str_clear(&frombase) ||
+			!str_append0t(&frombase, workdir) ||
+			!str_appendc(&frombase, '/') ||
+			!str_append0t(&frombase, path)) {
+		goto e;
+	}
+	char *canon = malloc(frombase.sz);
+	if (!canon) goto e;
+	if (fpath_canon(frombase.data, canon, 0) == FPATH_OK) {
+		const char *infile = db_intern_free(canon);
+		if (!infile || !reqinfile(t, infile)) goto e;
+	}
+	else {
+		free(canon);
+	}
+	free(frombase.data);
+	return true;
+
+e:	free(frombase.data);
+	return false;
+}
+
+static void warnabnormal(const struct task *t, int status) {
+	char *s = desctostr(&t->desc);
+	char buf[4];
+	// buf + 0 to dodge the [static] - status has <= 3 digits
+	buf[fmt_fixed_u32(buf + 0, status)] = '\0';
+	errmsg_warnx(msg_error, "task `", s, "` failed with abnormal status ", buf);
+	free(s);
+}
+
+static void finish(struct task *t, int status) {
+	if (status < 100) {
+		handle_success(t, status);
+		++tui_ndone;
+	}
+	else {
+		handle_failure(t, status);
+	}
+}
+
+// Lua tasks keep their error output in memory until they're done, so there
+// aren't loads of files held open by tasks that are just waiting around
+static void finishlua(struct task *t, int status) {
+	uint len;
+	const char *out = luatask_errout(t->lua, &len);
+	if (len) {
+		int fd = createerr(t);
+		if (fd != -1) {
+			if (!fd_writeall(fd, out, len)) {
+				errmsg_warn(msg_warn, "couldn't save Lua task error output");
 			}
-			char *canon = malloc(frombase.sz);
-			if (!canon) goto e;
-			if (fpath_canon(frombase.data, canon, 0) == FPATH_OK) {
-				const char *infile = db_intern_free(canon);
-				if (!infile || !infile_ensure(infile)) goto e;
-				const char **pp = table_put_infile(&(*tp)->infiles, infile);
-				if (!pp) goto e;
-				*pp = infile;
+			close(fd);
+		}
+	}
+	luatask_free(t->lua);
+	t->lua = 0;
+	finish(t, status);
+}
+
+static void rundeferred(struct evloop_timer *unused) {
+	// more could get added in here as other tasks finish, so don't cache sz
+	for (uint i = 0; i < deferred.sz; ++i) {
+		struct task *t = deferred.data[i];
+		if (t->kind != TASK_LUA) { // built-in, or failed before it started
+			finish(t, t->builtinstatus);
+			continue;
+		}
+		if (!t->lua) {
+			t->lua = luatask_new(t->desc.argv, t->desc.workdir, t);
+			if (!t->lua) {
+				errmsg_warn(msg_error, "couldn't start Lua task");
+				handle_failure(t, 100);
 			}
-			free(frombase.data);
 		}
-		if (isgoal) goal = *tp; // XXX also stupid
-		(*tp)->outresult = r;
-		proc_start(&(*tp)->base, (*tp)->desc.argv, (*tp)->desc.workdir);
-		++nstarted;
-		return true;
+		setphase(t, TRACE_RUNNING);
+		luarunning = t;
+		int status = luatask_resume(t->lua);
+		luarunning = 0;
+		if (status != -1) finishlua(t, status);
+	}
+	deferred.sz = 0;
+}
+
+static bool builtininfile(const char *path, void *ctxt) {
+	struct task *t = ctxt;
+	return reqrelinfile(t, t->desc.workdir, path);
+}
+
+static void runbuiltin(struct task *t) {
+	int errfd = createerr(t);
+	if (errfd == -1) {
+		t->builtinstatus = 100;
+	}
+	else {
+		t->builtinstatus = builtin_run(t->desc.argv, t->desc.workdir, errfd,
+				&builtininfile, t);
+		close(errfd);
+	}
+	defer(t);
+}
+
+// fails a task before it starts, the way a built-in would
+static void failearly(struct task *t, const char *msg) {
+	int errfd = createerr(t);
+	if (errfd == -1) {
+		t->builtinstatus = 100;
+	}
+	else {
+		t->builtinstatus = fd_writeall(errfd, msg, strlen(msg)) ? 2 : 100;
+		close(errfd);
+	}
+	defer(t);
+}
+
+// @worker PROG [ARGS...] tasks are handed to a persistent worker process
+// running PROG, which can do any number of them, one after another (see
+// build_worker_next() in libbuild). there's a pool of workers for each program,
+// growing to at most maxpar; a worker that's waiting for something to do is
+// blocked as far as proc.c is concerned, so it doesn't take up a job slot
+struct workerpool {
+	const char *prog; // interned; also the argv[0] the workers are started with
+	uint nworkers;
+	struct vec_taskp idle; // workers waiting for tasks
+	struct vec_taskp queue; // tasks waiting for workers, from qhead onwards
+	uint qhead;
+};
+struct vec_workerpool VEC(struct workerpool);
+static struct vec_workerpool pools = {0}; // usually only one or two of these
+
+static struct workerpool *getpool(const char *prog) {
+	for (struct workerpool *p = pools.data; p - pools.data < pools.sz; ++p) {
+		if (p->prog == prog) return p;
+	}
+	if (!vec_push(&pools, ((struct workerpool){prog}))) return 0;
+	return pools.data + pools.sz - 1;
+}
+
+static bool newworker(struct workerpool *p) {
+	struct task *w = freelist_alloc_task();
+	if (!w) return false;
+	const char **argv = malloc(2 * sizeof(*argv));
+	if (!argv) { freelist_free_task(w); return false; }
+	argv[0] = p->prog; argv[1] = 0;
+	// workers all run from the root; libbuild moves them around from there
+	*w = (struct task){.kind = TASK_WORKER, .desc = {argv, "."}};
+	++p->nworkers;
+	proc_start(&w->base, argv, ".");
+	return true;
+}
+
+static void sendwork(struct task *w) {
+	struct task *t = w->serving;
+	setphase(t, TRACE_RUNNING);
+	int errfd = createerr(t);
+	if (errfd == -1) handle_failure(t, 100);
+	bool ok = proc_reply(&w->base, &(struct ipc_reply){
+		1, .work = {t->desc.argv + 1, t->desc.workdir}, .workerrfd = errfd
+	});
+	close(errfd);
+	if (!ok) {
+		errmsg_warn(msg_error, "couldn't hand task to worker `",
+				w->desc.argv[0], "`");
+		handle_failure(t, 100);
+	}
+}
+
+static void startwork(struct task *t) {
+	const char *prog = t->desc.argv[1];
+	if (!prog) { failearly(t, "usage: @worker PROG [ARGS...]\n"); return; }
+	// the program's path is relative to the task's workdir, but workers are
+	// started from the root, so it needs to be relative to that instead
+	if (path_isfull(prog) && *prog != '/') {
+		char buf[PATH_MAX], canon[PATH_MAX + 2] = "./";
+		uint dirlen = strlen(t->desc.workdir), len = strlen(prog);
+		if (dirlen + len + 2 > sizeof(buf)) {
+			failearly(t, "@worker: program path is too long\n");
+			return;
+		}
+		memcpy(buf, t->desc.workdir, dirlen);
+		buf[dirlen] = '/';
+		memcpy(buf + dirlen + 1, prog, len + 1);
+		if (fpath_canon(buf, canon + 2, 0) != FPATH_OK) {
+			failearly(t, "@worker: invalid program path\n");
+			return;
+		}
+		char *s = strdup(canon);
+		if (!s || !(prog = db_intern_free(s))) goto e;
+	}
+	struct workerpool *p = getpool(prog);
+	if (!p) goto e;
+	if (p->idle.sz) {
+		struct task *w = p->idle.data[--p->idle.sz];
+		w->serving = t; t->worker = w;
+		proc_unblock(&w->base); // it gets sent the task once it's its turn
+		return;
+	}
+	if (!vec_push(&p->queue, t)) goto e;
+	// if the pool's already full, the task just waits for whichever worker
+	// finishes first (and the same goes if a new one isn't ready in time)
+	if (p->nworkers < maxpar && !newworker(p)) goto e;
+	return;
+
+e:	errmsg_warn(msg_error, "couldn't find a worker for task");
+	handle_failure(t, 100);
+}
+
+// a worker wants something to do
+static void worknext(struct task *w) {
+	if (w->serving) {
+		errmsg_warnx(msg_fatal, "worker `", w->desc.argv[0], "` asked for "
+				"another task without finishing the last - fix your code!");
+		handle_failure(w->serving, 2);
+	}
+	struct workerpool *p = getpool(w->desc.argv[0]);
+	if (p->qhead < p->queue.sz) {
+		struct task *t = p->queue.data[p->qhead++];
+		if (p->qhead == p->queue.sz) p->qhead = p->queue.sz = 0;
+		w->serving = t; t->worker = w;
+		sendwork(w);
+	}
+	else {
+		if (!vec_push(&p->idle, w)) {
+			errmsg_warn(msg_fatal, "couldn't keep track of idle worker");
+			exit_failure(100);
+		}
+		proc_block();
+	}
+}
+
+static void workdone(struct task *w, int status) {
+	struct task *t = w->serving;
+	if (!t) {
+		errmsg_warnx(msg_fatal, "worker `", w->desc.argv[0], "` finished a "
+				"task it wasn't given - fix your code!");
+		exit_failure(2);
+	}
+	w->serving = 0; t->worker = 0;
+	if (status >= 100) warnabnormal(t, status);
+	finish(t, status);
+}
+
+static void workerexit(struct task *w) {
+	struct workerpool *p = getpool(w->desc.argv[0]);
+	--p->nworkers;
+	for (uint i = 0; i < p->idle.sz; ++i) {
+		if (p->idle.data[i] != w) continue;
+		p->idle.data[i] = p->idle.data[--p->idle.sz];
+		// proc.c thinks it was blocked, but is about to count it as active
+		// and take it off nactive; put the counts back the way it expects
+		++nactive; --nblocked;
+		break;
+	}
+	struct task *t = w->serving;
+	if (!t && p->qhead < p->queue.sz && !p->nworkers) {
+		t = p->queue.data[p->qhead]; // nothing else is going to do this one
+	}
+	if (t) {
+		char *s = desctostr(&t->desc);
+		errmsg_warnx(msg_error, "worker `", w->desc.argv[0],
+				"` exited before finishing task `", s, "`");
+		free(s);
+		handle_failure(t, 100);
+	}
+	free((void *)w->desc.argv);
+	freelist_free_task(w);
+}
+
+// tells idle workers to exit once the build is done (busy ones would be
+// unusual, but they'll find out when they try to talk to us)
+static void stopworkers(void) {
+	for (struct workerpool *p = pools.data; p - pools.data < pools.sz; ++p) {
+		for (uint i = 0; i < p->idle.sz; ++i) {
+			proc_reply(&p->idle.data[i]->base, &(struct ipc_reply){0});
+		}
+	}
+}
+
+static void startdep(struct task_desc dep, struct db_taskresult *r,
+		bool isgoal, const struct why *why) {
+	explain(dep, why);
+	if (dryrun) {
+		// pretend it ran, so anything depending on it sees that (none of this
+		// gets saved, see exit_clean())
+		if (isgoal) exit_clean(0);
+		r->newness = db_newness;
+		r->checked = true;
+		return;
+	}
+	struct task **tp = table_put_activetask(&activetasks, dep);
+	if (!tp) goto e;
+	*tp = opentask(dep, r);
+	if (!*tp) goto e;
+	(*tp)->startidx = startorder.sz;
+	if (!vec_push(&startorder, *tp)) goto e;
+	// create the implicit infile, but only for in-tree executables (for Lua
+	// tasks, the script; for @worker tasks, the worker program). anything
+	// outside the tree, absolute paths included, is left out by reqrelinfile()
+	uchar kind = (*tp)->kind;
+	const char *self = kind == TASK_LUA || kind == TASK_WORK ?
+			dep.argv[1] : dep.argv[0];
+	if (self && kind != TASK_LUA && !path_isfull(self)) self = 0;
+	if (self && !reqrelinfile(*tp, dep.workdir, self)) goto e;
+	if (isgoal) goal = *tp; // XXX also stupid
+	(*tp)->outresult = r;
+	// built-ins are done right away; anything else may have to wait its turn
+	events_queued((*tp)->id, &dep);
+	trace_begin(&(*tp)->trace, (*tp)->kind == TASK_BUILTIN ?
+			TRACE_RUNNING : TRACE_QUEUED);
+	if ((*tp)->kind == TASK_BUILTIN) setphase(*tp, TRACE_RUNNING);
+	switch ((*tp)->kind) {
+		case TASK_PROC:
+			proc_start(&(*tp)->base, (*tp)->desc.argv, (*tp)->desc.workdir);
+			break;
+		case TASK_BUILTIN: runbuiltin(*tp); break;
+		case TASK_LUA: defer(*tp); break;
+		case TASK_WORK: startwork(*tp);
+	}
+	++nstarted;
+	return;
+
+	// XXX one day, make this more granular instead of just dying on the spot
+e:	errmsg_warn("couldn't handle task dependency");
+	exit_failure(100);
+}
+
+static void uptodate(struct task_desc dep, struct db_taskresult *r,
+		bool isgoal) {
+	if (dryrun) {
+		if (isgoal) exit_clean(0);
+		r->checked = true;
+		return;
 	}
 	// we only get here once per up-to-date run - stick the error output here!
 	char buf[12];
@@ -370,13 +1074,174 @@ r:;		struct task **tp = table_put_activetask(&activetasks, dep);
 	}
 	if (isgoal) exit_clean(r->status); // XXX this is stupid
 	r->checked = true;
-	return r->newness > reqnewness;
+}
+
+// roughly how many deps and infiles get looked at before the event loop gets
+// another go (a timer slice only; checks that a task is waiting on go all out)
+#define CHECK_SLICE 512
+
+enum { CHECK_FINE, CHECK_RERUN, CHECK_PENDING };
+
+// looks at dep on behalf of something with newness reqnewness, returning
+// whether that would need to rerun (and if so, why), or CHECK_PENDING if dep
+// has been pushed onto the stack and the answer comes once it's popped off
+static int visit(struct task_desc dep, bool isgoal, uint reqnewness,
+		struct why *why) {
+	if (table_get_activetask(&activetasks, dep)) {
+		because(why, (struct why){WHY_DEPRAN, .dep = dep});
+		return CHECK_RERUN;
+	}
+	struct db_taskresult *r = db_gettaskresult(dep);
+	if (!r) goto e;
+	if (r->newness == 0) { // it's newly created!
+		startdep(dep, r, isgoal, &(struct why){WHY_NEW});
+		because(why, (struct why){WHY_DEPRAN, .dep = dep});
+		return CHECK_RERUN;
+	}
+	if (r->checked) {
+		if (r->newness <= reqnewness) return CHECK_FINE;
+		because(why, (struct why){r->newness == db_newness ?
+				WHY_DEPRAN : WHY_DEPNEWER, .dep = dep});
+		return CHECK_RERUN;
+	}
+	bool isnew;
+	struct checkidx *c = table_putget_checking(&checking, r, &isnew);
+	if (!c) goto e;
+	// already on the stack, so the recorded deps go round in a circle somehow.
+	// can't hurt to rerun, and that'll find out what the deps really are
+	if (!isnew) {
+		because(why, (struct why){WHY_CYCLE});
+		return CHECK_RERUN;
+	}
+	c->r = r; c->idx = checkstack.sz;
+	// if haven't checked up-to-date-ness in this run, do a depth first search
+	// (even if cleanbuild, still start deps eagerly in parallel)
+	if (!vec_push(&checkstack, ((struct checkframe){
+		dep, r, 0, {cleanbuild ? WHY_CLEAN : WHY_NONE}, isgoal
+	}))) {
+		goto e;
+	}
+	return CHECK_PENDING;
+
+e:	errmsg_warn("couldn't handle task dependency");
+	exit_failure(100);
+}
+
+// works on the stack until it's down to floor frames, or budget runs out;
+// returns false in the latter case
+static bool runcheck(uint floor, uint budget) {
+	while (checkstack.sz > floor) {
+		if (!budget--) return false;
+		struct checkframe *f = checkstack.data + checkstack.sz - 1;
+		struct db_taskresult *r = f->r;
+		if (f->next < r->ndeps) {
+			// currently rerunning all deps preemptively/concurrently
+			// it's up for debate/testing whether this is the universally
+			// best-performing approach, but it's the approach for now
+			// (if this pushes anything, f moves, but why is only written to
+			// when the answer is already known, so that's fine)
+			visit(r->deps[f->next++], false, r->newness, &f->why);
+			continue;
+		}
+		if (f->next < r->ndeps + r->ninfiles) {
+			// ideally we wouldn't check these if we know we already need to
+			// rerun, but if we don't update the infiles themselves, they'll
+			// change later and that'll cause yet another rebuild for no reason
+			const char *infile = r->infiles[f->next++ - r->ndeps];
+			int ret = infile_query(infile, r->newness);
+			if (ret == -1) {
+				if (!f->why.kind) {
+					errmsg_warn(msg_warn, "couldn't query infile ", infile);
+					errmsg_warnx(msg_note, "resorting to a maybe-redundant "
+							"task rerun");
+				}
+				because(&f->why, (struct why){WHY_INFILEERR, .infile = infile});
+			}
+			else if (ret) {
+				because(&f->why, (struct why){WHY_INFILE,
+						infile_changes(infile), .infile = infile});
+			}
+			continue;
+		}
+		struct checkframe done = *f;
+		--checkstack.sz;
+		table_del_checking(&checking, r);
+		if (done.why.kind) startdep(done.desc, r, done.isgoal, &done.why);
+		else uptodate(done.desc, r, done.isgoal);
+		if (checkstack.sz) {
+			f = checkstack.data + checkstack.sz - 1;
+			if (done.why.kind) {
+				because(&f->why, (struct why){WHY_DEPRAN, .dep = done.desc});
+			}
+			else if (r->newness > f->r->newness) {
+				because(&f->why, (struct why){WHY_DEPNEWER, .dep = done.desc});
+			}
+		}
+	}
+	return true;
+}
+
+static void checkslice(struct evloop_timer *unused);
+static struct evloop_timer checktimer = {.cb = &checkslice};
+
+static void checkslice(struct evloop_timer *unused) {
+	if (!runcheck(0, CHECK_SLICE)) {
+		checktimer.deadline = time_now();
+		evloop_sched(&checktimer);
+	}
+}
+
+// a task wants dep, and will want to know how it went, so the check can't wait
+static void reqdep(struct task *req, struct task_desc dep) {
+	bool isnew;
+	if (!adddep(req, dep, &isnew) ||
+			isnew && !vec_push(&req->newdeps, dep)) {
+		goto e;
+	}
+	struct db_taskresult *r = db_gettaskresult(dep);
+	if (!r) goto e;
+	struct checkidx *c = table_get_checking(&checking, r);
+	// partway through already, so just finish it off
+	if (c) { runcheck(c->idx, -1); return; }
+	// not got to yet: the rest of the stack has to be done first, as otherwise
+	// this could run into something on it that isn't done, and can't be until
+	// this is
+	if (!r->checked && r->newness &&
+			!table_get_activetask(&activetasks, dep)) {
+		runcheck(0, -1);
+	}
+	struct why unused = {0};
+	if (visit(dep, false, req->outresult->newness, &unused) == CHECK_PENDING) {
+		runcheck(0, -1);
+	}
+	return;
 
-	// XXX one day, make this more granular instead of just dying on the spot
 e:	errmsg_warn("couldn't handle task dependency");
 	exit_failure(100);
 }
 
+// makes sure t gets a result for this dep under the given tag, whether it's
+// done already or not (called after reqdep() so it'll be one or the other)
+static void watchdep(struct task *t, struct task_desc dep, int tag) {
+	struct task **active = table_get_activetask(&activetasks, dep);
+	if (active) {
+		if (!vec_push(&(*active)->waiters, ((struct waiter){t, tag}))) goto e;
+		++t->npending;
+	}
+	else {
+		struct db_taskresult *r = db_gettaskresult(dep);
+		if (!r || !vec_push(&t->results, ((struct ipc_depresult){
+			tag, r->status, r->newness == db_newness
+		}))) {
+			goto e;
+		}
+	}
+	return;
+
+e:	errmsg_warn("couldn't track dependency result");
+	exit_failure(100);
+}
+
 // cycle check algorithm:
 // * only care about running tasks that are blocked, since non-blocked things
 //   obviously aren't participating in any kind of dependency relationship, and
@@ -392,22 +1257,34 @@ e:	errmsg_warn("couldn't handle task dependency");
 // cool thing about this: it only happens once per wait, and generally only
 // traverses a small subset of the graph, unlike most build system cycle checks
 // which necessarily validate the entire thing every time!
+//
+// tasks blocked in a waitsome count as blockees too, but only for the last dep
+// they're waiting on; until then, any of the others could still wake them up
+
+// gets the ith thing blocked on t, or null if the ith waiter isn't blocked
+static struct task *blockee(const struct task *t, uint i) {
+	if (i < t->blockees.sz) return t->blockees.data[i];
+	struct task *w = t->waiters.data[i - t->blockees.sz].t;
+	return w->waitsome > 0 && w->npending == 1 ? w : 0;
+}
 
 static bool cyclecheck(struct task *req, struct task *dep) {
 	if (req->cyclecheck == cyclecheckid) return false;
 	req->cyclecheck = cyclecheckid;
-	for (uint i = 0; i < req->blockees.sz; ++i) {
-		if (req->blockees.data[i] == dep) {
+	for (uint i = 0; i < req->blockees.sz + req->waiters.sz; ++i) {
+		struct task *b = blockee(req, i);
+		if (!b) continue;
+		if (b == dep) {
 			errmsg_warnx(msg_fatal, "blocked tasks would deadlock "
 					"(dependency cycle)");
 			obuf_put0t(buf_err, "  the full cycle looks something like this:\n");
 			obuf_put0t(buf_err, "  ┌─► `");
-			char *s = desctostr(&req->blockees.data[i]->desc);
+			char *s = desctostr(&b->desc);
 			if (s) obuf_put0t(buf_err, s);
 			obuf_put0t(buf_err, "`\n");
 			goto yep;
 		}
-		if (cyclecheck(req->blockees.data[i], dep)) {
+		if (cyclecheck(b, dep)) {
 yep:		obuf_put0t(buf_err, "  │   `");
 			char *s = desctostr(&req->desc);
 			if (s) obuf_put0t(buf_err, s);
@@ -428,6 +1305,69 @@ static void docyclecheck(struct task *req, struct task *dep) {
 	}
 }
 
+// for a waitsome: counts how many of t's pending deps are (transitively)
+// blocked on t itself; if that's all of them, nothing can ever wake t up again
+static uint countstuck(struct task *req, struct task *t, struct task **found) {
+	if (req->cyclecheck == cyclecheckid) return 0;
+	req->cyclecheck = cyclecheckid;
+	uint n = 0;
+	for (uint i = 0; i < req->waiters.sz; ++i) {
+		if (req->waiters.data[i].t == t) {
+			++n;
+			// prefer something other than t itself; makes for a nicer message
+			if (!*found || req != t) *found = req;
+		}
+	}
+	for (uint i = 0; i < req->blockees.sz + req->waiters.sz; ++i) {
+		struct task *b = blockee(req, i);
+		if (b) n += countstuck(b, t, found);
+	}
+	return n;
+}
+
+// sends back up to max results, oldest first, and keeps the rest for later
+static bool sendresults(struct task *t, int max) {
+	uint n = t->results.sz < (uint)max ? t->results.sz : (uint)max;
+	uchar maxstatus = 0;
+	for (uint i = 0; i < n; ++i) {
+		if (t->results.data[i].status > maxstatus) {
+			maxstatus = t->results.data[i].status;
+		}
+	}
+	if (!reply(t, &(struct ipc_reply){maxstatus, n, t->results.data})) {
+		return false;
+	}
+	memmove(t->results.data, t->results.data + n,
+			(t->results.sz - n) * sizeof(*t->results.data));
+	t->results.sz -= n;
+	return true;
+}
+
+static void reqwaitsome(struct task *t, int max) {
+	// if anything's finished, or there's nothing left to finish, reply now
+	if (t->results.sz || !t->npending) {
+		if (!sendresults(t, max)) goto e;
+		return;
+	}
+	t->waitsome = max; // set first so the cycle check counts us as blocked
+	++cyclecheckid;
+	struct task *found = 0;
+	if (countstuck(t, t, &found) == t->npending) {
+		// search again just to print out the path
+		++cyclecheckid;
+		docyclecheck(t, found);
+		// shouldn't get here, but just in case:
+		errmsg_warnx(msg_fatal, "blocked tasks would deadlock "
+				"(dependency cycle)");
+		exit_failure(100);
+	}
+	block(t);
+	return;
+
+e:	errmsg_warn("couldn't handle dependency wait request");
+	exit_failure(100);
+}
+
 static void reqwait(struct task *t) {
 	t->maxdepstatus = 0;
 	++cyclecheckid;
@@ -449,38 +1389,128 @@ static void reqwait(struct task *t) {
 	// if there weren't any deps, send unblock message immediately, otherwise
 	// tell proc we're blocked
 	if (t->nblockers) {
-		proc_block();
+		block(t);
 	}
-	else if (!ipcserver_send(t->base.ipcsock, &(struct ipc_reply){0})) {
+	else if (!reply(t, &(struct ipc_reply){t->maxdepstatus})) {
 		goto e;
 	}
+	else {
+		t->results.sz = 0; // a full wait doesn't care about individual results
+	}
 	return;
 
 e:	errmsg_warn("couldn't handle dependency wait request");
 	exit_failure(100);
 }
 
+// handles a request from a task, be it over IPC or from a Lua task directly
+static bool handlereq(struct task *t, struct ipc_req *req) {
+	switch (req->type) {
+		case IPC_REQ_DEP:
+			reqdep(t, req->dep);
+			watchdep(t, req->dep, req->tag);
+			break;
+		case IPC_REQ_DEPS:
+			for (int i = 0; i < req->deps.n; ++i) {
+				struct task_desc d = {req->deps.argvs[i], req->deps.workdir};
+				reqdep(t, d);
+				watchdep(t, d, req->tag + i);
+			}
+			break;
+		case IPC_REQ_WAIT: reqwait(t); break;
+		case IPC_REQ_WAITSOME: reqwaitsome(t, req->waitmax); break;
+		case IPC_REQ_INFILE: return reqinfile(t, req->infile);
+		case IPC_REQ_INFILES:;
+			bool ok = true;
+			for (int i = 0; ok && i < req->infiles.n; ++i) {
+				ok = reqinfile(t, req->infiles.paths[i]);
+			}
+			return ok;
+		case IPC_REQ_TASKTITLE: free(t->title); t->title = req->title; break;
+		// workers deal with these themselves (see workerev()); anything else
+		// gets told it's not a worker, and can go about its business
+		case IPC_REQ_WORKNEXT: return reply(t, &(struct ipc_reply){0});
+		case IPC_REQ_WORKDONE: break;
+		case IPC_REQ_RING: case IPC_REQ_RINGWAKE:; // see proc.c
+	}
+	return true;
+}
+
+static bool unblocked(struct task *t) {
+	setphase(t, TRACE_RUNNING);
+	if (t->waitsome) {
+		int max = -t->waitsome;
+		t->waitsome = 0;
+		return sendresults(t, max);
+	}
+	if (!reply(t, &(struct ipc_reply){t->maxdepstatus})) return false;
+	t->results.sz = 0; // as in reqwait()
+	return true;
+}
+
+static void luareq(void *ctxt, struct ipc_req *req) {
+	struct task *t = ctxt;
+	if (!handlereq(t, req)) {
+		char *s = desctostr(&t->desc);
+		errmsg_warn(msg_error, "couldn't handle request from task `", s, "`");
+		free(s);
+		handle_failure(t, 100);
+	}
+}
+
+// proc events for worker processes, as opposed to ordinary task processes
+static void workerev(int evtype, union proc_ev_param P, struct task *w) {
+	struct task *t = w->serving;
+	switch (evtype) {
+		case PROC_EV_START:
+			// anything said outside of a task goes straight to our own stderr
+			*P.errfd = fcntl(2, F_DUPFD_CLOEXEC, 3);
+			break;
+		case PROC_EV_EXIT: workerexit(w); break;
+		case PROC_EV_IPC:;
+			struct ipc_req req;
+			// libbuild moves into the task's workdir, so paths are relative to
+			// that, same as for a process
+			if (!ipcserver_decode(&req, t ? t->desc.workdir : ".")) {
+				if (errno == EINVAL) goto qfail;
+				goto fail;
+			}
+			if (req.type == IPC_REQ_WORKNEXT) {
+				worknext(w);
+			}
+			else if (req.type == IPC_REQ_WORKDONE) {
+				workdone(w, req.workstatus);
+			}
+			else if (!t) {
+				errmsg_warnx(msg_fatal, "worker `", w->desc.argv[0], "` made a "
+						"request without a task - fix your code!");
+				if (req.type == IPC_REQ_TASKTITLE) free(req.title);
+				exit_failure(2);
+			}
+			else if (!handlereq(t, &req)) {
+				goto fail;
+			}
+			break;
+		case PROC_EV_UNBLOCK: sendwork(w); break; // see startwork()
+		case PROC_EV_ERROR:
+fail:		errmsg_warn(msg_error, "couldn't handle event from worker `",
+					w->desc.argv[0], "`");
+qfail:		if (t) handle_failure(t, 100);
+			exit_failure(100);
+	}
+}
+
 static void proc_cb(int evtype, union proc_ev_param P, struct proc_info *proc) {
 	struct task *t = (struct task *)proc;
+	if (t->kind == TASK_WORKER) { workerev(evtype, P, t); return; }
 	switch (evtype) {
-		case PROC_EV_STDERR:
-			if (!t->haderr) {
-				// create file lazily; originally we just did this in opentask()
-				// but that used up all the FDs when many tasks were queued in
-				// parallel, which is obviously no good
-				// this also avoids creating as many syscalls, inodes, etc.
-				char buf[12];
-				buf[0] = 'e';
-				buf[1 + fmt_fixed_u32(buf + 1, t->id)] = '\0';
-				t->fd_err = openat(db_dirfd, buf, O_RDWR | O_CREAT | O_TRUNC |
-						O_CLOEXEC, 0644);
-				if (t->fd_err == -1) {
-					errmsg_warn("couldn't open "BUILDDB_DIR"/", buf);
-					goto qfail;
-				}
-				t->haderr = true;
-			}
-			if (!fd_writeall(t->fd_err, P.buf, P.sz)) goto fail;
+		case PROC_EV_START:;
+			// the task writes its error output directly to this file, so we
+			// never have to touch it until the task is done. the file is only
+			// opened right as the task starts, as opening it in opentask() used
+			// up all the FDs when many tasks were queued in parallel
+			*P.errfd = createerr(t);
+			setphase(t, TRACE_RUNNING);
 			break;
 		case PROC_EV_EXIT:
 			if (WIFEXITED(P.status)) {
@@ -489,13 +1519,7 @@ static void proc_cb(int evtype, union proc_ev_param P, struct proc_info *proc) {
 					++tui_ndone;
 				}
 				else {
-					char *s = desctostr(&t->desc);
-					char buf[4];
-					// buf + 0 to dodge the [static] - status has <= 3 digits
-					buf[fmt_fixed_u32(buf + 0, WEXITSTATUS(P.status))] = '\0';
-					errmsg_warnx(msg_error, "task `", s,
-							"` failed with abnormal status ", buf);
-					free(s);
+					warnabnormal(t, WEXITSTATUS(P.status));
 					handle_failure(t, WEXITSTATUS(P.status));
 				}
 			}
@@ -509,28 +1533,14 @@ static void proc_cb(int evtype, union proc_ev_param P, struct proc_info *proc) {
 			break;
 		case PROC_EV_IPC:;
 			struct ipc_req req;
-			if (!ipcserver_recv(t->base.ipcsock, &req, t->desc.workdir)) {
+			if (!ipcserver_decode(&req, t->desc.workdir)) {
 				if (errno == EINVAL) goto qfail; // error reported by ipcserver
-#ifdef __DragonFly__
-				// ECONNRESET on connectionless sockets, brought to you by Matt
-				if (errno == ECONNRESET) break;
-#endif
 				goto fail;
 			}
-			switch (req.type) {
-				case IPC_REQ_DEP:
-					reqdep(t, req.dep, false, t->outresult->newness); break;
-				case IPC_REQ_WAIT: reqwait(t); break;
-				case IPC_REQ_INFILE:
-					if (!reqinfile(t, req.infile)) goto fail; break;
-				case IPC_REQ_TASKTITLE: free(t->title); t->title = req.title;
-			}
+			if (!handlereq(t, &req)) goto fail;
 			break;
 		case PROC_EV_UNBLOCK:
-			if (!ipcserver_send(t->base.ipcsock,
-					&(struct ipc_reply){t->maxdepstatus})) {
-				goto fail;
-			}
+			if (!unblocked(t)) goto fail;
 			break;
 		case PROC_EV_ERROR:
 fail:;		char *s = desctostr(&t->desc);
@@ -540,15 +1550,77 @@ qfail:		handle_failure(t, 100);
 	}
 }
 
+bool task_estimate(uint *eta, uint *pct, bool *partial) {
+	if (checkstack.sz) return false; // more could be about to start
+	vlong now = time_now();
+	uvlong total = donems, left = 0;
+	uint crit = 0, n = 0;
+	*partial = false;
+	for (uint i = 0; i < startorder.sz; ++i) {
+		struct task *t = startorder.data[i];
+		if (!t) continue;
+		t->startidx = n;
+		startorder.data[n++] = t;
+		const struct db_taskresult *r = t->outresult;
+		uint expect = r->durms;
+		if (expect == -1u) { *partial = true; expect = 0; }
+		uvlong ran = t->runms + (t->runsince ? now - t->runsince : 0);
+		uint rem = ran < expect ? expect - ran : 0;
+		// the deps it had last time were checked, and so started, before it
+		// was (see runcheck()), so they've all been seen to already. anything
+		// later is from a cycle, which just gets ignored
+		uint before = 0;
+		for (uint j = 0; j < r->ndeps; ++j) {
+			struct task **d = table_get_activetask(&activetasks, r->deps[j]);
+			if (d && (*d)->startidx < t->startidx && (*d)->estms > before) {
+				before = (*d)->estms;
+			}
+		}
+		t->estms = before + rem;
+		if (t->estms > crit) crit = t->estms;
+		total += expect;
+		left += rem;
+	}
+	startorder.sz = n;
+	if (!total) return false;
+	// can't be done any sooner than the longest chain of tasks, one after
+	// another, nor than all the work spread evenly over every job slot
+	uvlong spread = left / maxpar;
+	*eta = crit > spread ? crit : spread;
+	*pct = (total - left) * 100 / total;
+	return true;
+}
+
 void task_init(void) {
 	proc_init(&proc_cb);
+	luatask_init(&luareq);
 	if (!table_init_activetask(&activetasks)) {
 		errmsg_die(100, msg_fatal, "couldn't allocate task table");
 	}
+	if (!table_init_checking(&checking)) {
+		errmsg_die(100, msg_fatal, "couldn't allocate task table");
+	}
+	if (dryrun) {
+		whybuf->fd = 1;
+	}
+	else {
+		whybuf->fd = openat(db_dirfd, "why", O_WRONLY | O_CREAT | O_TRUNC |
+				O_CLOEXEC, 0644);
+		if (whybuf->fd == -1) {
+			errmsg_warn(msg_warn, "couldn't open .builddb/why");
+			errmsg_warnx(msg_note, "reasons for reruns won't be recorded");
+		}
+	}
 }
 	
 void task_goal(const char *const *argv, const char *workdir) {
-	reqdep(0, (struct task_desc){argv, workdir}, true, 0);
+	// the rest happens in slices once the event loop is going
+	struct why unused = {0};
+	if (visit((struct task_desc){argv, workdir}, true, 0, &unused) ==
+			CHECK_PENDING) {
+		checktimer.deadline = time_now();
+		evloop_sched(&checktimer);
+	}
 }
 
 // vi: sw=4 ts=4 noet tw=80 cc=80
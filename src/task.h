@@ -17,6 +17,10 @@
 #ifndef INC_TASK_H
 #define INC_TASK_H
 
+#include <stdbool.h>
+
+#include <intdefs.h>
+
 /*
  * note: also responsible for calling proc_init; the task API is essentially a
  * layer on top of proc stuff
@@ -26,6 +30,15 @@ void task_init(void);
 /* this one is called *once* with the main task to kick everything off */
 void task_goal(const char *const *argv, const char *workdir);
 
+/*
+ * estimates how much longer the build will take, going by how long each task
+ * that's still to finish spent running last time. returns false if there's
+ * nothing to go on yet; otherwise, *eta is in milliseconds, *pct is how much of
+ * the expected work is done, and *partial is set if some of the tasks have
+ * never finished before, in which case the estimate will be on the low side
+ */
+bool task_estimate(uint *eta, uint *pct, bool *partial);
+
 #endif
 
 // vi: sw=4 ts=4 noet tw=80 cc=80
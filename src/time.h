@@ -5,7 +5,8 @@
 
 #include <intdefs.h>
 
-vlong time_now(void);
+vlong time_now(void); // milliseconds
+vlong time_nowus(void); // microseconds, for finer timing (trace.c)
 
 #endif
 
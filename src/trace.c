@@ -0,0 +1,165 @@
+/* This file is dedicated to the public domain. */
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <fmt.h>
+#include <intdefs.h>
+#include <iobuf.h>
+#include <vec.h>
+
+#include "defs.h"
+#include "desc.h"
+#include "json.h"
+#include "time.h"
+#include "trace.h"
+
+bool tracing = false;
+
+static struct obuf *out = OBUF(-1, 65536);
+static vlong epoch;
+static bool anyevents = false;
+static uint nslots = 0;
+struct vec_uint VEC(uint);
+static struct vec_uint freeslots = {0};
+static uint counts[4] = {0}; // tasks in each phase, for the counter track
+static uint nextflow = 0;
+
+static const char *const phasenames[] = {
+	0, "queued", "running", "blocked"
+};
+
+static void putnum(uvlong n) {
+	char buf[21];
+	obuf_putbytes(out, buf, fmt_fixed_u64(buf, n));
+}
+
+static void putstrpart(const char *p, uint n, void *unused) {
+	obuf_putbytes(out, p, n);
+}
+
+static void putstr(const char *s) { json_putstr(s, &putstrpart, 0); }
+
+// starts off an event object, leaving it open for the rest of the fields
+static void event(const char *name, char ph, uint slot, vlong ts) {
+	obuf_put0t(out, anyevents ? ",\n{\"name\":" : "\n{\"name\":");
+	anyevents = true;
+	putstr(name);
+	obuf_put0t(out, ",\"ph\":\"");
+	obuf_putc(out, ph);
+	obuf_put0t(out, "\",\"pid\":1,\"tid\":");
+	putnum(slot);
+	obuf_put0t(out, ",\"ts\":");
+	putnum(ts - epoch);
+}
+
+static void span(const char *name, uint slot, vlong start, vlong end) {
+	event(name, 'X', slot, start);
+	obuf_put0t(out, ",\"dur\":");
+	putnum(end - start);
+}
+
+static void counter(vlong now) {
+	event("tasks", 'C', 0, now);
+	for (int i = 1; i < 4; ++i) {
+		obuf_put0t(out, i == 1 ? ",\"args\":{\"" : ",\"");
+		obuf_put0t(out, phasenames[i]);
+		obuf_put0t(out, "\":");
+		putnum(counts[i]);
+	}
+	obuf_put0t(out, "}}");
+}
+
+bool trace_init(const char *path) {
+	out->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (out->fd == -1) return false;
+	tracing = true;
+	epoch = time_nowus();
+	obuf_put0t(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	event("process_name", 'M', 0, epoch);
+	obuf_put0t(out, ",\"args\":{\"name\":\"build\"}}");
+	return true;
+}
+
+void trace_begin(struct trace_task *t, int phase) {
+	if (!tracing) return;
+	if (freeslots.sz) {
+		t->slot = freeslots.data[--freeslots.sz];
+	}
+	else {
+		t->slot = ++nslots; // 0 is left for the counter
+		char buf[16] = "slot ";
+		buf[5 + fmt_fixed_u32(buf + 5, t->slot)] = '\0';
+		event("thread_name", 'M', t->slot, time_nowus());
+		obuf_put0t(out, ",\"args\":{\"name\":");
+		putstr(buf);
+		obuf_put0t(out, "}}");
+	}
+	t->start = t->since = time_nowus();
+	t->phase = phase;
+	++counts[phase];
+	counter(t->start);
+}
+
+// closes off the current phase, with a slice if any time was spent in it
+static void endphase(struct trace_task *t, vlong now) {
+	if (now > t->since) {
+		span(phasenames[t->phase], t->slot, t->since, now);
+		obuf_putc(out, '}');
+	}
+	--counts[t->phase];
+}
+
+void trace_phase(struct trace_task *t, int phase) {
+	if (!tracing || !t->phase || t->phase == phase) return;
+	vlong now = time_nowus();
+	endphase(t, now);
+	t->since = now;
+	t->phase = phase;
+	++counts[phase];
+	counter(now);
+}
+
+void trace_flow(const struct trace_task *dep, const struct trace_task *waiter) {
+	if (!tracing || !dep->phase || !waiter->phase) return;
+	// the start binds to the slice the dep is in right now (its last phase, as
+	// it's just finishing) and Perfetto draws the arrow from the end of that
+	event("dep", 's', dep->slot, dep->since);
+	obuf_put0t(out, ",\"cat\":\"dep\",\"id\":");
+	putnum(nextflow);
+	obuf_putc(out, '}');
+	event("dep", 'f', waiter->slot, time_nowus());
+	obuf_put0t(out, ",\"cat\":\"dep\",\"bp\":\"e\",\"id\":");
+	putnum(nextflow++);
+	obuf_putc(out, '}');
+}
+
+void trace_end(struct trace_task *t, const struct task_desc *desc,
+		const char *title, int status) {
+	if (!tracing || !t->phase) return;
+	vlong now = time_nowus();
+	endphase(t, now);
+	t->phase = 0;
+	char *s = 0;
+	if (!title) title = s = desctostr(desc);
+	span(title ? title : "?", t->slot, t->start, now);
+	free(s);
+	obuf_put0t(out, ",\"cat\":\"task\",\"args\":{\"status\":");
+	putnum(status);
+	obuf_put0t(out, "}}");
+	counter(now);
+	// if this fails, there'll just be a few more slots than needed
+	vec_push(&freeslots, t->slot);
+}
+
+void trace_finish(void) {
+	if (!tracing) return;
+	obuf_put0t(out, "\n]}\n");
+	obuf_flush(out);
+	close(out->fd);
+	tracing = false;
+}
+
+// vi: sw=4 ts=4 noet tw=80 cc=80
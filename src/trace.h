@@ -0,0 +1,56 @@
+/* This file is dedicated to the public domain. */
+
+#ifndef INC_TRACE_H
+#define INC_TRACE_H
+
+#include <stdbool.h>
+
+#include <intdefs.h>
+
+#include "defs.h"
+
+/*
+ * -T writes a timeline of every task that runs, in Chrome's trace event JSON
+ * format (as loaded by chrome://tracing or Perfetto). each task gets a slice
+ * spanning its whole run, split up into phases underneath that, on a "slot"
+ * which it keeps until it's done; slots get reused, so there are only as many
+ * as there were tasks on the go at once
+ */
+
+enum {
+	TRACE_QUEUED = 1, // waiting for a job slot, before starting or resuming
+	TRACE_RUNNING,
+	TRACE_BLOCKED // waiting on deps
+};
+
+/* kept in each task; only touched by this code */
+struct trace_task {
+	vlong start, since; // of the whole task and of the current phase
+	uint slot;
+	uchar phase;
+	// char padding[3];
+};
+
+extern bool tracing;
+
+/* opens the trace file, returning false on failure (errno is set) */
+bool trace_init(const char *path);
+
+/* the rest of these do nothing unless trace_init() has been called */
+
+void trace_begin(struct trace_task *t, int phase);
+void trace_phase(struct trace_task *t, int phase);
+
+/* draws an arrow from a dep that just finished to a task waiting on it */
+void trace_flow(const struct trace_task *dep, const struct trace_task *waiter);
+
+/* title may be null, in which case the task's command is shown instead */
+void trace_end(struct trace_task *t, const struct task_desc *desc,
+		const char *title, int status);
+
+/* finishes the file off; called at exit */
+void trace_finish(void);
+
+#endif
+
+// vi: sw=4 ts=4 noet tw=80 cc=80
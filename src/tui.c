@@ -24,6 +24,7 @@
 #include "fmt.h"
 #include "iobuf.h"
 #include "proc.h"
+#include "task.h"
 #include "time.h"
 
 static int devtty = -1;
@@ -36,6 +37,62 @@ static int spinstate = 0;
 int tui_ndone = 0;
 char *tui_lastdone = 0;
 
+// the estimate goes over every task that's on the go, so it only gets redone
+// every so often; in between, it just counts down
+#define ESTIMATE_FRAMES 10
+static int estframes = 0;
+static bool haveest = false, estpartial;
+static uint eta, etapct;
+static vlong etaat;
+
+static void puttwo(uint x) {
+	obuf_putc(buf_tty, '0' + x / 10);
+	obuf_putc(buf_tty, '0' + x % 10);
+}
+
+static void puttime(uint ms) {
+	uint s = ms / 1000 + !!(ms % 1000); // round up, so "0s" means it's late
+	if (s >= 3600) {
+		fmt_buf_u32(buf_tty, s / 3600);
+		obuf_putc(buf_tty, 'h');
+		puttwo(s / 60 % 60);
+		obuf_putc(buf_tty, 'm');
+	}
+	else if (s >= 60) {
+		fmt_buf_u32(buf_tty, s / 60);
+		obuf_putc(buf_tty, 'm');
+		puttwo(s % 60);
+		obuf_putc(buf_tty, 's');
+	}
+	else {
+		fmt_buf_u32(buf_tty, s);
+		obuf_putc(buf_tty, 's');
+	}
+}
+
+static void putestimate(void) {
+	vlong now = time_now();
+	if (!estframes--) {
+		haveest = task_estimate(&eta, &etapct, &estpartial);
+		etaat = now;
+		estframes = ESTIMATE_FRAMES - 1;
+	}
+	if (!haveest) return;
+	obuf_put0t(buf_tty, " (");
+	fmt_buf_u32(buf_tty, etapct);
+	obuf_put0t(buf_tty, "%), ETA ");
+	uint since = now - etaat;
+	uint left = since < eta ? eta - since : 0;
+	// if the known tasks are all running over, it's not looking good; if some
+	// have never run before, who knows
+	if (!left && !estpartial) {
+		obuf_put0t(buf_tty, "overdue");
+		return;
+	}
+	if (estpartial) obuf_putc(buf_tty, '>');
+	puttime(left);
+}
+
 static void redraw(void) {
 	// TODO(tui): do... whatever I come up with over here
 	obuf_put0t(buf_tty, "\r\033[K");
@@ -50,6 +107,7 @@ static void redraw(void) {
 	}
 	fmt_buf_u32(buf_tty, tui_ndone);
 	obuf_put0t(buf_tty, " done");
+	putestimate();
 	if (tui_lastdone) {
 		obuf_put0t(buf_tty, ", last: `");
 		obuf_put0t(buf_tty, tui_lastdone);
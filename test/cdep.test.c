@@ -0,0 +1,81 @@
+{.desc = "#include scanning"};
+
+#include <string.h>
+
+#include "../src/cdep.c"
+
+// scans s and compares the result against want, which is in the same format
+// as cdep_file.incs (so wantlen includes every null terminator)
+static bool scans(const char *s, const char *want, uint wantlen) {
+	struct vec_char out = {0};
+	bool ok = scan(s, s + strlen(s), &out) && out.sz == wantlen &&
+			!memcmp(out.data, want, wantlen);
+	free(out.data);
+	return ok;
+}
+
+#define SCANS(s, want) scans(s, want, sizeof(want) - 1)
+
+TEST("both kinds of include should be found, with the kind kept") {
+	return SCANS(
+		"#include <stdio.h>\n"
+		"#include \"local.h\"\n"
+		"int main(void) { return 0; }\n",
+		"<stdio.h\0\"local.h\0");
+}
+
+TEST("#import and odd spacing should be fine") {
+	return SCANS(
+		"  #  include\t<a.h>\n"
+		"\t#import \"b.h\"\n"
+		"#include<c.h>\n",
+		"<a.h\0\"b.h\0<c.h\0");
+}
+
+TEST("CRLF line endings should be handled") {
+	return SCANS("#include \"a.h\"\r\n#include <b.h>\r\n", "\"a.h\0<b.h\0");
+}
+
+TEST("a # partway through a line shouldn't start a directive") {
+	return SCANS(
+		"#define STR(x) #x\n"
+		"int x; #include \"no.h\"\n"
+		"char *s = \"#include <no.h>\";\n",
+		"");
+}
+
+TEST("computed includes and #include_next should be skipped") {
+	return SCANS(
+		"#include HEADER\n"
+		"#include_next <stdlib.h>\n"
+		"#include <yes.h>\n",
+		"<yes.h\0");
+}
+
+TEST("broken or empty names should be skipped") {
+	return SCANS(
+		"#include \"unterminated.h\n"
+		"#include <>\n"
+		"#include <mismatched.h\"\n"
+		"#include \"fine.h\"\n",
+		"\"fine.h\0");
+}
+
+TEST("directives are found regardless of #if, as documented") {
+	return SCANS(
+		"#if 0\n"
+		"#include \"hidden.h\"\n"
+		"#endif\n",
+		"\"hidden.h\0");
+}
+
+TEST("an include on the last line, without a newline, should be found") {
+	return SCANS("#include <last.h>", "<last.h\0");
+}
+
+TEST("input ending partway through a directive should give nothing") {
+	return SCANS("#include", "") && SCANS("#include ", "") &&
+			SCANS("#include <abc", "") && SCANS("#", "");
+}
+
+// vi: sw=4 ts=4 noet tw=80 cc=80
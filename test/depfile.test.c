@@ -0,0 +1,101 @@
+{.desc = "Makefile-style dependency file parsing"};
+
+#include <string.h>
+
+#include "../src/depfile.c"
+
+struct got { int n; const char *paths[16]; };
+
+// each word is unescaped over the top of itself, so paths handed to the
+// callback stay put for the rest of the parse and can just be pointed at
+static bool collect(const char *path, void *ctxt) {
+	struct got *g = ctxt;
+	if (g->n == sizeof(g->paths) / sizeof(*g->paths)) return false;
+	g->paths[g->n++] = path;
+	return true;
+}
+
+// parses a copy of s, since it's done in place, and compares what comes out
+// against the null-terminated list of paths in want
+static bool parses(const char *s, const char *const *want) {
+	char in[4096];
+	uint len = strlen(s);
+	if (len + 1 > sizeof(in)) return false;
+	memcpy(in, s, len);
+	struct got g = {0};
+	if (!depfile_parse(in, len, &collect, &g)) return false;
+	for (int i = 0; i < g.n; ++i) {
+		if (!want[i] || strcmp(g.paths[i], want[i])) return false;
+	}
+	return !want[g.n];
+}
+
+TEST("gcc -MD -MP output should give each prerequisite once") {
+	// as written by gcc 12 for a source file including "sub dir/a b.h",
+	// "c$d.h", "e#f.h" and <stdbool.h>
+	return parses(
+		"m.o: m.c /usr/include/stdc-predef.h "
+		"sub\\ dir/a\\ b.h c$$d.h e\\#f.h \\\n"
+		" /usr/lib/gcc/x86_64-linux-gnu/12/include/stdbool.h\n"
+		"/usr/include/stdc-predef.h:\n"
+		"sub\\ dir/a\\ b.h:\n"
+		"c$$d.h:\n"
+		"e\\#f.h:\n"
+		"/usr/lib/gcc/x86_64-linux-gnu/12/include/stdbool.h:\n",
+		(const char *const[]){
+			"m.c", "/usr/include/stdc-predef.h", "sub dir/a b.h", "c$d.h",
+			"e#f.h", "/usr/lib/gcc/x86_64-linux-gnu/12/include/stdbool.h", 0
+		});
+}
+
+TEST("clang -MD -MP output should give each prerequisite once") {
+	// clang puts each prerequisite on its own line, and blank lines between
+	// the phony rules
+	return parses(
+		"m.o: m.c \\\n"
+		"  sub\\ dir/a\\ b.h \\\n"
+		"  c$$d.h \\\n"
+		"  e\\#f.h\n"
+		"\n"
+		"sub\\ dir/a\\ b.h:\n"
+		"\n"
+		"c$$d.h:\n"
+		"\n"
+		"e\\#f.h:\n",
+		(const char *const[]){"m.c", "sub dir/a b.h", "c$d.h", "e#f.h", 0});
+}
+
+TEST("CRLF line endings and continuations should be handled") {
+	return parses(
+		"m.o: m.c \\\r\n"
+		"  a.h \\\r\n"
+		"  b.h\r\n"
+		"a.h:\r\n"
+		"b.h:\r\n",
+		(const char *const[]){"m.c", "a.h", "b.h", 0});
+}
+
+TEST("drive letter colons shouldn't be taken for rule separators") {
+	// what clang targeting Windows writes, give or take
+	return parses(
+		"C:/out/m.o: C:/src/m.c \\\r\n"
+		"  C:/Program\\ Files/x/y.h D:\\inc\\z.h\r\n"
+		"C:/Program\\ Files/x/y.h:\r\n",
+		(const char *const[]){
+			"C:/src/m.c", "C:/Program Files/x/y.h", "D:\\inc\\z.h", 0
+		});
+}
+
+TEST("multiple targets and a missing final newline should be fine") {
+	return parses("a.o b.o: a.c b.c",
+			(const char *const[]){"a.c", "b.c", 0});
+}
+
+static bool stop(const char *path, void *ctxt) { return false; }
+
+TEST("a failing callback should stop the parse") {
+	char in[] = "m.o: m.c a.h\n"; // the null terminator is the spare byte
+	return !depfile_parse(in, sizeof(in) - 1, &stop, 0);
+}
+
+// vi: sw=4 ts=4 noet tw=80 cc=80
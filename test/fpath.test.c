@@ -2,6 +2,8 @@
 
 #include <limits.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "../src/fpath.c"
 
@@ -49,4 +51,146 @@ TEST("canonicalisation should deduplicate slashes") {
 	return !strcmp(buf, "hello/world");
 }
 
+// fpath_canon() as it was before it learned to copy 16 bytes at a time; the
+// fast version has to give exactly the same answers
+static enum fpath_err bytewise_canon(const char *path, char *canon,
+		int *reldepth) {
+	if (*path == '\0') return FPATH_EMPTY;
+	if (*path == '/') return FPATH_ABSOLUTE;
+	int depth = 0;
+	const char *start = canon;
+	for (;;) {
+		switch (*path) {
+			case '\0': goto r;
+			case '/': goto slash;
+			case '.':
+				switch (*++path) {
+					case '/': goto nosl; // skip ./, it does nothing
+					case '.':
+						switch (*++path) {
+							case '/':
+								if (--depth < 0) return FPATH_OUTSIDE;
+								canon -= 2; // point right before the slash
+								// go back to the start of the component, to
+								// overwrite with the next component of path
+								while (canon != start && canon[-1] != '/') {
+									--canon;
+								}
+								goto nosl;
+							case '\0':
+								if (--depth < 0) return FPATH_OUTSIDE;
+								canon -= 2; // point right before the slash
+								// go back to the slash _before_ the start of
+								// the component
+								while (canon != start && *canon != '/') --canon;
+								// special case: project root/base dir
+								if (canon == start) *canon++ = '.';
+								goto r;
+							default:
+								*canon++ = '.'; *canon++ = '.';
+								*canon++ = *path;
+								goto mid;
+						}
+					case '\0':
+						// special case: project root/base dir
+						if (canon == start) *canon++ = '.';
+						else --canon; // otherwise same as ./ (remove the /)
+						goto r;
+					default:
+						*canon++ = '.';
+						*canon++ = *path;
+						goto mid;
+				}
+			default:
+				*canon++ = *path;
+				goto mid;
+		}
+mid:	for (;;) {
+			switch (*++path) {
+				case '/': goto slash;
+				case '\0': goto r;
+				default: *canon++ = *path;
+			}
+		}
+slash:	++depth;
+		*canon++ = '/';
+nosl:	while (*++path == '/');
+		if (!*path) return FPATH_TRAILSLASH;
+	}
+r:	if (canon == start) return FPATH_EMPTY;
+	*canon = '\0';
+	if (reldepth) *reldepth = depth;
+	return FPATH_OK;
+}
+
+static uint rngstate = 1;
+static uint rng(void) { // xorshift, just to have the same paths every time
+	rngstate ^= rngstate << 13;
+	rngstate ^= rngstate >> 17;
+	rngstate ^= rngstate << 5;
+	return rngstate;
+}
+
+// makes up a path out of the sorts of components that take fpath_canon() down
+// each of its different branches, with the odd long one spanning a few 16-byte
+// chunks. the result is at most 600 or so bytes
+static uint randpath(char *buf) {
+	static const char *const odd[] = {"", ".", "..", "...", ".x", "..x"};
+	uint n = 0, ncomps = 1 + rng() % 8;
+	for (uint i = 0; i < ncomps; ++i) {
+		if (i) buf[n++] = '/';
+		if (rng() % 3 == 0) {
+			const char *s = odd[rng() % (sizeof(odd) / sizeof(*odd))];
+			memcpy(buf + n, s, strlen(s));
+			n += strlen(s);
+		}
+		else {
+			uint len = 1 + rng() % (rng() % 4 ? 12 : 60);
+			for (uint j = 0; j < len; ++j) buf[n++] = "abcdefgh._-"[rng() % 11];
+		}
+	}
+	if (rng() % 8 == 0) buf[n++] = '/';
+	buf[n] = '\0';
+	return n;
+}
+
+static bool sameresult(const char *path, char *canon) {
+	char expect[1024];
+	int depth, expectdepth;
+	enum fpath_err err = fpath_canon(path, canon, &depth);
+	if (err != bytewise_canon(path, expect, &expectdepth)) return false;
+	if (err != FPATH_OK) return true; // canon is junk either way
+	return !strcmp(canon, expect) && depth == expectdepth;
+}
+
+TEST("canonicalisation should match the byte-at-a-time version") {
+	char path[1024], canon[1024];
+	for (int i = 0; i < 200000; ++i) {
+		randpath(path);
+		if (!sameresult(path, canon)) return false;
+	}
+	return true;
+}
+
+TEST("canonicalisation shouldn't go past the end of either buffer") {
+	// put each path right up against an inaccessible page, and likewise for
+	// the smallest allowable output buffer, so going past either end faults
+	long pgsz = sysconf(_SC_PAGESIZE);
+	char *in = mmap(0, pgsz * 2, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	char *out = mmap(0, pgsz * 2, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (in == MAP_FAILED || out == MAP_FAILED) return false;
+	if (mprotect(in + pgsz, pgsz, PROT_NONE) == -1) return false;
+	if (mprotect(out + pgsz, pgsz, PROT_NONE) == -1) return false;
+	char path[1024];
+	for (int i = 0; i < 20000; ++i) {
+		uint len = randpath(path);
+		char *p = in + pgsz - len - 1;
+		memcpy(p, path, len + 1);
+		if (!sameresult(p, out + pgsz - len - 1)) return false;
+	}
+	return true;
+}
+
 // vi: sw=4 ts=4 noet tw=80 cc=80